@@ -0,0 +1,1057 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assembler.h"
+#include "registers.h"
+
+// Assembly happens in two passes over the source.  The first works out the
+// address of every label, the second writes out the instructions and data.
+// Both run the same code; the first just doesn't write anything, and treats
+// labels it hasn't seen yet as 0.  Pseudo-instructions always expand to the
+// same number of instructions in both passes.
+
+#define MAX_LINE_LENGTH 4096
+#define MAX_OPERANDS 4
+
+// The text segment has to end before the data segment starts, and the data
+// segment before the lowest address the stack can grow down to
+#define TEXT_SEGMENT_END DATA_SEGMENT_ADDRESS
+#define DATA_SEGMENT_END 0x7F000000
+
+#define R_TYPE(s, t, d, shift, funct)                                       \
+    (((uint32_t)(s) << 21) | ((uint32_t)(t) << 16) | ((uint32_t)(d) << 11) | \
+     ((uint32_t)(shift) << 6) | (uint32_t)(funct))
+#define I_TYPE(opcode, s, t, imm)                                           \
+    (((uint32_t)(opcode) << 26) | ((uint32_t)(s) << 21) |                   \
+     ((uint32_t)(t) << 16) | ((uint32_t)(imm) & 0xFFFF))
+
+#define OPCODE_SPECIAL2 0x1C
+#define OPCODE_REGIMM 0x01
+
+typedef struct assembler {
+    const char *source_name;
+    int line_number;
+    int pass;
+    int n_errors;
+    int in_text;
+    uint32_t text_next;     // address the next instruction goes at
+    uint32_t data_next;     // address the next byte of data goes at
+    uint32_t symbols_capacity;
+    program_image_t *image;
+} assembler_t;
+
+typedef enum operand_kind {
+    o_register,             // $t0
+    o_immediate,            // 42, -1, 0x10, 'a'
+    o_label,                // loop, numbers+4
+    o_memory                // 4($sp), ($t1), numbers($t0)
+} operand_kind_t;
+
+typedef struct operand {
+    operand_kind_t kind;
+    int reg;                // the register, or the base register of o_memory
+    int32_t value;          // the immediate, or the address of a label
+    int has_label;          // whether an o_memory offset is a label
+} operand_t;
+
+// Instructions of the form `add $d, $s, $t', which can also be given an
+// immediate instead of $t
+static const struct {
+    const char *name;
+    uint32_t opcode;
+    uint32_t funct;
+    uint32_t immediate_opcode;  // I-type equivalent, 0 if there isn't one
+    int negate_immediate;       // sub $d, $s, I is addi $d, $s, -I
+} three_register[] = {
+    { "add",  0x00, 0x20, 0x08, 0 },
+    { "addu", 0x00, 0x20, 0x08, 0 },
+    { "sub",  0x00, 0x22, 0x08, 1 },
+    { "subu", 0x00, 0x22, 0x08, 1 },
+    { "mul",  OPCODE_SPECIAL2, 0x02, 0x00, 0 },
+    { "and",  0x00, 0x24, 0x0C, 0 },
+    { "or",   0x00, 0x25, 0x0D, 0 },
+    { "xor",  0x00, 0x26, 0x0E, 0 },
+    { "slt",  0x00, 0x2A, 0x0A, 0 },
+};
+
+// Instructions of the form `addi $t, $s, I'
+static const struct {
+    const char *name;
+    uint32_t opcode;
+    uint32_t funct;             // R-type equivalent, for immediates too big
+} immediate_arithmetic[] = {
+    { "addi",  0x08, 0x20 },
+    { "addiu", 0x08, 0x20 },
+    { "andi",  0x0C, 0x24 },
+    { "ori",   0x0D, 0x25 },
+    { "xori",  0x0E, 0x26 },
+    { "slti",  0x0A, 0x2A },
+};
+
+static const struct {
+    const char *name;
+    uint32_t opcode;
+} load_store[] = {
+    { "lb", 0x20 }, { "lh", 0x21 }, { "lw", 0x23 },
+    { "sb", 0x28 }, { "sh", 0x29 }, { "sw", 0x2B },
+};
+
+// Branches comparing a register with zero
+static const struct {
+    const char *name;
+    uint32_t opcode;
+    uint32_t t;
+} branch_zero[] = {
+    { "blez", 0x06, 0 }, { "bgtz", 0x07, 0 },
+    { "bltz", OPCODE_REGIMM, 0 }, { "bgez", OPCODE_REGIMM, 1 },
+};
+
+// Pseudo-instruction branches, made from slt and beq/bne
+static const struct {
+    const char *name;
+    int swap;                   // slt $at, $t, $s instead of slt $at, $s, $t
+    uint32_t branch_opcode;
+} branch_compare[] = {
+    { "blt", 0, 0x05 }, { "bgt", 1, 0x05 },
+    { "bge", 0, 0x04 }, { "ble", 1, 0x04 },
+};
+
+#define N_ELEMENTS(array) (sizeof (array) / sizeof (array)[0])
+
+static void assemble_pass(assembler_t *a, const char *source, size_t length);
+static void assemble_line(assembler_t *a, char *line);
+static void assemble_directive(assembler_t *a, const char *directive,
+                               char *rest);
+static void assemble_instruction(assembler_t *a, const char *mnemonic,
+                                 char *rest);
+static void error(assembler_t *a, const char *format, ...);
+
+static void define_label(assembler_t *a, const char *name);
+static int find_label(assembler_t *a, const char *name, uint32_t *address);
+static void align_data(assembler_t *a, uint32_t alignment);
+
+static void emit_instruction(assembler_t *a, uint32_t instruction);
+static void emit_branch(assembler_t *a, uint32_t instruction,
+                        uint32_t target);
+static void emit_data_byte(assembler_t *a, uint8_t byte);
+static void emit_data(assembler_t *a, uint32_t value, int n_bytes);
+static void emit_load_immediate(assembler_t *a, int reg, uint32_t value,
+                                int always_two);
+
+static char *strip_comment(char *line);
+static char *skip_space(char *s);
+static int read_identifier(char **s, char *name, size_t size);
+static int split_operands(assembler_t *a, char *rest, char *tokens[],
+                          int max_tokens);
+static int parse_operand(assembler_t *a, char *token, operand_t *operand);
+static int parse_register(assembler_t *a, const char *token);
+static int parse_expression(assembler_t *a, char *text, int32_t *value,
+                            int *is_label);
+static int parse_char(char **s, int quote, int *c);
+static int check_operands(assembler_t *a, const char *mnemonic,
+                          operand_t operands[], int n_operands,
+                          const char *kinds);
+
+static int fits_signed_16(int32_t value);
+static uint32_t segment_room(const assembler_t *a);
+
+int assemble_program(const char *source_name, const char *source,
+                     size_t length, program_image_t *image) {
+    memset(image, 0, sizeof *image);
+    image->text_address = TEXT_SEGMENT_ADDRESS;
+    image->data_address = DATA_SEGMENT_ADDRESS;
+
+    assembler_t a = {
+        .source_name = source_name,
+        .image = image,
+    };
+
+    a.pass = 1;
+    assemble_pass(&a, source, length);
+    if (a.n_errors == 0) {
+        image->text_length = a.text_next - TEXT_SEGMENT_ADDRESS;
+        image->data_length = a.data_next - DATA_SEGMENT_ADDRESS;
+        image->text = calloc(image->text_length + 1, 1);
+        image->data = calloc(image->data_length + 1, 1);
+        if (image->text == NULL || image->data == NULL) {
+            error(&a, "out of memory");
+        } else {
+            a.pass = 2;
+            assemble_pass(&a, source, length);
+        }
+    }
+
+    if (a.n_errors != 0) {
+        free_program_image(image);
+        return -1;
+    }
+    return 0;
+}
+
+static void assemble_pass(assembler_t *a, const char *source, size_t length) {
+    a->line_number = 0;
+    a->in_text = 1;
+    a->text_next = TEXT_SEGMENT_ADDRESS;
+    a->data_next = DATA_SEGMENT_ADDRESS;
+
+    const char *end = source + length;
+    const char *next = source;
+    while (next < end) {
+        const char *newline = memchr(next, '\n', end - next);
+        size_t line_length = (newline ? newline : end) - next;
+        a->line_number++;
+
+        char line[MAX_LINE_LENGTH];
+        if (line_length >= sizeof line) {
+            error(a, "line too long");
+        } else {
+            memcpy(line, next, line_length);
+            line[line_length] = '\0';
+            assemble_line(a, line);
+        }
+        next += line_length + 1;
+    }
+}
+
+static void assemble_line(assembler_t *a, char *line) {
+    char *s = skip_space(strip_comment(line));
+
+    // any number of labels can start a line
+    char labels[MAX_OPERANDS][MAX_LINE_LENGTH];
+    int n_labels = 0;
+    for (;;) {
+        char *after = s;
+        char name[MAX_LINE_LENGTH];
+        if (!read_identifier(&after, name, sizeof name)) {
+            break;
+        }
+        after = skip_space(after);
+        if (*after != ':') {
+            break;
+        }
+        if (n_labels == MAX_OPERANDS) {
+            error(a, "too many labels");
+            return;
+        }
+        strcpy(labels[n_labels++], name);
+        s = skip_space(after + 1);
+    }
+
+    char word[MAX_LINE_LENGTH];
+    char *rest = s;
+    int have_word = read_identifier(&rest, word, sizeof word);
+    if (*s != '\0' && !have_word) {
+        error(a, "syntax error");
+        return;
+    }
+
+    // like SPIM, labels on a .word or .half go after the padding
+    if (!a->in_text && have_word) {
+        if (strcmp(word, ".word") == 0) {
+            align_data(a, 4);
+        } else if (strcmp(word, ".half") == 0) {
+            align_data(a, 2);
+        }
+    }
+    for (int l = 0; l < n_labels; l++) {
+        define_label(a, labels[l]);
+    }
+
+    if (!have_word) {
+        return;
+    }
+    if (word[0] == '.') {
+        assemble_directive(a, word, rest);
+    } else {
+        assemble_instruction(a, word, rest);
+    }
+}
+
+static void assemble_directive(assembler_t *a, const char *directive,
+                               char *rest) {
+    rest = skip_space(rest);
+
+    if (strcmp(directive, ".text") == 0) {
+        a->in_text = 1;
+    } else if (strcmp(directive, ".data") == 0) {
+        a->in_text = 0;
+    } else if (strcmp(directive, ".globl") == 0 ||
+               strcmp(directive, ".global") == 0 ||
+               strcmp(directive, ".extern") == 0) {
+        // only one file, nothing to do
+    } else if (strcmp(directive, ".word") == 0 ||
+               strcmp(directive, ".half") == 0 ||
+               strcmp(directive, ".byte") == 0) {
+        int n_bytes = directive[1] == 'w' ? 4 : directive[1] == 'h' ? 2 : 1;
+        if (a->in_text && n_bytes != 4) {
+            error(a, "%s is not allowed in the text segment", directive);
+            return;
+        }
+
+        char *tokens[MAX_LINE_LENGTH / 2];
+        int n_tokens = split_operands(a, rest, tokens, N_ELEMENTS(tokens));
+        if (n_tokens < 0) {
+            return;
+        }
+        if (n_tokens == 0) {
+            error(a, "%s needs a value", directive);
+        }
+        for (int i = 0; i < n_tokens; i++) {
+            // value:count repeats a value
+            uint32_t repeats = 1;
+            char *colon = strchr(tokens[i], ':');
+            if (colon != NULL && tokens[i][0] != '\'') {
+                *colon = '\0';
+                int32_t count;
+                int is_label;
+                if (!parse_expression(a, colon + 1, &count, &is_label)) {
+                    return;
+                }
+                if (is_label || count <= 0 ||
+                    (uint32_t)count > segment_room(a) / n_bytes) {
+                    error(a, "bad repeat count '%s'", colon + 1);
+                    return;
+                }
+                repeats = count;
+            }
+
+            int32_t value;
+            int is_label;
+            if (!parse_expression(a, tokens[i], &value, &is_label)) {
+                return;
+            }
+            for (uint32_t r = 0; r < repeats; r++) {
+                if (a->in_text) {
+                    emit_instruction(a, value);
+                } else {
+                    emit_data(a, value, n_bytes);
+                }
+            }
+        }
+    } else if (a->in_text) {
+        error(a, "%s is not allowed in the text segment", directive);
+    } else if (strcmp(directive, ".space") == 0) {
+        int32_t n_bytes;
+        int is_label;
+        if (!parse_expression(a, rest, &n_bytes, &is_label)) {
+            return;
+        }
+        if (n_bytes < 0) {
+            error(a, "negative .space");
+            return;
+        }
+        if ((uint32_t)n_bytes > segment_room(a)) {
+            error(a, ".space too big for the data segment");
+            return;
+        }
+        for (int32_t b = 0; b < n_bytes; b++) {
+            emit_data_byte(a, 0);
+        }
+    } else if (strcmp(directive, ".align") == 0) {
+        int32_t power;
+        int is_label;
+        if (!parse_expression(a, rest, &power, &is_label)) {
+            return;
+        }
+        if (power < 0 || power > 16) {
+            error(a, "bad .align");
+            return;
+        }
+        align_data(a, 1u << power);
+    } else if (strcmp(directive, ".ascii") == 0 ||
+               strcmp(directive, ".asciiz") == 0) {
+        char *s = rest;
+        do {
+            s = skip_space(s);
+            if (*s != '"') {
+                error(a, "%s needs a string", directive);
+                return;
+            }
+            s++;
+            while (*s != '"') {
+                int c;
+                if (!parse_char(&s, '"', &c)) {
+                    error(a, "unterminated string");
+                    return;
+                }
+                emit_data_byte(a, c);
+            }
+            s = skip_space(s + 1);
+            if (directive[6] == 'z') {
+                emit_data_byte(a, '\0');
+            }
+        } while (*s == ',' && s++);
+        if (*s != '\0') {
+            error(a, "unexpected '%s'", s);
+        }
+    } else {
+        error(a, "unknown directive %s", directive);
+    }
+}
+
+static void assemble_instruction(assembler_t *a, const char *mnemonic,
+                                 char *rest) {
+    if (!a->in_text) {
+        error(a, "instruction %s in the data segment", mnemonic);
+        return;
+    }
+
+    char *tokens[MAX_OPERANDS];
+    int n = split_operands(a, rest, tokens, MAX_OPERANDS);
+    if (n < 0) {
+        return;
+    }
+    operand_t o[MAX_OPERANDS];
+    for (int i = 0; i < n; i++) {
+        if (!parse_operand(a, tokens[i], &o[i])) {
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(three_register); i++) {
+        if (strcmp(mnemonic, three_register[i].name) != 0) {
+            continue;
+        }
+        // add $d, $s is add $d, $d, $s
+        if (n == 2 && o[1].kind != o_memory) {
+            o[2] = o[1];
+            o[1] = o[0];
+            n = 3;
+        }
+        if (!check_operands(a, mnemonic, o, n, "rrx")) {
+            return;
+        }
+
+        uint32_t t = o[2].reg;
+        if (o[2].kind != o_register) {
+            int32_t value = o[2].value;
+            if (three_register[i].negate_immediate) {
+                value = -(uint32_t)value;
+            }
+            // andi/ori/xori sign-extend their immediate in this emulator,
+            // so only use them for values where that doesn't matter
+            uint32_t opcode = three_register[i].immediate_opcode;
+            int fits = opcode == 0x08 || opcode == 0x0A ?
+                fits_signed_16(value) : (value >= 0 && value <= 0x7FFF);
+            if (opcode != 0 && fits && o[2].kind != o_label) {
+                emit_instruction(a, I_TYPE(opcode, o[1].reg, o[0].reg, value));
+                return;
+            }
+            emit_load_immediate(a, at, o[2].value, o[2].kind == o_label);
+            t = at;
+        }
+        emit_instruction(a, (three_register[i].opcode << 26) |
+                            R_TYPE(o[1].reg, t, o[0].reg, 0,
+                                   three_register[i].funct));
+        return;
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(immediate_arithmetic); i++) {
+        if (strcmp(mnemonic, immediate_arithmetic[i].name) != 0) {
+            continue;
+        }
+        if (n == 2) {
+            o[2] = o[1];
+            o[1] = o[0];
+            n = 3;
+        }
+        if (!check_operands(a, mnemonic, o, n, "rri")) {
+            return;
+        }
+        // every immediate is sign-extended in this emulator, andi/ori/xori's
+        // too, so anything outside that range goes through $at
+        int32_t value = o[2].value;
+        if (fits_signed_16(value) && o[2].kind != o_label) {
+            emit_instruction(a, I_TYPE(immediate_arithmetic[i].opcode,
+                                       o[1].reg, o[0].reg, value));
+        } else {
+            emit_load_immediate(a, at, value, o[2].kind == o_label);
+            emit_instruction(a, R_TYPE(o[1].reg, at, o[0].reg, 0,
+                                       immediate_arithmetic[i].funct));
+        }
+        return;
+    }
+
+    if (strcmp(mnemonic, "sll") == 0 || strcmp(mnemonic, "srl") == 0 ||
+        strcmp(mnemonic, "sllv") == 0 || strcmp(mnemonic, "srlv") == 0) {
+        if (!check_operands(a, mnemonic, o, n, "rrx")) {
+            return;
+        }
+        int left = mnemonic[1] == 'l';
+        if (o[2].kind == o_register) {
+            emit_instruction(a, R_TYPE(o[2].reg, o[1].reg, o[0].reg, 0,
+                                       left ? 0x04 : 0x06));
+        } else if (strlen(mnemonic) == 4) {
+            error(a, "%s needs a register shift amount", mnemonic);
+        } else if (o[2].value < 0 || o[2].value > 31) {
+            error(a, "shift amount out of range");
+        } else {
+            emit_instruction(a, R_TYPE(0, o[1].reg, o[0].reg, o[2].value,
+                                       left ? 0x00 : 0x02));
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(load_store); i++) {
+        if (strcmp(mnemonic, load_store[i].name) != 0) {
+            continue;
+        }
+        if (!check_operands(a, mnemonic, o, n, "rm")) {
+            return;
+        }
+        uint32_t opcode = load_store[i].opcode;
+        if (o[1].kind == o_memory && !o[1].has_label &&
+            fits_signed_16(o[1].value)) {
+            emit_instruction(a, I_TYPE(opcode, o[1].reg, o[0].reg,
+                                       o[1].value));
+            return;
+        }
+
+        // lui $at, %hi(address); [add $at, $at, $base]; op $t, %lo($at)
+        uint32_t address = o[1].value;
+        emit_instruction(a, I_TYPE(0x0F, 0, at, (address + 0x8000) >> 16));
+        if (o[1].kind == o_memory) {
+            emit_instruction(a, R_TYPE(at, o[1].reg, at, 0, 0x20));
+        }
+        emit_instruction(a, I_TYPE(opcode, at, o[0].reg, address));
+        return;
+    }
+
+    if (strcmp(mnemonic, "beq") == 0 || strcmp(mnemonic, "bne") == 0) {
+        if (!check_operands(a, mnemonic, o, n, "rxl")) {
+            return;
+        }
+        uint32_t t = o[1].reg;
+        if (o[1].kind != o_register) {
+            emit_load_immediate(a, at, o[1].value, o[1].kind == o_label);
+            t = at;
+        }
+        uint32_t opcode = mnemonic[1] == 'e' ? 0x04 : 0x05;
+        emit_branch(a, I_TYPE(opcode, o[0].reg, t, 0), o[2].value);
+        return;
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(branch_zero); i++) {
+        if (strcmp(mnemonic, branch_zero[i].name) != 0) {
+            continue;
+        }
+        if (!check_operands(a, mnemonic, o, n, "rl")) {
+            return;
+        }
+        emit_branch(a, I_TYPE(branch_zero[i].opcode, o[0].reg,
+                              branch_zero[i].t, 0), o[1].value);
+        return;
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(branch_compare); i++) {
+        if (strcmp(mnemonic, branch_compare[i].name) != 0) {
+            continue;
+        }
+        if (!check_operands(a, mnemonic, o, n, "rxl")) {
+            return;
+        }
+        uint32_t s = o[0].reg;
+        uint32_t t = o[1].reg;
+        if (o[1].kind != o_register) {
+            emit_load_immediate(a, at, o[1].value, o[1].kind == o_label);
+            t = at;
+        }
+        if (branch_compare[i].swap) {
+            emit_instruction(a, R_TYPE(t, s, at, 0, 0x2A));
+        } else {
+            emit_instruction(a, R_TYPE(s, t, at, 0, 0x2A));
+        }
+        emit_branch(a, I_TYPE(branch_compare[i].branch_opcode, at, zero, 0),
+                    o[2].value);
+        return;
+    }
+
+    if (strcmp(mnemonic, "beqz") == 0 || strcmp(mnemonic, "bnez") == 0) {
+        if (!check_operands(a, mnemonic, o, n, "rl")) {
+            return;
+        }
+        uint32_t opcode = mnemonic[1] == 'e' ? 0x04 : 0x05;
+        emit_branch(a, I_TYPE(opcode, o[0].reg, zero, 0), o[1].value);
+    } else if (strcmp(mnemonic, "b") == 0) {
+        // bgez $zero, label
+        if (check_operands(a, mnemonic, o, n, "l")) {
+            emit_branch(a, I_TYPE(OPCODE_REGIMM, zero, 1, 0), o[0].value);
+        }
+    } else if (strcmp(mnemonic, "j") == 0 || strcmp(mnemonic, "jal") == 0) {
+        if (check_operands(a, mnemonic, o, n, "l")) {
+            uint32_t opcode = mnemonic[1] == 'a' ? 0x03 : 0x02;
+            emit_instruction(a, (opcode << 26) |
+                                (((uint32_t)o[0].value >> 2) & 0x03FFFFFF));
+        }
+    } else if (strcmp(mnemonic, "jr") == 0) {
+        if (check_operands(a, mnemonic, o, n, "r")) {
+            emit_instruction(a, R_TYPE(o[0].reg, 0, 0, 0, 0x08));
+        }
+    } else if (strcmp(mnemonic, "lui") == 0) {
+        if (check_operands(a, mnemonic, o, n, "ri")) {
+            emit_instruction(a, I_TYPE(0x0F, 0, o[0].reg, o[1].value));
+        }
+    } else if (strcmp(mnemonic, "li") == 0) {
+        // a label's address may not be known in the first pass, so it
+        // always takes two instructions, like la
+        if (check_operands(a, mnemonic, o, n, "ri")) {
+            emit_load_immediate(a, o[0].reg, o[1].value,
+                                o[1].kind == o_label);
+        }
+    } else if (strcmp(mnemonic, "la") == 0) {
+        // labels' addresses aren't known in the first pass, so always use
+        // two instructions
+        if (check_operands(a, mnemonic, o, n, "ri")) {
+            emit_load_immediate(a, o[0].reg, o[1].value, 1);
+        }
+    } else if (strcmp(mnemonic, "move") == 0) {
+        // add $d, $zero, $s
+        if (check_operands(a, mnemonic, o, n, "rr")) {
+            emit_instruction(a, R_TYPE(zero, o[1].reg, o[0].reg, 0, 0x20));
+        }
+    } else if (strcmp(mnemonic, "neg") == 0) {
+        // sub $d, $zero, $s
+        if (check_operands(a, mnemonic, o, n, "rr")) {
+            emit_instruction(a, R_TYPE(zero, o[1].reg, o[0].reg, 0, 0x22));
+        }
+    } else if (strcmp(mnemonic, "syscall") == 0) {
+        if (check_operands(a, mnemonic, o, n, "")) {
+            emit_instruction(a, 0x0000000C);
+        }
+    } else if (strcmp(mnemonic, "nop") == 0) {
+        if (check_operands(a, mnemonic, o, n, "")) {
+            emit_instruction(a, 0x00000000);
+        }
+    } else {
+        error(a, "unknown instruction %s", mnemonic);
+    }
+}
+
+static void error(assembler_t *a, const char *format, ...) {
+    // the same errors come up in both passes, only report them once
+    if (a->pass == 1 || a->n_errors == 0) {
+        fprintf(stderr, "%s:%d: ", a->source_name, a->line_number);
+        va_list arguments;
+        va_start(arguments, format);
+        vfprintf(stderr, format, arguments);
+        va_end(arguments);
+        fputc('\n', stderr);
+    }
+    a->n_errors++;
+}
+
+static void define_label(assembler_t *a, const char *name) {
+    if (a->pass == 2) {
+        return;
+    }
+
+    uint32_t address;
+    if (find_label(a, name, &address)) {
+        error(a, "label %s defined twice", name);
+        return;
+    }
+
+    program_image_t *image = a->image;
+    if (image->n_symbols == a->symbols_capacity) {
+        a->symbols_capacity = a->symbols_capacity ? 2 * a->symbols_capacity
+                                                  : 64;
+        program_symbol_t *symbols = realloc(
+            image->symbols, a->symbols_capacity * sizeof *symbols);
+        if (symbols == NULL) {
+            error(a, "out of memory");
+            return;
+        }
+        image->symbols = symbols;
+    }
+    program_symbol_t *symbol = &image->symbols[image->n_symbols];
+    symbol->name = strdup(name);
+    symbol->address = a->in_text ? a->text_next : a->data_next;
+    if (symbol->name == NULL) {
+        error(a, "out of memory");
+        return;
+    }
+    image->n_symbols++;
+}
+
+static int find_label(assembler_t *a, const char *name, uint32_t *address) {
+    for (uint32_t i = 0; i < a->image->n_symbols; i++) {
+        if (strcmp(a->image->symbols[i].name, name) == 0) {
+            *address = a->image->symbols[i].address;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void align_data(assembler_t *a, uint32_t alignment) {
+    while (a->data_next % alignment != 0) {
+        emit_data_byte(a, 0);
+    }
+}
+
+static void emit_instruction(assembler_t *a, uint32_t instruction) {
+    if (a->text_next % 4 != 0) {
+        error(a, "misaligned instruction");
+        return;
+    }
+    if (a->pass == 2) {
+        uint8_t *bytes = &a->image->text[a->text_next - TEXT_SEGMENT_ADDRESS];
+        for (int b = 0; b < 4; b++) {
+            bytes[b] = instruction >> (b * 8);
+        }
+    }
+    a->text_next += 4;
+}
+
+// Branches are relative to the address of the branch itself
+static void emit_branch(assembler_t *a, uint32_t instruction,
+                        uint32_t target) {
+    int32_t offset = (int32_t)(target - a->text_next) / 4;
+    if (a->pass == 2 && (target % 4 != 0 || !fits_signed_16(offset))) {
+        error(a, "branch target out of range");
+    }
+    emit_instruction(a, instruction | (offset & 0xFFFF));
+}
+
+static void emit_data_byte(assembler_t *a, uint8_t byte) {
+    if (a->pass == 2) {
+        a->image->data[a->data_next - DATA_SEGMENT_ADDRESS] = byte;
+    }
+    a->data_next++;
+}
+
+static void emit_data(assembler_t *a, uint32_t value, int n_bytes) {
+    for (int b = 0; b < n_bytes; b++) {
+        emit_data_byte(a, value >> (b * 8));
+    }
+}
+
+// li/la: ori for small positive values and addi for small negative values,
+// otherwise lui $at plus ori, or addi when the low half would be sign-extended
+static void emit_load_immediate(assembler_t *a, int reg, uint32_t value,
+                                int always_two) {
+    int32_t signed_value = value;
+    if (!always_two && signed_value >= 0 && signed_value <= 0x7FFF) {
+        emit_instruction(a, I_TYPE(0x0D, zero, reg, value));
+    } else if (!always_two && fits_signed_16(signed_value)) {
+        emit_instruction(a, I_TYPE(0x08, zero, reg, value));
+    } else if ((value & 0x8000) == 0) {
+        emit_instruction(a, I_TYPE(0x0F, 0, at, value >> 16));
+        emit_instruction(a, I_TYPE(0x0D, at, reg, value));
+    } else {
+        emit_instruction(a, I_TYPE(0x0F, 0, at, (value >> 16) + 1));
+        emit_instruction(a, I_TYPE(0x08, at, reg, value));
+    }
+}
+
+// Cuts a line off at a '#' that isn't inside quotes
+static char *strip_comment(char *line) {
+    int quote = 0;
+    for (char *c = line; *c != '\0'; c++) {
+        if (quote && *c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (quote && *c == quote) {
+            quote = 0;
+        } else if (!quote && (*c == '"' || *c == '\'')) {
+            quote = *c;
+        } else if (!quote && *c == '#') {
+            *c = '\0';
+            break;
+        }
+    }
+    return line;
+}
+
+static char *skip_space(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    return s;
+}
+
+// Reads a label, mnemonic or directive name, returning 0 if there isn't one
+static int read_identifier(char **s, char *name, size_t size) {
+    char *c = *s;
+    if (!isalpha((unsigned char)*c) && *c != '_' && *c != '.') {
+        return 0;
+    }
+    size_t n = 0;
+    while (isalnum((unsigned char)*c) || *c == '_' || *c == '.') {
+        if (n + 1 < size) {
+            name[n++] = *c;
+        }
+        c++;
+    }
+    name[n] = '\0';
+    *s = c;
+    return 1;
+}
+
+// Splits operands separated by commas and/or spaces, keeping quoted
+// characters and `offset ($reg)' together.  Returns how many there are, or
+// -1 after reporting an error, including when there are more than
+// max_tokens.
+static int split_operands(assembler_t *a, char *rest, char *tokens[],
+                          int max_tokens) {
+    int n = 0;
+    char *s = rest;
+    for (;;) {
+        while (isspace((unsigned char)*s) || *s == ',') {
+            s++;
+        }
+        if (*s == '\0') {
+            return n;
+        }
+        if (n == max_tokens) {
+            error(a, "too many operands");
+            return -1;
+        }
+
+        char *start = s;
+        int depth = 0;
+        while (*s != '\0') {
+            if (*s == '\'') {
+                int c;
+                s++;
+                if (!parse_char(&s, '\'', &c) || *s != '\'') {
+                    error(a, "bad character constant");
+                    return -1;
+                }
+                s++;
+                continue;
+            }
+            if (*s == '(') {
+                depth++;
+            } else if (*s == ')') {
+                depth--;
+            } else if (depth == 0 && (*s == ',' || isspace((unsigned char)*s))) {
+                // `4 ($t0)' is one operand
+                char *next = skip_space(s);
+                if (*next != '(') {
+                    break;
+                }
+                s = next;
+                continue;
+            }
+            s++;
+        }
+
+        int at_end = *s == '\0';
+        *s = '\0';
+        tokens[n++] = start;
+        if (at_end) {
+            return n;
+        }
+        s++;
+    }
+}
+
+static int parse_operand(assembler_t *a, char *token, operand_t *operand) {
+    memset(operand, 0, sizeof *operand);
+
+    char *open = strchr(token, '(');
+    if (open != NULL) {
+        char *close = strchr(open, ')');
+        if (close == NULL || *skip_space(close + 1) != '\0') {
+            error(a, "bad operand '%s'", token);
+            return 0;
+        }
+        *open = '\0';
+        *close = '\0';
+        operand->kind = o_memory;
+        char *base = skip_space(open + 1);
+        char *end = base + strlen(base);
+        while (end > base && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        operand->reg = parse_register(a, base);
+        if (operand->reg < 0) {
+            return 0;
+        }
+        char *offset = skip_space(token);
+        if (*offset == '\0') {
+            return 1;
+        }
+        return parse_expression(a, offset, &operand->value,
+                                &operand->has_label);
+    }
+
+    if (token[0] == '$') {
+        operand->kind = o_register;
+        operand->reg = parse_register(a, token);
+        return operand->reg >= 0;
+    }
+
+    int is_label;
+    if (!parse_expression(a, token, &operand->value, &is_label)) {
+        return 0;
+    }
+    operand->kind = is_label ? o_label : o_immediate;
+    return 1;
+}
+
+static int parse_register(assembler_t *a, const char *token) {
+    if (token[0] == '$' && isdigit((unsigned char)token[1])) {
+        char *end;
+        long number = strtol(token + 1, &end, 10);
+        if (*end == '\0' && number >= 0 && number < N_REGISTERS) {
+            return number;
+        }
+    }
+    for (int r = 0; r < N_REGISTERS; r++) {
+        if (strcmp(token, register_name_map[r]) == 0) {
+            return r;
+        }
+    }
+    if (strcmp(token, "$s8") == 0) {
+        return fp;
+    }
+    error(a, "unknown register '%s'", token);
+    return -1;
+}
+
+// Parses a number, a character constant, or a label optionally followed by
+// + or - a number
+static int parse_expression(assembler_t *a, char *text, int32_t *value,
+                            int *is_label) {
+    char *s = skip_space(text);
+    *is_label = 0;
+    long long result = 0;
+
+    if (*s == '\'') {
+        int c;
+        s++;
+        if (!parse_char(&s, '\'', &c) || *s != '\'') {
+            error(a, "bad character constant");
+            return 0;
+        }
+        result = c;
+        s++;
+    } else if (isalpha((unsigned char)*s) || *s == '_') {
+        char name[MAX_LINE_LENGTH];
+        read_identifier(&s, name, sizeof name);
+        uint32_t address = 0;
+        if (!find_label(a, name, &address) && a->pass == 2) {
+            error(a, "undefined label %s", name);
+            return 0;
+        }
+        *is_label = 1;
+        result = address;
+        s = skip_space(s);
+        if (*s == '+' || *s == '-') {
+            int32_t offset;
+            int offset_is_label;
+            int negative = *s == '-';
+            if (!parse_expression(a, s + 1, &offset, &offset_is_label) ||
+                offset_is_label) {
+                error(a, "bad offset from label %s", name);
+                return 0;
+            }
+            result += negative ? -(long long)offset : offset;
+            s += strlen(s);
+        }
+    } else {
+        int negative = 0;
+        if (*s == '-' || *s == '+') {
+            negative = *s == '-';
+            s++;
+        }
+        if (!isdigit((unsigned char)*s)) {
+            error(a, "bad operand '%s'", text);
+            return 0;
+        }
+        char *end;
+        if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+            result = strtoll(s + 2, &end, 16);
+            if (end == s + 2) {
+                error(a, "bad number '%s'", text);
+                return 0;
+            }
+        } else {
+            result = strtoll(s, &end, 10);
+        }
+        s = end;
+        if (negative) {
+            result = -result;
+        }
+        if (result < INT32_MIN || result > UINT32_MAX) {
+            error(a, "number '%s' out of range", text);
+            return 0;
+        }
+    }
+
+    if (*skip_space(s) != '\0') {
+        error(a, "bad operand '%s'", text);
+        return 0;
+    }
+    *value = (uint32_t)result;
+    return 1;
+}
+
+// Reads one possibly escaped character of a string or character constant,
+// returning 0 at the end of the line or the closing quote
+static int parse_char(char **s, int quote, int *c) {
+    char *p = *s;
+    if (*p == '\0' || *p == quote) {
+        return 0;
+    }
+    if (*p != '\\') {
+        *c = (unsigned char)*p;
+        *s = p + 1;
+        return 1;
+    }
+    p++;
+    switch (*p) {
+        case 'n': *c = '\n'; break;
+        case 't': *c = '\t'; break;
+        case 'r': *c = '\r'; break;
+        case 'a': *c = '\a'; break;
+        case 'b': *c = '\b'; break;
+        case 'f': *c = '\f'; break;
+        case 'v': *c = '\v'; break;
+        case '0': *c = '\0'; break;
+        case '\\': case '\'': case '"': *c = *p; break;
+        default: return 0;
+    }
+    *s = p + 1;
+    return 1;
+}
+
+// Checks operand kinds against a string with one letter per operand:
+//     r  a register
+//     i  a number or a label
+//     x  a register, a number or a label
+//     l  a label (or an absolute address)
+//     m  a memory operand, a number or a label
+static int check_operands(assembler_t *a, const char *mnemonic,
+                          operand_t operands[], int n_operands,
+                          const char *kinds) {
+    int ok = n_operands == (int)strlen(kinds);
+    for (int i = 0; ok && i < n_operands; i++) {
+        operand_kind_t kind = operands[i].kind;
+        switch (kinds[i]) {
+            case 'r': ok = kind == o_register; break;
+            case 'i': case 'l': ok = kind == o_immediate || kind == o_label; break;
+            case 'x': ok = kind != o_memory; break;
+            case 'm': ok = kind != o_register; break;
+        }
+    }
+    if (!ok) {
+        error(a, "wrong operands for %s", mnemonic);
+    }
+    return ok;
+}
+
+static int fits_signed_16(int32_t value) {
+    return value >= -0x8000 && value <= 0x7FFF;
+}
+
+// How many more bytes the current segment can take
+static uint32_t segment_room(const assembler_t *a) {
+    uint32_t next = a->in_text ? a->text_next : a->data_next;
+    uint32_t end = a->in_text ? TEXT_SEGMENT_END : DATA_SEGMENT_END;
+    return next < end ? end - next : 0;
+}
@@ -0,0 +1,25 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stddef.h>
+#include "program_image.h"
+
+// Where the assembler places the text and data segments, the same as SPIM
+#define TEXT_SEGMENT_ADDRESS 0x00400024
+#define DATA_SEGMENT_ADDRESS 0x10000000
+
+// Bump this whenever the same source would assemble differently, so stale
+// cached programs aren't used
+#define ASSEMBLER_VERSION 2
+
+// Assembles MIPS assembly source into a program image.  Supports the
+// instructions the emulator can execute, the common SPIM pseudo-instructions
+// (li, la, move, b, bgt, bge, blt, ble, ...) and the .text, .data, .word,
+// .half, .byte, .space, .ascii, .asciiz and .align directives.
+//
+// Returns 0 on success.  Otherwise prints the problems found to stderr,
+// prefixed by source_name and a line number, and returns -1.
+int assemble_program(const char *source_name, const char *source,
+                     size_t length, program_image_t *image);
+
+#endif
@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "assembler.h"
+#include "assembly_cache.h"
+
+#define PATH_LENGTH 2048
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325u
+#define FNV_PRIME 0x100000001B3u
+
+static bool cache_directory(char *directory, size_t size);
+static bool make_directories(char *path);
+static uint64_t hash_source(const char *source, size_t length);
+static void add_to_cache(const char *directory, const char *path,
+                         const program_image_t *image);
+
+int assemble_program_cached(const char *source_name, const char *source,
+                            size_t length, program_image_t *image,
+                            assembly_cache_result_t *result) {
+    char directory[PATH_LENGTH];
+    if (!cache_directory(directory, sizeof directory)) {
+        *result = cache_off;
+        return assemble_program(source_name, source, length, image);
+    }
+
+    // the length is in the name too, as a cheap check against collisions
+    char path[PATH_LENGTH];
+    int n = snprintf(path, sizeof path, "%s/%016" PRIx64 "-%zx.img",
+                     directory, hash_source(source, length), length);
+    if (n <= 0 || (size_t)n >= sizeof path) {
+        // too long a name to look up or store, so assemble it every time
+        *result = cache_miss;
+        return assemble_program(source_name, source, length, image);
+    }
+
+    if (access(path, R_OK) == 0 && map_program_image(path, image) == 1) {
+        *result = cache_hit;
+        return 0;
+    }
+
+    *result = cache_miss;
+    if (assemble_program(source_name, source, length, image) != 0) {
+        return -1;
+    }
+    add_to_cache(directory, path, image);
+    return 0;
+}
+
+void print_assembly_cache_result(FILE *f, const char *source_name,
+                                 assembly_cache_result_t result) {
+    static const char *const descriptions[] = {
+        [cache_off] = "off",
+        [cache_hit] = "hit",
+        [cache_miss] = "miss",
+    };
+    fprintf(f, "assembly cache: %s for %s\n", descriptions[result],
+            source_name);
+}
+
+// Finds the cache directory, creating it if need be
+static bool cache_directory(char *directory, size_t size) {
+    const char *setting = getenv("EMU_CACHE_DIR");
+    const char *home = getenv("HOME");
+    int n;
+    if (setting != NULL) {
+        n = snprintf(directory, size, "%s", setting);
+    } else if (home != NULL && home[0] != '\0') {
+        n = snprintf(directory, size, "%s/.cache/emu", home);
+    } else {
+        return false;
+    }
+    if (n <= 0 || (size_t)n >= size) {
+        return false;
+    }
+    return make_directories(directory);
+}
+
+// mkdir -p
+static bool make_directories(char *path) {
+    for (char *slash = strchr(path + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int made = mkdir(path, 0777) == 0 || errno == EEXIST;
+        *slash = '/';
+        if (!made) {
+            return false;
+        }
+    }
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+}
+
+// 64 bit FNV-1a of the source, starting from the assembler and program image
+// versions
+static uint64_t hash_source(const char *source, size_t length) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint32_t versions[] = { ASSEMBLER_VERSION, PROGRAM_IMAGE_VERSION };
+    const unsigned char *bytes = (const unsigned char *)versions;
+    for (size_t i = 0; i < sizeof versions; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)source[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Writes to a temporary file and renames it into place, so nothing ever
+// maps a half-written entry.  Failing to cache isn't an error.
+static void add_to_cache(const char *directory, const char *path,
+                         const program_image_t *image) {
+    char temporary_path[PATH_LENGTH];
+    int n = snprintf(temporary_path, sizeof temporary_path,
+                     "%s/.emu.XXXXXX", directory);
+    if (n <= 0 || (size_t)n >= sizeof temporary_path) {
+        return;
+    }
+
+    int fd = mkstemp(temporary_path);
+    if (fd < 0) {
+        return;
+    }
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(temporary_path);
+        return;
+    }
+
+    int ok = write_program_image_to(image, f) == 0;
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok || chmod(temporary_path, 0644) != 0 ||
+        rename(temporary_path, path) != 0) {
+        unlink(temporary_path);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef ASSEMBLY_CACHE_H
+#define ASSEMBLY_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "program_image.h"
+
+// Assembled programs are kept on disk, named after a hash of their source
+// and the assembler version, so running the same source again maps the
+// program image written last time instead of assembling it.
+//
+// The cache lives in $EMU_CACHE_DIR, or $HOME/.cache/emu if that isn't set.
+// Setting EMU_CACHE_DIR to an empty string turns the cache off.  Entries
+// are written to a temporary file and renamed into place, so any number of
+// emu processes can share a cache directory.
+
+typedef enum assembly_cache_result {
+    cache_off,          // no cache directory to use
+    cache_hit,          // mapped the program image from the cache
+    cache_miss          // assembled the source, and cached it if possible
+} assembly_cache_result_t;
+
+// Same as assemble_program(), but goes through the cache.  *result says
+// which way the program image was found.
+int assemble_program_cached(const char *source_name, const char *source,
+                            size_t length, program_image_t *image,
+                            assembly_cache_result_t *result);
+
+// Describes where the program image came from, e.g. for `emu -v'
+void print_assembly_cache_result(FILE *f, const char *source_name,
+                                 assembly_cache_result_t result);
+
+#endif
@@ -0,0 +1,503 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "assembly_cache.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "guest_io.h"
+#include "machine.h"
+#include "ram.h"
+
+// A program named in the manifest, assembled by whichever job gets to it
+// first and then shared, read-only, by every job that runs it.  A checkpoint
+// isn't assembled; each worker maps it into its own machine.
+typedef struct batch_program {
+    char *filename;
+    pthread_mutex_t lock;
+    bool loaded;
+    bool usable;
+    bool checkpoint;
+    program_image_t image;
+} batch_program_t;
+
+typedef enum job_status {
+    job_passed,         // printed exactly the expected output
+    job_failed,         // printed something else
+    job_ran,            // terminated, with no expected output to compare
+    job_error           // couldn't be loaded or run
+} job_status_t;
+
+typedef struct batch_job {
+    batch_program_t *program;
+    char *input_filename;
+    char *expected_filename;
+
+    job_status_t status;
+    uint64_t instruction_count;
+    double seconds;
+} batch_job_t;
+
+// Each worker starts with a contiguous run of jobs, taking them from the
+// back, and when it runs out takes jobs from the front of other workers'
+// runs.  first..last-1 are the job numbers not yet taken.
+typedef struct batch_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int first;
+    int last;
+
+    struct batch *batch;
+    int number;
+
+    // the machine the worker ran its last job on, with a snapshot taken
+    // just after program was loaded, so later jobs running the same
+    // program can reset it instead of loading the program again
+    emu_machine_t *machine;
+    batch_program_t *program;
+} batch_worker_t;
+
+typedef struct batch {
+    batch_job_t *jobs;
+    int n_jobs;
+    batch_program_t **programs;
+    int n_programs;
+    batch_worker_t *workers;
+    int n_workers;
+    int (*run)(emu_machine_t *machine);
+} batch_t;
+
+static bool read_manifest(const char *filename, batch_t *batch);
+static batch_program_t *find_program(batch_t *batch, const char *filename);
+static int count_threads(int n_jobs);
+static void *run_worker(void *argument);
+static int take_job(batch_worker_t *worker);
+static int steal_job(batch_worker_t *worker);
+static void run_job(batch_worker_t *worker, batch_job_t *job);
+static emu_machine_t *start_machine(batch_worker_t *worker,
+                                    batch_program_t *program, FILE *input,
+                                    FILE *output);
+static bool load_batch_program(batch_program_t *program);
+static char *read_file(const char *filename, size_t *length);
+static void print_job(const batch_job_t *job);
+static void free_batch(batch_t *batch);
+static double now(void);
+
+static const char *job_status_names[] = {
+    [job_passed] = "PASS",
+    [job_failed] = "FAIL",
+    [job_ran] = "RAN",
+    [job_error] = "ERROR",
+};
+
+int run_batch(const char *manifest_filename,
+              int (*run)(emu_machine_t *machine)) {
+    batch_t batch = {.run = run};
+    if (!read_manifest(manifest_filename, &batch)) {
+        free_batch(&batch);
+        return 1;
+    }
+
+    double start = now();
+
+    batch.n_workers = count_threads(batch.n_jobs);
+    batch.workers = calloc(batch.n_workers, sizeof *batch.workers);
+    if (batch.workers == NULL) {
+        perror("");
+        free_batch(&batch);
+        return 1;
+    }
+    for (int w = 0; w < batch.n_workers; w++) {
+        batch_worker_t *worker = &batch.workers[w];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->first = (int64_t)batch.n_jobs * w / batch.n_workers;
+        worker->last = (int64_t)batch.n_jobs * (w + 1) / batch.n_workers;
+        worker->batch = &batch;
+        worker->number = w;
+    }
+
+    // this thread is worker 0
+    int n_started = 1;
+    while (n_started < batch.n_workers &&
+           pthread_create(&batch.workers[n_started].thread, NULL, run_worker,
+                          &batch.workers[n_started]) == 0) {
+        n_started++;
+    }
+    run_worker(&batch.workers[0]);
+    for (int w = 1; w < n_started; w++) {
+        pthread_join(batch.workers[w].thread, NULL);
+    }
+
+    double seconds = now() - start;
+
+    int counts[4] = {0};
+    for (int j = 0; j < batch.n_jobs; j++) {
+        print_job(&batch.jobs[j]);
+        counts[batch.jobs[j].status]++;
+    }
+    printf("%d jobs: %d passed, %d failed, %d ran, %d errors "
+           "in %.3f s with %d threads\n",
+           batch.n_jobs, counts[job_passed], counts[job_failed],
+           counts[job_ran], counts[job_error], seconds, n_started);
+
+    free_batch(&batch);
+    return counts[job_failed] + counts[job_error] == 0 ? 0 : 1;
+}
+
+static bool read_manifest(const char *filename, batch_t *batch) {
+    FILE *manifest = fopen(filename, "r");
+    if (manifest == NULL) {
+        fprintf(stderr, "can not open '%s': ", filename);
+        perror("");
+        return false;
+    }
+
+    int capacity = 0;
+    char line[BUFSIZ];
+    bool ok = true;
+    for (int line_number = 1; ok && fgets(line, sizeof line, manifest);
+         line_number++) {
+        char *words[3] = {NULL, NULL, NULL};
+        int n_words = 0;
+        for (char *word = strtok(line, " \t\r\n"); word != NULL;
+             word = strtok(NULL, " \t\r\n")) {
+            if (n_words == 3) {
+                fprintf(stderr, "%s:%d: too many fields\n", filename,
+                        line_number);
+                ok = false;
+                break;
+            }
+            words[n_words++] = word;
+        }
+        if (!ok || n_words == 0 || words[0][0] == '#') {
+            continue;
+        }
+
+        if (batch->n_jobs == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            batch_job_t *bigger =
+                realloc(batch->jobs, capacity * sizeof *batch->jobs);
+            if (bigger == NULL) {
+                perror("");
+                ok = false;
+                break;
+            }
+            batch->jobs = bigger;
+        }
+
+        batch_job_t *job = &batch->jobs[batch->n_jobs];
+        memset(job, 0, sizeof *job);
+        batch->n_jobs++;
+        job->program = find_program(batch, words[0]);
+        if (words[1] != NULL && strcmp(words[1], "-") != 0) {
+            job->input_filename = strdup(words[1]);
+        }
+        if (words[2] != NULL) {
+            job->expected_filename = strdup(words[2]);
+        }
+        if (job->program == NULL ||
+            (words[1] != NULL && strcmp(words[1], "-") != 0 &&
+             job->input_filename == NULL) ||
+            (words[2] != NULL && job->expected_filename == NULL)) {
+            perror("");
+            ok = false;
+        }
+    }
+    fclose(manifest);
+
+    if (ok && batch->n_jobs == 0) {
+        fprintf(stderr, "%s: no jobs\n", filename);
+        ok = false;
+    }
+    return ok;
+}
+
+static batch_program_t *find_program(batch_t *batch, const char *filename) {
+    for (int p = 0; p < batch->n_programs; p++) {
+        if (strcmp(batch->programs[p]->filename, filename) == 0) {
+            return batch->programs[p];
+        }
+    }
+
+    batch_program_t **bigger = realloc(
+        batch->programs, (batch->n_programs + 1) * sizeof *batch->programs);
+    if (bigger == NULL) {
+        return NULL;
+    }
+    batch->programs = bigger;
+
+    batch_program_t *program = calloc(1, sizeof *program);
+    if (program == NULL || (program->filename = strdup(filename)) == NULL) {
+        free(program);
+        return NULL;
+    }
+    pthread_mutex_init(&program->lock, NULL);
+    batch->programs[batch->n_programs++] = program;
+    return program;
+}
+
+static int count_threads(int n_jobs) {
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *setting = getenv("EMU_BATCH_THREADS");
+    if (setting != NULL && *setting) {
+        n_threads = strtol(setting, NULL, 10);
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    return n_threads < n_jobs ? n_threads : n_jobs;
+}
+
+static void *run_worker(void *argument) {
+    batch_worker_t *worker = argument;
+    int j;
+    while ((j = take_job(worker)) >= 0 || (j = steal_job(worker)) >= 0) {
+        run_job(worker, &worker->batch->jobs[j]);
+    }
+    if (worker->machine != NULL) {
+        free_machine(worker->machine);
+        worker->machine = NULL;
+    }
+    return NULL;
+}
+
+// Takes the last job left in a worker's own run, or returns -1
+static int take_job(batch_worker_t *worker) {
+    int j = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->first < worker->last) {
+        j = --worker->last;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return j;
+}
+
+// Takes the first job left in another worker's run, or returns -1 if there
+// are none left anywhere
+static int steal_job(batch_worker_t *worker) {
+    batch_t *batch = worker->batch;
+    for (int i = 1; i < batch->n_workers; i++) {
+        batch_worker_t *victim =
+            &batch->workers[(worker->number + i) % batch->n_workers];
+        int j = -1;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->first < victim->last) {
+            j = victim->first++;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (j >= 0) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+static void run_job(batch_worker_t *worker, batch_job_t *job) {
+    double start = now();
+    job->status = job_error;
+
+    if (!load_batch_program(job->program)) {
+        job->seconds = now() - start;
+        return;
+    }
+
+    // jobs without input read from an empty buffer instead of a stream
+    FILE *input = NULL;
+    if (job->input_filename != NULL) {
+        input = fopen(job->input_filename, "r");
+        if (input == NULL) {
+            fprintf(stderr, "can not open '%s': ", job->input_filename);
+            perror("");
+            job->seconds = now() - start;
+            return;
+        }
+    }
+
+    char *output = NULL;
+    size_t output_length = 0;
+    FILE *output_stream = open_memstream(&output, &output_length);
+    emu_machine_t *machine = NULL;
+    if (output_stream != NULL) {
+        machine = start_machine(worker, job->program, input, output_stream);
+    }
+
+    if (machine != NULL) {
+        if (input == NULL) {
+            set_input_buffer(machine, "", 0);
+        } else {
+            map_input(machine);
+        }
+        while (!run_guarded(machine, worker->batch->run)) {
+        }
+        job->instruction_count = machine->instruction_count;
+        // the streams are about to be closed
+        flush_output(machine);
+        free_input(machine);
+        if (machine == worker->machine) {
+            machine->input = NULL;
+            machine->output = NULL;
+        } else {
+            free_machine(machine);
+        }
+        fclose(output_stream);
+        job->seconds = now() - start;
+
+        if (job->expected_filename == NULL) {
+            job->status = job_ran;
+        } else {
+            size_t expected_length;
+            char *expected = read_file(job->expected_filename,
+                                       &expected_length);
+            if (expected != NULL) {
+                job->status = expected_length == output_length &&
+                                      memcmp(expected, output,
+                                             output_length) == 0
+                                  ? job_passed
+                                  : job_failed;
+            }
+            free(expected);
+        }
+    } else {
+        perror("");
+        if (output_stream != NULL) {
+            fclose(output_stream);
+        }
+        job->seconds = now() - start;
+    }
+
+    free(output);
+    if (input != NULL) {
+        fclose(input);
+    }
+}
+
+// Returns a machine with program loaded and ready to run: the worker's last
+// machine reset to its snapshot if that ran the same program, otherwise a
+// new one, or NULL if out of memory
+static emu_machine_t *start_machine(batch_worker_t *worker,
+                                    batch_program_t *program, FILE *input,
+                                    FILE *output) {
+    emu_machine_t *machine = worker->machine;
+    if (machine != NULL && worker->program == program) {
+        reset_machine(machine);
+        machine->input = input;
+        machine->output = output;
+        return machine;
+    }
+    if (machine != NULL) {
+        free_machine(machine);
+        worker->machine = NULL;
+    }
+    if (program->checkpoint) {
+        // every job reads its input from the start, wherever the
+        // checkpoint's own run had got to
+        machine = load_checkpoint(program->filename, NULL, output);
+        if (machine != NULL) {
+            machine->input = input;
+        }
+    } else {
+        machine = create_machine(&program->image, input, output);
+    }
+    if (machine != NULL && snapshot_machine(machine)) {
+        worker->machine = machine;
+        worker->program = program;
+    }
+    return machine;
+}
+
+// Assembles (or maps) a program the first time a job needs it
+static bool load_batch_program(batch_program_t *program) {
+    pthread_mutex_lock(&program->lock);
+    if (!program->loaded) {
+        program->loaded = true;
+        program->checkpoint = is_checkpoint(program->filename);
+        int mapped = program->checkpoint
+                         ? 1
+                         : map_program_image(program->filename,
+                                             &program->image);
+        if (mapped > 0) {
+            program->usable = true;
+        } else if (mapped == 0) {
+            size_t length;
+            char *source = read_file(program->filename, &length);
+            assembly_cache_result_t cache_result;
+            program->usable =
+                source != NULL &&
+                assemble_program_cached(program->filename, source, length,
+                                        &program->image, &cache_result) == 0;
+            free(source);
+        }
+    }
+    bool usable = program->usable;
+    pthread_mutex_unlock(&program->lock);
+    return usable;
+}
+
+// Reads the whole of a file into a malloc'd buffer, or returns NULL
+static char *read_file(const char *filename, size_t *length) {
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) {
+        fprintf(stderr, "can not open '%s': ", filename);
+        perror("");
+        return NULL;
+    }
+
+    char *contents = NULL;
+    FILE *out = open_memstream(&contents, length);
+    char buffer[BUFSIZ];
+    size_t n;
+    while (out != NULL && (n = fread(buffer, 1, sizeof buffer, in)) > 0) {
+        fwrite(buffer, 1, n, out);
+    }
+    bool ok = out != NULL && !ferror(in) && !ferror(out);
+    if (out != NULL && fclose(out) != 0) {
+        ok = false;
+    }
+    fclose(in);
+
+    if (!ok) {
+        fprintf(stderr, "can not read '%s'\n", filename);
+        free(contents);
+        return NULL;
+    }
+    return contents;
+}
+
+static void print_job(const batch_job_t *job) {
+    printf("%-5s %s %s %llu instructions %.3f ms\n",
+           job_status_names[job->status], job->program->filename,
+           job->input_filename ? job->input_filename : "-",
+           (unsigned long long)job->instruction_count, job->seconds * 1000);
+}
+
+static void free_batch(batch_t *batch) {
+    for (int j = 0; j < batch->n_jobs; j++) {
+        free(batch->jobs[j].input_filename);
+        free(batch->jobs[j].expected_filename);
+    }
+    for (int p = 0; p < batch->n_programs; p++) {
+        batch_program_t *program = batch->programs[p];
+        if (program->usable && !program->checkpoint) {
+            free_program_image(&program->image);
+        }
+        pthread_mutex_destroy(&program->lock);
+        free(program->filename);
+        free(program);
+    }
+    for (int w = 0; w < batch->n_workers; w++) {
+        pthread_mutex_destroy(&batch->workers[w].lock);
+    }
+    free(batch->jobs);
+    free(batch->programs);
+    free(batch->workers);
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
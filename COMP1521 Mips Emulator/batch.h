@@ -0,0 +1,25 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "machine.h"
+
+// Runs every job in a manifest file, each on its own machine, spread over a
+// pool of worker threads, then prints one line per job and a summary.
+//
+// Each line of the manifest is
+//
+//     program [input [expected-output]]
+//
+// where program is a .s file or a program image, input is fed to the read
+// syscalls (nothing if it's missing or `-') and expected-output, if given,
+// is compared with everything the program printed.  Blank lines and lines
+// starting with `#' are ignored.
+//
+// The number of threads is the number of online CPUs, or $EMU_BATCH_THREADS
+// if that is set.  run is how each program is run (see run_guarded()).
+//
+// Returns 0 if every job ran and none had the wrong output, otherwise 1.
+int run_batch(const char *manifest_filename,
+              int (*run)(emu_machine_t *machine));
+
+#endif
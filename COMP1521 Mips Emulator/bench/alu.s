@@ -0,0 +1,32 @@
+# benchmark: a tight loop of integer arithmetic, with no loads, stores or
+# syscalls in it.  reads the number of iterations, prints a checksum
+
+main:                     # int main(void) {
+    li   $v0, 5           #   scanf("%d", &n);  // n in $t0
+    syscall
+    move $t0, $v0
+
+    li   $t1, 0           #   i = 0;
+    li   $t2, 12345       #   x = 12345;
+    li   $t3, 0           #   sum = 0;
+
+loop:                     # loop:
+    mul  $t4, $t2, $t2    #   y = x * x + i;
+    add  $t4, $t4, $t1
+    xor  $t2, $t4, $t3    #   x = y ^ sum;
+    sll  $t5, $t2, 3      #   sum = (x << 3) - (x >> 5);
+    srl  $t6, $t2, 5
+    sub  $t3, $t5, $t6
+    slt  $t7, $t3, $t2    #   sum += sum < x;
+    add  $t3, $t3, $t7
+    addi $t1, $t1, 1      #   i++;
+    blt  $t1, $t0, loop   #   if (i < n) goto loop;
+
+    move $a0, $t3         #   printf("%d\n", sum);
+    li   $v0, 1
+    syscall
+    li   $a0, '\n'
+    li   $v0, 11
+    syscall
+
+    jr   $ra              #   return
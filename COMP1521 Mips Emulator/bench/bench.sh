@@ -0,0 +1,90 @@
+#!/bin/sh
+# Runs each benchmark workload with each engine several times, and prints
+# how fast emu ran it in MIPS (millions of emulated instructions per second,
+# from `emu --stats', so assembling and loading aren't counted).
+#
+# usage: bench.sh <emu> [repeats]
+#
+# BENCH_ENGINES picks the engines (default "fast jit", "step" is -s and
+# "tier" is -t),
+# BENCH_SCALE multiplies every workload's size (default 1), and
+# BENCH_WORKLOADS picks the workloads (default all of them).
+#
+# The instruction count and checksum of the output only change if the
+# emulator's behaviour does, so results from two builds can be diffed.
+
+emu=${1:?usage: bench.sh <emu> [repeats]}
+repeats=${2:-5}
+engines=${BENCH_ENGINES:-fast jit}
+scale=${BENCH_SCALE:-1}
+workloads=${BENCH_WORKLOADS:-alu memory branches recursion syscalls heap}
+bench=$(dirname "$0")
+out=${TMPDIR:-/tmp}/emu-bench-$$
+trap 'rm -f "$out" "$out.stats"' EXIT
+
+# the input for each workload, sized to run for a second or two on the
+# fast engine
+size() {
+    case $1 in
+    alu)        echo $((20000000 * scale)) ;;
+    memory)     echo $((1500 * scale)) ;;
+    branches)   echo $((15000000 * scale)) ;;
+    # each extra level is about 1.6 times as much work
+    recursion)  echo $((33 + scale)) ;;
+    syscalls)   echo $((6000000 * scale)) ;;
+    heap)       echo $((1000000 * scale)) ;;
+    esac
+}
+
+printf '# %d runs of each, MIPS = million emulated instructions per second\n' \
+    "$repeats"
+printf '# %-10s %-6s %10s %12s %10s %9s %7s %9s %9s\n' workload engine n \
+    instructions checksum mips stddev min max
+
+for workload in $workloads; do
+    n=$(size "$workload")
+    for engine in $engines; do
+        case $engine in
+        fast)   flags= ;;
+        jit)    flags=-j ;;
+        step)   flags=-s ;;
+        tier)   flags=-t ;;
+        *)      echo "bench.sh: unknown engine '$engine'" >&2; exit 1 ;;
+        esac
+
+        run=0
+        mips=
+        while [ $run -lt "$repeats" ]; do
+            echo "$n" |
+                EMU_CACHE_DIR= "$emu" $flags --stats -E "$bench/$workload.s" \
+                    >"$out" 2>"$out.stats" || {
+                echo "bench.sh: $workload failed" >&2
+                cat "$out.stats" >&2
+                exit 1
+            }
+            instructions=$(awk '$1 == "instructions" { print $2 }' \
+                "$out.stats")
+            mips="$mips $(awk '$1 == "instructions" { n = $2 }
+                $1 == "run" { print n / $3 / 1e6 }' "$out.stats")"
+            run=$((run + 1))
+        done
+        checksum=$(cksum <"$out" | awk '{ print $1 }')
+
+        echo "$mips" | awk -v w="$workload" -v e="$engine" -v n="$n" \
+            -v i="$instructions" -v c="$checksum" '{
+            min = max = $1
+            for (r = 1; r <= NF; r++) {
+                sum += $r
+                if ($r < min) min = $r
+                if ($r > max) max = $r
+            }
+            mean = sum / NF
+            for (r = 1; r <= NF; r++) {
+                squares += ($r - mean) ^ 2
+            }
+            stddev = NF > 1 ? sqrt(squares / (NF - 1)) : 0
+            printf "%-12s %-6s %10s %12s %10s %9.2f %7.2f %9.2f %9.2f\n",
+                w, e, n, i, c, mean, stddev, min, max
+        }'
+    done
+done
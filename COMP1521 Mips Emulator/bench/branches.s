@@ -0,0 +1,49 @@
+# benchmark: branches that go whichever way a pseudo-random number says,
+# so they can't be predicted.  reads the number of iterations, prints a
+# checksum
+
+main:                     # int main(void) {
+    li   $v0, 5           #   scanf("%d", &n);  // n in $t0
+    syscall
+    move $t0, $v0
+
+    li   $t1, 0           #   i = 0;
+    li   $t2, 1           #   x = 1;
+    li   $t3, 0           #   a = 0;
+    li   $t4, 0           #   b = 0;
+    li   $t9, 1103515245  #   multiplier
+
+loop:                     # loop:
+    mul  $t2, $t2, $t9    #   x = x * 1103515245 + 12345;
+    addi $t2, $t2, 12345
+
+    srl  $t5, $t2, 16     #   if (x >> 16 & 1) {
+    andi $t5, $t5, 1
+    beqz $t5, even
+    addi $t3, $t3, 1      #     a++;
+    b    next             #   } else {
+even:
+    addi $t4, $t4, 1      #     b++;
+next:                     #   }
+
+    srl  $t5, $t2, 20     #   if ((x >> 20 & 3) == 0) {
+    andi $t5, $t5, 3
+    bnez $t5, skip
+    add  $t3, $t3, $t4    #     a += b;
+skip:                     #   }
+
+    bltz $t2, negative    #   if (x >= 0) {
+    sub  $t4, $t4, $t3    #     b -= a;
+negative:                 #   }
+
+    addi $t1, $t1, 1      #   i++;
+    blt  $t1, $t0, loop   #   if (i < n) goto loop;
+
+    xor  $a0, $t3, $t4    #   printf("%d\n", a ^ b);
+    li   $v0, 1
+    syscall
+    li   $a0, '\n'
+    li   $v0, 11
+    syscall
+
+    jr   $ra              #   return
@@ -0,0 +1,86 @@
+# benchmark: allocates a node at a time with sbrk.  reads n, builds a
+# linked list of n nodes and sums it, then inserts n pseudo-random keys into
+# a binary search tree, and prints the sum plus the number of tree nodes
+# visited
+
+main:                     # int main(void) {
+    li   $v0, 5           #   scanf("%d", &n);  // n in $s0
+    syscall
+    move $s0, $v0
+
+    li   $s1, 0           #   list = NULL;
+    li   $t0, 0           #   i = 0;
+list:                     # list:
+    li   $a0, 8           #   node = sbrk(8);
+    li   $v0, 9
+    syscall
+    sw   $t0, 0($v0)      #   node->value = i;
+    sw   $s1, 4($v0)      #   node->next = list;
+    move $s1, $v0         #   list = node;
+    addi $t0, $t0, 1      #   i++;
+    blt  $t0, $s0, list   #   if (i < n) goto list;
+
+    li   $s2, 0           #   sum = 0;
+sum:                      # sum:
+    beq  $s1, 0, tree     #   if (list == NULL) goto tree;
+    lw   $t1, 0($s1)      #   sum += list->value;
+    add  $s2, $s2, $t1
+    lw   $s1, 4($s1)      #   list = list->next;
+    j    sum              #   goto sum;
+
+tree:                     # tree:
+    li   $s3, 0           #   root = NULL;
+    li   $t3, 12345       #   seed = 12345;
+    li   $t0, 0           #   i = 0;
+insert:                   # insert:
+    li   $t4, 1103515245  #   seed = seed * 1103515245 + 12345;
+    mul  $t3, $t3, $t4
+    addi $t3, $t3, 12345
+    srl  $t5, $t3, 8      #   key = (seed >> 8) & 0xFFFFF;
+    li   $t4, 0xFFFFF
+    and  $t5, $t5, $t4
+
+    li   $a0, 12          #   node = sbrk(12);
+    li   $v0, 9
+    syscall
+    sw   $t5, 0($v0)      #   node->key = key;
+    sw   $zero, 4($v0)    #   node->left = NULL;
+    sw   $zero, 8($v0)    #   node->right = NULL;
+
+    bne  $s3, 0, descend  #   if (root == NULL) {
+    move $s3, $v0         #       root = node;
+    j    inserted         #       goto inserted;
+descend:                  #   }
+    move $t6, $s3         #   p = root;
+step:                     # step:
+    addi $s2, $s2, 1      #   sum++;
+    lw   $t7, 0($t6)      #   if (key < p->key) {
+    bge  $t5, $t7, right
+    lw   $t8, 4($t6)      #       if (p->left == NULL) {
+    bne  $t8, 0, left
+    sw   $v0, 4($t6)      #           p->left = node;
+    j    inserted         #           goto inserted;
+left:                     #       }
+    move $t6, $t8         #       p = p->left;
+    j    step             #       goto step;
+right:                    #   }
+    lw   $t8, 8($t6)      #   if (p->right == NULL) {
+    bne  $t8, 0, go_right
+    sw   $v0, 8($t6)      #       p->right = node;
+    j    inserted         #       goto inserted;
+go_right:                 #   }
+    move $t6, $t8         #   p = p->right;
+    j    step             #   goto step;
+
+inserted:                 # inserted:
+    addi $t0, $t0, 1      #   i++;
+    blt  $t0, $s0, insert #   if (i < n) goto insert;
+
+    move $a0, $s2         #   printf("%d\n", sum);
+    li   $v0, 1
+    syscall
+    li   $a0, '\n'
+    li   $v0, 11
+    syscall
+
+    jr   $ra              #   return
@@ -0,0 +1,39 @@
+# benchmark: streams loads and stores through a 64 KiB array.  reads the
+# number of passes over the array, prints a checksum
+
+main:                     # int main(void) {
+    li   $v0, 5           #   scanf("%d", &n);  // n in $t0
+    syscall
+    move $t0, $v0
+
+    li   $t1, 0           #   pass = 0;
+    li   $t3, 0           #   sum = 0;
+
+pass:                     # pass:
+    la   $t4, array       #   p = &array[0];
+    li   $t2, 0           #   i = 0;
+
+word:                     # word:
+    lw   $t5, 0($t4)      #   *p = *p + i + pass;
+    add  $t5, $t5, $t2
+    add  $t5, $t5, $t1
+    sw   $t5, 0($t4)
+    add  $t3, $t3, $t5    #   sum += *p;
+    addi $t4, $t4, 4      #   p++;
+    addi $t2, $t2, 1      #   i++;
+    blt  $t2, 16384, word #   if (i < 16384) goto word;
+
+    addi $t1, $t1, 1      #   pass++;
+    blt  $t1, $t0, pass   #   if (pass < n) goto pass;
+
+    move $a0, $t3         #   printf("%d\n", sum);
+    li   $v0, 1
+    syscall
+    li   $a0, '\n'
+    li   $v0, 11
+    syscall
+
+    jr   $ra              #   return
+
+.data
+array:  .space 65536      # int array[16384];
@@ -0,0 +1,45 @@
+# benchmark: naive recursive fibonacci, so almost everything is jal, jr and
+# stack frames.  reads n, prints fib(n)
+
+main:                     # int main(void) {
+    addi $sp, $sp, -4
+    sw   $ra, 0($sp)
+
+    li   $v0, 5           #   scanf("%d", &n);
+    syscall
+    move $a0, $v0
+
+    jal  fib              #   printf("%d\n", fib(n));
+    move $a0, $v0
+    li   $v0, 1
+    syscall
+    li   $a0, '\n'
+    li   $v0, 11
+    syscall
+
+    lw   $ra, 0($sp)
+    addi $sp, $sp, 4
+    jr   $ra              #   return
+
+fib:                      # int fib(int n) {
+    move $v0, $a0         #   if (n < 2) return n;
+    blt  $a0, 2, fib_end
+
+    addi $sp, $sp, -12
+    sw   $ra, 0($sp)
+    sw   $a0, 4($sp)
+
+    addi $a0, $a0, -1     #   int f = fib(n - 1);
+    jal  fib
+    sw   $v0, 8($sp)
+
+    lw   $a0, 4($sp)      #   return f + fib(n - 2);
+    addi $a0, $a0, -2
+    jal  fib
+    lw   $t0, 8($sp)
+    add  $v0, $v0, $t0
+
+    lw   $ra, 0($sp)
+    addi $sp, $sp, 12
+fib_end:
+    jr   $ra              # }
@@ -0,0 +1,25 @@
+# benchmark: prints a number and a character every few instructions, so
+# most of the time goes on syscalls.  reads how many numbers to print
+
+main:                     # int main(void) {
+    li   $v0, 5           #   scanf("%d", &n);  // n in $t0
+    syscall
+    move $t0, $v0
+
+    li   $t1, 0           #   i = 0;
+
+loop:                     # loop:
+    move $a0, $t1         #   printf("%d", i);
+    li   $v0, 1
+    syscall
+    li   $a0, ' '         #   putchar(' ');
+    li   $v0, 11
+    syscall
+    addi $t1, $t1, 1      #   i++;
+    blt  $t1, $t0, loop   #   if (i < n) goto loop;
+
+    li   $a0, '\n'        #   putchar('\n');
+    li   $v0, 11
+    syscall
+
+    jr   $ra              #   return
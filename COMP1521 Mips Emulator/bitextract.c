@@ -165,18 +165,21 @@ char *getCommand(uint32_t instruction) {
     }
     
     // If the left six bits are 000001, then scan bits 16 to 20
-    // If the program execution reaches here, the command is either blez or bgez
-    int midFive = (instruction >> 16) & 0x0000001F;
-    switch (midFive)  {
-        case 0x00000000:
-            command = malloc(sizeof(char) * (strlen("bltz") + 1)); 
-            strcpy(command, "bltz");
-            return command;
-        case 0x00000001:
-            command = malloc(sizeof(char) * (strlen("bgez") + 1)); 
-            strcpy(command, "bgez");
-            return command;
+    // If the program execution reaches here, the command is either bltz or bgez
+    if (leftSix == 1u) {
+        int midFive = (instruction >> 16) & 0x0000001F;
+        switch (midFive)  {
+            case 0x00000000:
+                command = malloc(sizeof(char) * (strlen("bltz") + 1)); 
+                strcpy(command, "bltz");
+                return command;
+            case 0x00000001:
+                command = malloc(sizeof(char) * (strlen("bgez") + 1)); 
+                strcpy(command, "bgez");
+                return command;
+        }
     }
+    // Anything else isn't an instruction we know
     return NULL;
 }
 
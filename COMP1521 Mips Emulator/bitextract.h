@@ -8,7 +8,7 @@ void printBits(uint32_t input);
 void printHex(uint32_t input);
 
 // Determines the opcode encoded by the instruction and returns it as a string,
-// like "blez"
+// like "blez", or NULL if it isn't an instruction the emulator knows
 char *getCommand(uint32_t instruction);
 
 // Gets a slice from a 32 bit bit-string given a boundary. Eg.
@@ -0,0 +1,173 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cfg.h"
+#include "decode_instruction.h"
+
+// ========================== My Helper Functions ==============================
+// How the instruction at address leaves its block, and where to if it says
+static cfg_exit_t instructionExit(const decoded_instruction_t *decoded,
+                                  uint32_t address, uint32_t *target);
+static bool inText(const cfg_t *cfg, uint32_t address);
+
+// =============================================================================
+cfg_t *build_cfg(const decoded_instruction_t *text, uint32_t first_address,
+                 uint32_t n_words) {
+    cfg_t *cfg = calloc(1, sizeof *cfg);
+    bool *leaders = calloc(n_words + 1, sizeof *leaders);
+    if (cfg == NULL || leaders == NULL) {
+        free(cfg);
+        free(leaders);
+        return NULL;
+    }
+    cfg->first_address = first_address;
+    cfg->n_words = n_words;
+
+    // the first pass finds where blocks start and checks every instruction
+    leaders[0] = true;
+    for (uint32_t w = 0; w < n_words; w++) {
+        uint32_t target;
+        cfg_exit_t how = instructionExit(&text[w], first_address + w * 4,
+                                         &target);
+        if (how == cfg_exit_next) {
+            continue;
+        }
+        leaders[w + 1] = true;
+        if (how == cfg_exit_invalid) {
+            cfg->n_invalid++;
+        } else if (how == cfg_exit_branch || how == cfg_exit_jump) {
+            if (inText(cfg, target)) {
+                leaders[(target - first_address) / 4] = true;
+            } else {
+                cfg->n_bad_targets++;
+            }
+        }
+    }
+
+    uint32_t n_blocks = 0;
+    for (uint32_t w = 0; w < n_words; w++) {
+        n_blocks += leaders[w];
+    }
+    cfg->blocks = calloc(n_blocks + 1, sizeof *cfg->blocks);
+    cfg->block_of = calloc(n_words + 1, sizeof *cfg->block_of);
+    if (cfg->blocks == NULL || cfg->block_of == NULL) {
+        free(leaders);
+        free_cfg(cfg);
+        return NULL;
+    }
+
+    // the second pass cuts the text into blocks at the leaders
+    for (uint32_t w = 0; w < n_words; w++) {
+        if (leaders[w]) {
+            cfg->blocks[cfg->n_blocks].first = w;
+            cfg->n_blocks++;
+        }
+        cfg_block_t *block = &cfg->blocks[cfg->n_blocks - 1];
+        block->last = w;
+        block->exit = instructionExit(&text[w], first_address + w * 4,
+                                      &block->target);
+        cfg->block_of[w] = cfg->n_blocks - 1;
+    }
+    free(leaders);
+    return cfg;
+}
+
+void free_cfg(cfg_t *cfg) {
+    if (cfg == NULL) {
+        return;
+    }
+    free(cfg->blocks);
+    free(cfg->block_of);
+    free(cfg);
+}
+
+void print_cfg(FILE *out, const cfg_t *cfg) {
+    fprintf(out, "%u basic block%s:\n", cfg->n_blocks,
+            cfg->n_blocks == 1 ? "" : "s");
+    for (uint32_t b = 0; b < cfg->n_blocks; b++) {
+        const cfg_block_t *block = &cfg->blocks[b];
+        uint32_t first = cfg->first_address + block->first * 4;
+        uint32_t last = cfg->first_address + block->last * 4;
+        fprintf(out, "    block %-4u [%08X..%08X] ->", b, first, last);
+
+        bool next = block->exit == cfg_exit_next ||
+                    block->exit == cfg_exit_branch ||
+                    block->exit == cfg_exit_syscall;
+        if (block->exit == cfg_exit_branch || block->exit == cfg_exit_jump) {
+            if (inText(cfg, block->target)) {
+                fprintf(out, " block %u",
+                        cfg->block_of[(block->target - cfg->first_address) /
+                                      4]);
+            } else {
+                fprintf(out, " %08X (outside the text)", block->target);
+            }
+            if (next) {
+                fprintf(out, ",");
+            }
+        }
+        if (next) {
+            if (block->last + 1 < cfg->n_words) {
+                fprintf(out, " block %u", b + 1);
+            } else {
+                fprintf(out, " end of text");
+            }
+        }
+        if (block->exit == cfg_exit_register) {
+            fprintf(out, " any (jr)");
+        } else if (block->exit == cfg_exit_syscall) {
+            fprintf(out, " (or exit)");
+        } else if (block->exit == cfg_exit_invalid) {
+            fprintf(out, " nowhere (invalid instruction)");
+        }
+        fprintf(out, "\n");
+    }
+
+    if (cfg->n_invalid == 0 && cfg->n_bad_targets == 0) {
+        fprintf(out, "Every instruction decodes and every branch and jump "
+                     "stays in the text segment.\n");
+        return;
+    }
+    uint32_t n_problems = cfg->n_invalid + cfg->n_bad_targets;
+    fprintf(out, "%u problem%s:\n", n_problems, n_problems == 1 ? "" : "s");
+    for (uint32_t b = 0; b < cfg->n_blocks; b++) {
+        const cfg_block_t *block = &cfg->blocks[b];
+        uint32_t last = cfg->first_address + block->last * 4;
+        if (block->exit == cfg_exit_invalid) {
+            fprintf(out, "    [%08X] invalid instruction\n", last);
+        } else if ((block->exit == cfg_exit_branch ||
+                    block->exit == cfg_exit_jump) &&
+                   !inText(cfg, block->target)) {
+            fprintf(out,
+                    "    [%08X] goes to %08X, outside the text segment\n",
+                    last, block->target);
+        }
+    }
+}
+
+static cfg_exit_t instructionExit(const decoded_instruction_t *decoded,
+                                  uint32_t address, uint32_t *target) {
+    *target = address;
+    switch (decoded->handler) {
+    case handler_branch:
+        *target = address + decoded->imm * 4;
+        return cfg_exit_branch;
+    case handler_jump:
+        if (decoded->opcode == op_jr) {
+            return cfg_exit_register;
+        }
+        *target = jump_target(address, decoded);
+        return cfg_exit_jump;
+    case handler_syscall:
+        return cfg_exit_syscall;
+    case handler_invalid:
+        return cfg_exit_invalid;
+    default:
+        return cfg_exit_next;
+    }
+}
+
+static bool inText(const cfg_t *cfg, uint32_t address) {
+    uint32_t offset = address - cfg->first_address;
+    return offset / 4 < cfg->n_words && offset % 4 == 0;
+}
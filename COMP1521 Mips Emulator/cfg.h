@@ -0,0 +1,55 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "decode_instruction.h"
+
+// Where a basic block can go when its last instruction has run
+typedef enum cfg_exit {
+    cfg_exit_next,      // on to the next block (the next word is a target)
+    cfg_exit_branch,    // to target, or on to the next block
+    cfg_exit_jump,      // to target (j, jal)
+    cfg_exit_register,  // to an address in a register (jr)
+    cfg_exit_syscall,   // on to the next block, unless the program exits
+    cfg_exit_invalid,   // nowhere, the instruction doesn't decode
+} cfg_exit_t;
+
+// A run of instructions that is only ever entered at its first and only
+// ever left after its last, given as indexes of words of the text segment
+typedef struct cfg_block {
+    uint32_t first;
+    uint32_t last;
+    cfg_exit_t exit;
+    // for cfg_exit_branch and cfg_exit_jump
+    uint32_t target;
+} cfg_block_t;
+
+// The basic blocks of a text segment, found when a program is loaded.
+// Blocks start at the start of the text, at the target of every branch and
+// jump, and after every branch, jump, syscall and invalid instruction.
+typedef struct cfg {
+    uint32_t first_address;
+    uint32_t n_words;
+    uint32_t n_blocks;
+    cfg_block_t *blocks;
+    // the block each word belongs to
+    uint32_t *block_of;
+
+    // what the checks found: instructions that don't decode, and branches
+    // and jumps to outside the text segment (or into the middle of a word)
+    uint32_t n_invalid;
+    uint32_t n_bad_targets;
+} cfg_t;
+
+// Finds the basic blocks of n_words instructions decoded from first_address
+// on, none of which may be op_undecoded.  Returns NULL if out of memory.
+cfg_t *build_cfg(const decoded_instruction_t *text, uint32_t first_address,
+                 uint32_t n_words);
+void free_cfg(cfg_t *cfg);
+
+// Prints each block with where it goes, then any problems the checks found
+void print_cfg(FILE *out, const cfg_t *cfg);
+
+#endif
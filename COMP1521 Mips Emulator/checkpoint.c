@@ -0,0 +1,181 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "guest_io.h"
+#include "machine.h"
+#include "ram.h"
+#include "registers.h"
+#include "stats.h"
+
+#define SEGMENT_ENTRY_LENGTH 12
+#define HEADER_LENGTH (172 + MAX_CHECKPOINT_SEGMENTS * SEGMENT_ENTRY_LENGTH)
+
+static uint64_t seek_input(FILE *input, uint64_t offset);
+static uint32_t read_le32(const uint8_t *bytes);
+static void write_le32(uint8_t *bytes, uint32_t value);
+static uint64_t read_le64(const uint8_t *bytes);
+static void write_le64(uint8_t *bytes, uint64_t value);
+
+int write_checkpoint(emu_machine_t *machine, const char *filename) {
+    flush_output(machine);
+
+    uint8_t header[HEADER_LENGTH] = {0};
+    memcpy(header, CHECKPOINT_MAGIC, 4);
+    write_le32(header + 4, CHECKPOINT_VERSION);
+    for (int r = 0; r < N_REGISTERS; r++) {
+        write_le32(header + 8 + r * 4, machine->registers[r]);
+    }
+    write_le32(header + 136, machine->program_counter);
+    write_le64(header + 140, machine->instruction_count);
+    write_le64(header + 148, machine->input_position);
+    write_le32(header + 156, machine->exited);
+
+    memory_layout_t layout;
+    uint64_t length =
+        get_memory_layout(machine, CHECKPOINT_PAGE_SIZE, &layout);
+    write_le32(header + 160, layout.heap_start);
+    write_le32(header + 164, layout.heap_break);
+    write_le32(header + 168, layout.n_segments);
+    for (uint32_t i = 0; i < layout.n_segments; i++) {
+        uint8_t *entry = header + 172 + i * SEGMENT_ENTRY_LENGTH;
+        write_le32(entry, layout.segments[i].first_address);
+        write_le32(entry + 4, layout.segments[i].last_address);
+        write_le32(entry + 8, layout.segments[i].offset);
+    }
+
+    // the file is sized first, so the pages of zeros that aren't written
+    // are holes that take up no space
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = fd >= 0 && ftruncate(fd, length) == 0 &&
+              pwrite(fd, header, sizeof header, 0) == sizeof header &&
+              write_memory(machine, &layout, fd);
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "can not write '%s': ", filename);
+        perror("");
+    }
+    return ok ? 0 : -1;
+}
+
+bool is_checkpoint(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char magic[4];
+    bool checkpoint = pread(fd, magic, sizeof magic, 0) == sizeof magic &&
+                      memcmp(magic, CHECKPOINT_MAGIC, sizeof magic) == 0;
+    close(fd);
+    return checkpoint;
+}
+
+emu_machine_t *load_checkpoint(const char *filename, FILE *input,
+                               FILE *output) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "can not open '%s': ", filename);
+        perror("");
+        return NULL;
+    }
+
+    const char *problem = NULL;
+    uint8_t header[HEADER_LENGTH];
+    memory_layout_t layout;
+    if (pread(fd, header, sizeof header, 0) != sizeof header) {
+        problem = "truncated";
+    } else if (memcmp(header, CHECKPOINT_MAGIC, 4) != 0) {
+        problem = "not a";
+    } else if (read_le32(header + 4) != CHECKPOINT_VERSION) {
+        problem = "unsupported version of";
+    } else {
+        layout.heap_start = read_le32(header + 160);
+        layout.heap_break = read_le32(header + 164);
+        layout.n_segments = read_le32(header + 168);
+        if (layout.n_segments > MAX_CHECKPOINT_SEGMENTS) {
+            problem = "bad segment table in";
+        }
+        for (uint32_t i = 0; problem == NULL && i < layout.n_segments; i++) {
+            const uint8_t *entry = header + 172 + i * SEGMENT_ENTRY_LENGTH;
+            layout.segments[i].first_address = read_le32(entry);
+            layout.segments[i].last_address = read_le32(entry + 4);
+            layout.segments[i].offset = read_le32(entry + 8);
+        }
+    }
+
+    emu_machine_t *machine = NULL;
+    if (problem == NULL) {
+        machine = calloc(1, sizeof *machine);
+        if (machine == NULL) {
+            problem = "out of memory for";
+        }
+    }
+    if (problem == NULL) {
+        machine->input = input;
+        machine->output = output;
+        start_stats(machine);
+        if (!map_memory(machine, &layout, fd)) {
+            problem = "can not map";
+        }
+    }
+    // the mappings stay after the file is closed
+    close(fd);
+    if (problem != NULL) {
+        fprintf(stderr, "%s: %s checkpoint\n", filename, problem);
+        free(machine);
+        return NULL;
+    }
+
+    for (int r = 0; r < N_REGISTERS; r++) {
+        machine->registers[r] = read_le32(header + 8 + r * 4);
+    }
+    machine->program_counter = read_le32(header + 136);
+    machine->instruction_count = read_le64(header + 140);
+    machine->exited = read_le32(header + 156) != 0;
+    machine->input_position = seek_input(input, read_le64(header + 148));
+    return machine;
+}
+
+// Moves input on to offset, returning how far it got: short of offset if
+// the input ends first, and 0 without any input
+static uint64_t seek_input(FILE *input, uint64_t offset) {
+    if (input == NULL) {
+        return 0;
+    }
+    if (offset == 0 || fseeko(input, offset, SEEK_SET) == 0) {
+        return offset;
+    }
+    // a pipe or a terminal, skip what was read before instead
+    uint64_t skipped = 0;
+    while (skipped < offset && getc(input) != EOF) {
+        skipped++;
+    }
+    return skipped;
+}
+
+static uint32_t read_le32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void write_le32(uint8_t *bytes, uint32_t value) {
+    for (int b = 0; b < 4; b++) {
+        bytes[b] = value >> (b * 8);
+    }
+}
+
+static uint64_t read_le64(const uint8_t *bytes) {
+    return read_le32(bytes) | (uint64_t)read_le32(bytes + 4) << 32;
+}
+
+static void write_le64(uint8_t *bytes, uint64_t value) {
+    write_le32(bytes, value);
+    write_le32(bytes + 4, value >> 32);
+}
@@ -0,0 +1,45 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "machine.h"
+
+// Checkpoint files start with this, followed by the version
+#define CHECKPOINT_MAGIC "EMUC"
+#define CHECKPOINT_VERSION 1
+
+// Writes everything needed to carry on running a machine later to a file:
+//
+//     offset  (each field is a little-endian uint32_t)
+//          0  magic "EMUC"
+//          4  version
+//          8  registers $0 to $31
+//        136  program counter
+//        140  instruction count (low word first)
+//        148  how far into its input the program has read (low word first)
+//        156  whether the program has exited
+//        160  heap start, heap break
+//        168  number of segments: 3, or 4 once the program has a heap
+//        172  for each of text, data, stack and heap: first address, last
+//             address, offset of its pages in the file
+//       4096  ... each segment's pages, page aligned, with pages of zeros
+//             left as holes (see `ram.h')
+//
+// Any output the machine has buffered is written out first.  Returns 0 on
+// success, or prints why not and returns -1.
+int write_checkpoint(emu_machine_t *machine, const char *filename);
+
+// Returns whether a file is a checkpoint
+bool is_checkpoint(const char *filename);
+
+// Creates a machine from a checkpoint, with its memory mapped copy-on-write
+// from the file, so it starts straight away however much memory the
+// program had and only the pages it stores to are copied.  input, unless
+// it is NULL, is moved on past what the program had read.
+//
+// Returns the machine, or prints why not and returns NULL.
+emu_machine_t *load_checkpoint(const char *filename, FILE *input,
+                               FILE *output);
+
+#endif
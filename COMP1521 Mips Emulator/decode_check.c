@@ -0,0 +1,329 @@
+// decode_check -- checks every instruction word against every decoder
+//
+// usage: decode_check [-t threads] [first [last]]
+//
+// Runs each word from first to last (by default all 2^32 of them) through
+// decode_instruction(), the table decoder everything executes from,
+// getCommand() and format_instruction(), the hand-written decoder behind
+// print_instruction(), and checks that they agree: the same opcode (or both
+// rejecting the word), the same fields, and the same disassembly. Then
+// reports how many words a second each core decoded with each of them.
+//
+// The words are shared out between threads (by default one per CPU) a
+// chunk at a time. Exits 1 if any word disagreed.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitextract.h"
+#include "decode_instruction.h"
+#include "print_instruction.h"
+
+// how many words a thread takes at once
+#define CHUNK_WORDS 65536
+// how many disagreements to describe before just counting them
+#define MAX_REPORTED 20
+
+typedef struct check_thread {
+    pthread_t thread;
+    uint64_t words;
+    double decode_seconds;      // in decode_instruction()
+    double command_seconds;     // in getCommand()
+    double format_seconds;      // in format_instruction()
+} check_thread_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_word;      // the next word no thread has taken
+static uint64_t last_word;
+static uint64_t mismatches;
+
+static void *check_words(void *argument);
+static void check_word(uint32_t word, const decoded_instruction_t *decoded,
+                       const char *command, const char *text);
+static bool expected_handler(const decoded_instruction_t *decoded);
+static bool expected_fields(uint32_t word,
+                            const decoded_instruction_t *decoded);
+static void format_decoded(const decoded_instruction_t *decoded, char *text);
+static void report_mismatch(uint32_t word, const char *what,
+                            const char *expected, const char *got);
+static double seconds_now(void);
+static uint64_t parse_word(const char *program_name, const char *argument);
+
+int main(int argc, char *argv[]) {
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int option;
+    while ((option = getopt(argc, argv, "t:")) != -1) {
+        if (option != 't' || (n_threads = strtol(optarg, NULL, 10)) < 1) {
+            fprintf(stderr, "usage: %s [-t threads] [first [last]]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    next_word = 0;
+    last_word = UINT32_MAX;
+    if (optind < argc) {
+        next_word = parse_word(argv[0], argv[optind]);
+    }
+    if (optind + 1 < argc) {
+        last_word = parse_word(argv[0], argv[optind + 1]);
+    }
+    uint64_t first_word = next_word;
+    uint64_t n_words = last_word >= first_word ? last_word - first_word + 1 : 0;
+
+    check_thread_t *threads = calloc(n_threads, sizeof *threads);
+    if (threads == NULL) {
+        perror(argv[0]);
+        return 1;
+    }
+    double start = seconds_now();
+    for (int t = 0; t < n_threads; t++) {
+        if (pthread_create(&threads[t].thread, NULL, check_words,
+                           &threads[t]) != 0) {
+            fprintf(stderr, "%s: can not start thread\n", argv[0]);
+            return 1;
+        }
+    }
+    for (int t = 0; t < n_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    double seconds = seconds_now() - start;
+
+    printf("%-8s %12s %20s %20s %20s\n", "thread", "words",
+           "decode_instruction", "getCommand", "format_instruction");
+    check_thread_t total = {0};
+    for (int t = 0; t < n_threads; t++) {
+        check_thread_t *thread = &threads[t];
+        printf("%-8d %12ju %16.1f M/s %16.1f M/s %16.1f M/s\n", t,
+               (uintmax_t)thread->words,
+               thread->words / thread->decode_seconds / 1e6,
+               thread->words / thread->command_seconds / 1e6,
+               thread->words / thread->format_seconds / 1e6);
+        total.words += thread->words;
+        total.decode_seconds += thread->decode_seconds;
+        total.command_seconds += thread->command_seconds;
+        total.format_seconds += thread->format_seconds;
+    }
+    printf("%-8s %12ju %16.1f M/s %16.1f M/s %16.1f M/s\n", "per core",
+           (uintmax_t)total.words, total.words / total.decode_seconds / 1e6,
+           total.words / total.command_seconds / 1e6,
+           total.words / total.format_seconds / 1e6);
+    printf("checked %ju words (%08jX to %08jX) on %ld threads in %.1f s, "
+           "%ju disagreed\n", (uintmax_t)n_words, (uintmax_t)first_word,
+           (uintmax_t)last_word, n_threads, seconds, (uintmax_t)mismatches);
+
+    free(threads);
+    return mismatches != 0;
+}
+
+// Takes chunks of words until there are none left, decoding each chunk with
+// each decoder in turn so they can be timed separately
+static void *check_words(void *argument) {
+    check_thread_t *thread = argument;
+    decoded_instruction_t *decoded = malloc(CHUNK_WORDS * sizeof *decoded);
+    char **commands = malloc(CHUNK_WORDS * sizeof *commands);
+    char (*texts)[INSTRUCTION_TEXT_SIZE] = malloc(CHUNK_WORDS * sizeof *texts);
+    if (decoded == NULL || commands == NULL || texts == NULL) {
+        perror("decode_check");
+        exit(1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        uint64_t first = next_word;
+        uint64_t n = 0;
+        if (first <= last_word) {
+            n = last_word - first + 1;
+            n = n < CHUNK_WORDS ? n : CHUNK_WORDS;
+        }
+        next_word = first + n;
+        pthread_mutex_unlock(&lock);
+        if (n == 0) {
+            break;
+        }
+
+        double start = seconds_now();
+        for (uint64_t i = 0; i < n; i++) {
+            decode_instruction((uint32_t)(first + i), &decoded[i]);
+        }
+        double decoded_at = seconds_now();
+        for (uint64_t i = 0; i < n; i++) {
+            commands[i] = getCommand((uint32_t)(first + i));
+        }
+        double commands_at = seconds_now();
+        for (uint64_t i = 0; i < n; i++) {
+            format_instruction((uint32_t)(first + i), texts[i]);
+        }
+        double formatted_at = seconds_now();
+
+        for (uint64_t i = 0; i < n; i++) {
+            check_word((uint32_t)(first + i), &decoded[i], commands[i],
+                       texts[i]);
+            free(commands[i]);
+        }
+        thread->words += n;
+        thread->decode_seconds += decoded_at - start;
+        thread->command_seconds += commands_at - decoded_at;
+        thread->format_seconds += formatted_at - commands_at;
+    }
+
+    free(texts);
+    free(commands);
+    free(decoded);
+    return NULL;
+}
+
+static void check_word(uint32_t word, const decoded_instruction_t *decoded,
+                       const char *command, const char *text) {
+    const char *name = decoded->opcode == op_invalid ? "(invalid)" :
+                       opcode_name(decoded->opcode);
+    if (command == NULL ? decoded->opcode != op_invalid :
+                          strcmp(command, name) != 0) {
+        report_mismatch(word, "opcode", command ? command : "(invalid)", name);
+        return;
+    }
+    if (!expected_handler(decoded)) {
+        report_mismatch(word, "handler", name, "wrong handler");
+        return;
+    }
+    if (!expected_fields(word, decoded)) {
+        report_mismatch(word, "fields", name, "wrong fields");
+        return;
+    }
+    char expected[INSTRUCTION_TEXT_SIZE];
+    format_decoded(decoded, expected);
+    if (strcmp(text, expected) != 0) {
+        report_mismatch(word, "disassembly", text, expected);
+    }
+}
+
+// Whether the opcode will be carried out by the right part of
+// execute_instruction.c
+static bool expected_handler(const decoded_instruction_t *decoded) {
+    switch (decoded->opcode) {
+        case op_add: case op_sub: case op_mul: case op_and: case op_or:
+        case op_xor: case op_slt: case op_sllv: case op_srlv:
+        case op_addi: case op_andi: case op_ori: case op_xori: case op_slti:
+        case op_sll: case op_srl:
+            return decoded->handler == handler_math;
+        case op_lui: case op_lb: case op_lh: case op_lw:
+        case op_sb: case op_sh: case op_sw:
+            return decoded->handler == handler_load_or_store;
+        case op_beq: case op_bne: case op_blez: case op_bgtz:
+        case op_bltz: case op_bgez:
+            return decoded->handler == handler_branch;
+        case op_j: case op_jal: case op_jr:
+            return decoded->handler == handler_jump;
+        case op_syscall:
+            return decoded->handler == handler_syscall;
+        default:
+            return decoded->opcode == op_invalid &&
+                   decoded->handler == handler_invalid;
+    }
+}
+
+// Whether the fields match the bits they came from, as extractBitSlice()
+// finds them
+static bool expected_fields(uint32_t word,
+                            const decoded_instruction_t *decoded) {
+    if (decoded->s != extractBitSlice(word, 21, 25) ||
+        decoded->t != extractBitSlice(word, 16, 20) ||
+        decoded->d != extractBitSlice(word, 11, 15) ||
+        decoded->shift != extractBitSlice(word, 6, 10)) {
+        return false;
+    }
+    if (decoded->opcode == op_j || decoded->opcode == op_jal) {
+        return (uint32_t)decoded->imm == extractBitSlice(word, 0, 25);
+    }
+    return decoded->imm == (int16_t)extractBitSlice(word, 0, 15);
+}
+
+// Disassembles a decoded instruction the way print_instruction() does
+static void format_decoded(const decoded_instruction_t *decoded, char *text) {
+    const char *name = opcode_name(decoded->opcode);
+    int s = decoded->s;
+    int t = decoded->t;
+    int d = decoded->d;
+    int imm = decoded->imm;
+    switch (decoded->opcode) {
+        case op_add: case op_sub: case op_mul: case op_and: case op_or:
+        case op_xor: case op_slt:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, $%d",
+                     name, d, s, t);
+            break;
+        case op_sllv: case op_srlv:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, $%d",
+                     name, d, t, s);
+            break;
+        case op_addi: case op_andi: case op_ori: case op_xori: case op_slti:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, %d",
+                     name, t, s, imm);
+            break;
+        case op_beq: case op_bne:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, %d",
+                     name, s, t, imm);
+            break;
+        case op_sll: case op_srl:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, %d",
+                     name, d, t, decoded->shift);
+            break;
+        case op_lui:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, %d", name, t, imm);
+            break;
+        case op_lb: case op_lh: case op_lw: case op_sb: case op_sh: case op_sw:
+            // print_instruction() shows the offset unsigned
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, %d($%d)",
+                     name, t, (uint16_t)imm, s);
+            break;
+        case op_blez: case op_bgtz: case op_bltz: case op_bgez:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, %d", name, s, imm);
+            break;
+        case op_j: case op_jal:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s 0x%x", name, imm);
+            break;
+        case op_jr:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d", name, s);
+            break;
+        case op_syscall:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "%s", name);
+            break;
+        default:
+            snprintf(text, INSTRUCTION_TEXT_SIZE, "invalid instruction");
+            break;
+    }
+}
+
+static void report_mismatch(uint32_t word, const char *what,
+                            const char *expected, const char *got) {
+    pthread_mutex_lock(&lock);
+    if (mismatches++ < MAX_REPORTED) {
+        fprintf(stderr, "%08X: %s disagrees: \"%s\" vs \"%s\"\n", word, what,
+                expected, got);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t parse_word(const char *program_name, const char *argument) {
+    char *end;
+    unsigned long long word = strtoull(argument, &end, 0);
+    if (*argument == '\0' || *end != '\0' || word > UINT32_MAX) {
+        fprintf(stderr, "%s: '%s' is not an instruction word\n", program_name,
+                argument);
+        exit(1);
+    }
+    return word;
+}
@@ -0,0 +1,154 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "decode_instruction.h"
+
+// ========================== My Helper Functions ==============================
+// Lookup tables mirroring the switch statements in getCommand(). A zero entry
+// (op_undecoded) means the bits don't identify an instruction on their own.
+static const uint8_t leftSixOpcodes[64] = {
+    [0x1C] = op_mul,
+    [0x08] = op_addi,
+    [0x0C] = op_andi,
+    [0x0D] = op_ori,
+    [0x0E] = op_xori,
+    [0x0A] = op_slti,
+    [0x0F] = op_lui,
+    [0x20] = op_lb,
+    [0x21] = op_lh,
+    [0x23] = op_lw,
+    [0x28] = op_sb,
+    [0x29] = op_sh,
+    [0x2B] = op_sw,
+    [0x04] = op_beq,
+    [0x05] = op_bne,
+    [0x06] = op_blez,
+    [0x07] = op_bgtz,
+    [0x02] = op_j,
+    [0x03] = op_jal,
+};
+
+static const uint8_t rightSixOpcodes[64] = {
+    [0x20] = op_add,
+    [0x22] = op_sub,
+    [0x24] = op_and,
+    [0x25] = op_or,
+    [0x26] = op_xor,
+    [0x04] = op_sllv,
+    [0x06] = op_srlv,
+    [0x2A] = op_slt,
+    [0x00] = op_sll,
+    [0x02] = op_srl,
+    [0x08] = op_jr,
+    [0x0C] = op_syscall,
+};
+
+static const char *const opcodeNames[N_OPCODES] = {
+    [op_undecoded] = "?",   [op_invalid] = "?",
+    [op_add] = "add",       [op_sub] = "sub",       [op_mul] = "mul",
+    [op_and] = "and",       [op_or] = "or",         [op_xor] = "xor",
+    [op_slt] = "slt",       [op_sllv] = "sllv",     [op_srlv] = "srlv",
+    [op_addi] = "addi",     [op_andi] = "andi",     [op_ori] = "ori",
+    [op_xori] = "xori",     [op_slti] = "slti",     [op_sll] = "sll",
+    [op_srl] = "srl",       [op_lui] = "lui",       [op_lb] = "lb",
+    [op_lh] = "lh",         [op_lw] = "lw",         [op_sb] = "sb",
+    [op_sh] = "sh",         [op_sw] = "sw",         [op_beq] = "beq",
+    [op_bne] = "bne",       [op_blez] = "blez",     [op_bgtz] = "bgtz",
+    [op_bltz] = "bltz",     [op_bgez] = "bgez",     [op_j] = "j",
+    [op_jal] = "jal",       [op_jr] = "jr",         [op_syscall] = "syscall",
+};
+
+static handler_t opcodeHandler(opcode_t opcode);
+
+// =============================================================================
+void decode_instruction(uint32_t instruction, decoded_instruction_t *decoded) {
+    uint32_t leftSix = instruction >> 26;
+    opcode_t opcode = op_undecoded;
+    if (leftSix != 0u) {
+        opcode = leftSixOpcodes[leftSix];
+    } else {
+        opcode = rightSixOpcodes[instruction & 0x0000003F];
+    }
+
+    // bltz and bgez share 000001 and are told apart by bits 16 to 20, like
+    // getCommand() does; anything else is invalid
+    if (leftSix == 0x00000001) {
+        uint32_t midFive = (instruction >> 16) & 0x0000001F;
+        if (midFive == 0x00000000) {
+            opcode = op_bltz;
+        } else if (midFive == 0x00000001) {
+            opcode = op_bgez;
+        }
+    }
+    if (opcode == op_undecoded) {
+        opcode = op_invalid;
+    }
+
+    decoded->opcode = opcode;
+    decoded->handler = opcodeHandler(opcode);
+    decoded->s = (instruction >> 21) & 0x1F;
+    decoded->t = (instruction >> 16) & 0x1F;
+    decoded->d = (instruction >> 11) & 0x1F;
+    decoded->shift = (instruction >> 6) & 0x1F;
+    decoded->imm2 = 0;
+    if (opcode == op_j || opcode == op_jal) {
+        decoded->imm = instruction & 0x03FFFFFF;
+    } else {
+        decoded->imm = (int16_t)(instruction & 0xFFFF);
+    }
+}
+
+int make_superinstruction(const decoded_instruction_t *first,
+                          const decoded_instruction_t *second,
+                          decoded_instruction_t *fused) {
+    if (first->opcode == op_add && (first->s == 0 || first->t == 0)) {
+        // add $d, $zero, $s or add $d, $s, $zero
+        *fused = *first;
+        fused->opcode = op_move;
+        fused->s = first->s == 0 ? first->t : first->s;
+        return 1;
+    }
+    if (second == NULL) {
+        return 0;
+    }
+
+    if (first->opcode == op_lui && first->t != 0 &&
+        second->opcode == op_ori && second->s == first->t) {
+        *fused = *first;
+        fused->opcode = op_lui_ori;
+        fused->imm = (uint32_t)first->imm << 16;
+        fused->d = second->t;
+        fused->imm2 = second->imm;
+        return 2;
+    }
+
+    // the branch compares slt's result with $zero, either way round
+    int branchReg = second->s == 0 ? second->t : second->t == 0 ? second->s : 0;
+    if (first->opcode == op_slt && first->d != 0 && branchReg == first->d &&
+        (second->opcode == op_bne || second->opcode == op_beq)) {
+        *fused = *first;
+        fused->opcode = second->opcode == op_bne ? op_slt_bne : op_slt_beq;
+        fused->imm2 = second->imm;
+        return 2;
+    }
+    return 0;
+}
+
+const char *opcode_name(opcode_t opcode) {
+    return opcodeNames[opcode];
+}
+
+static handler_t opcodeHandler(opcode_t opcode) {
+    if (opcode >= op_add && opcode <= op_srl) {
+        return handler_math;
+    } else if (opcode >= op_lui && opcode <= op_sw) {
+        return handler_load_or_store;
+    } else if (opcode >= op_beq && opcode <= op_bgez) {
+        return handler_branch;
+    } else if (opcode >= op_j && opcode <= op_jr) {
+        return handler_jump;
+    } else if (opcode == op_syscall) {
+        return handler_syscall;
+    }
+    return handler_invalid;
+}
+// =============================================================================
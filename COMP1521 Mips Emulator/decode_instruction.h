@@ -0,0 +1,73 @@
+#ifndef DECODE_INSTRUCTION_H
+#define DECODE_INSTRUCTION_H
+
+#include <stdint.h>
+
+// Every instruction the emulator understands. Decoding an instruction word
+// once into one of these saves re-deriving the mnemonic every time the
+// instruction is executed.
+typedef enum opcode {
+    op_undecoded,       // slot in the predecoded text needs (re)decoding
+    op_invalid,         // not an instruction getCommand() recognises
+    op_add, op_sub, op_mul, op_and, op_or, op_xor, op_slt, op_sllv, op_srlv,
+    op_addi, op_andi, op_ori, op_xori, op_slti, op_sll, op_srl,
+    op_lui, op_lb, op_lh, op_lw, op_sb, op_sh, op_sw,
+    op_beq, op_bne, op_blez, op_bgtz, op_bltz, op_bgez,
+    op_j, op_jal, op_jr,
+    op_syscall,
+    N_OPCODES,
+
+    // Superinstructions for what the assembler expands pseudo-instructions
+    // to, made by make_superinstruction().  Only fast_execute.c runs them,
+    // from the text get_fused_text() returns.
+    op_lui_ori = N_OPCODES, // li/la: lui $t, imm >> 16; ori $d, $t, imm2
+    op_slt_bne,             // blt/bgt: slt $d, $s, $t; bne $d, $zero, imm2
+    op_slt_beq,             // bge/ble: slt $d, $s, $t; beq $d, $zero, imm2
+    op_move,                // move: add $d, $zero, $s (one instruction)
+    N_FUSED_OPCODES
+} opcode_t;
+
+// Which of the helpers in `execute_instruction.c' carries out an opcode
+typedef enum handler {
+    handler_invalid,
+    handler_math,
+    handler_load_or_store,
+    handler_branch,
+    handler_jump,
+    handler_syscall
+} handler_t;
+
+// An instruction with all of its fields pulled out ahead of time
+typedef struct decoded_instruction {
+    uint8_t opcode;     // opcode_t
+    uint8_t handler;    // handler_t
+    uint8_t s;
+    uint8_t t;
+    uint8_t d;
+    uint8_t shift;      // shift amount of sll/srl
+    int16_t imm2;       // second instruction's immediate, in superinstructions
+    int32_t imm;        // sign-extended immediate, or the 26 bit jump target
+} decoded_instruction_t;
+
+// Decodes a single instruction word, recognising exactly what getCommand()
+// recognises
+void decode_instruction(uint32_t instruction, decoded_instruction_t *decoded);
+
+// Turns first (and the instruction after it, if second isn't NULL) into a
+// superinstruction if they are one of the sequences above, returning how
+// many instructions *fused stands for, or 0 if they aren't
+int make_superinstruction(const decoded_instruction_t *first,
+                          const decoded_instruction_t *second,
+                          decoded_instruction_t *fused);
+
+// Returns the mnemonic of an opcode, like "blez"
+const char *opcode_name(opcode_t opcode);
+
+// Returns where the j or jal at pc goes: the 26 bit target replaces all but
+// the top four bits of the next instruction's address
+static inline uint32_t jump_target(uint32_t pc,
+                                   const decoded_instruction_t *decoded) {
+    return ((pc + 4) & 0xF0000000) | (uint32_t)decoded->imm << 2;
+}
+
+#endif
@@ -6,6 +6,7 @@
 //
 // // // // // // // DO NOT MODIFY THIS FILE! // // // // // // // // //
 
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,11 +14,20 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "assembly_cache.h"
+#include "batch.h"
+#include "checkpoint.h"
 #include "emu.h"
+#include "fast_execute.h"
+#include "guest_io.h"
+#include "jit.h"
+#include "machine.h"
+#include "profile.h"
 #include "ram.h"
 #include "registers.h"
-
-#define PATH_LENGTH 2048
+#include "stats.h"
+#include "tier.h"
+#include "translate.h"
 
 typedef enum action {
     a_error,
@@ -25,31 +35,124 @@ typedef enum action {
     a_print,
     a_execute,
     a_print_file,
-    a_execute_file
+    a_execute_file,
+    a_written,         // the program was written to a program image file
+    a_batch            // run the jobs in a batch manifest
 } action_t;
 
 static action_t process_arguments(int argc, char *argv[],
-                                  char *spim_asm_filename,
-                                  char *spim_out_filename);
-static int run_or_print_program(action_t action);
-static void run_interactively(uint32_t *program_counter);
-static bool run_command(uint32_t *program_counter, int *program_terminated);
-static void step_program(uint32_t *program_counter, int *program_terminated);
-static void run_program(uint32_t *program_counter, int *program_terminated);
+                                  program_image_t *image);
+static bool read_file(const char *program_name, const char *filename,
+                      char **contents, size_t *length);
+static bool assemble_source(const char *program_name, const char *source_name,
+                            char *source, size_t source_length,
+                            program_image_t *image);
+static int run_or_print_program(emu_machine_t *machine, action_t action);
+static void run_interactively(emu_machine_t *machine);
+static bool run_command(emu_machine_t *machine, int *program_terminated);
+static void step_program(emu_machine_t *machine, int *program_terminated);
+static void run_program(emu_machine_t *machine, int *program_terminated);
+static void run_to_checkpoint(emu_machine_t *machine,
+                              int *program_terminated);
+static void checkpoint_program(emu_machine_t *machine,
+                               int program_terminated);
+static void check_exited(emu_machine_t *machine);
+static void report_profile(emu_machine_t *machine);
+static void report_stats(emu_machine_t *machine);
 static int get_command(void);
 
+// run whole programs a basic block at a time in the plain interpreter instead
+// of with the fast engine
+static bool single_step_engine = false;
+// run whole programs by translating them to native code
+static bool jit_engine = false;
+// run whole programs in the interpreter, compiling hot blocks to an IR
+static bool tier_engine = false;
+// and check each compiled block against the interpreter as it runs
+static bool tier_verify = false;
+// write the assembled program here instead of running it
+static const char *image_filename = NULL;
+// and write it as C, not a program image
+static bool translating = false;
+// report whether the assembly cache was used
+static bool verbose = false;
+// the batch manifest given with -B
+static const char *batch_filename = NULL;
+// count executions of each instruction and report them after running
+static bool profiling = false;
+// also write the counts here, for other programs to read
+static const char *profile_filename = NULL;
+// and the calling contexts here, for flame graph tools
+static const char *folded_filename = NULL;
+// report the emulator's own performance on exit
+static bool stats = false;
+// write a checkpoint here once the program has run checkpoint_at
+// instructions
+static const char *checkpoint_filename = NULL;
+static uint64_t checkpoint_at = 0;
+// the checkpoint given instead of a program, to carry on running
+static const char *resume_filename = NULL;
+// anything on the command line after the command, e.g. the file for C
+static char command_argument[BUFSIZ];
+// how long the program has been running for
+static double run_seconds = 0;
+
 #define EMU_USAGE_MESSAGE                                                      \
     "Usage: emu <file.s>\n"                                                    \
     "   or: emu -p <instructions>\n"                                           \
     "   or: emu -e <instructions>\n"                                           \
     "   or: emu -P <file.s>\n"                                                 \
     "   or: emu -E <file.s>\n"                                                 \
+    "   or: emu -s -E <file.s>\n"                                              \
+    "   or: emu -j -E <file.s>\n"                                              \
+    "   or: emu -t -E <file.s>\n"                                              \
+    "   or: emu -o <file.img> <file.s>\n"                                      \
+    "   or: emu --translate -o <file.c> <file.s>\n"                            \
+    "   or: emu -B <manifest>\n"                                               \
     "\n"                                                                       \
     "Options:\n"                                                               \
     "    -p      print instructions from command-line\n"                       \
     "    -P      print instructions from file\n"                               \
     "    -e      execute instructions from command-line\n"                     \
     "    -E      execute instructions from file\n"                             \
+    "    -s      run a basic block at a time, without the fast engine\n"       \
+    "    -j      translate the program to native code as it runs (x86-64)\n"   \
+    "    -t      compile hot blocks to an optimised IR as the program runs\n"  \
+    "    -o      write the assembled program to a binary program image\n"     \
+    "    -v      report whether the program came from the assembly cache\n"   \
+    "    -B      run the jobs in a manifest in parallel, reporting on each\n"  \
+    "    --profile\n"                                                          \
+    "            after running, report the functions (jal calls, jr $ra\n"    \
+    "            returns), blocks and instructions that ran the most, and\n"   \
+    "            the opcode mix (runs without the JIT)\n"                      \
+    "    --profile-dump=<file>\n"                                              \
+    "            profile, and also write every count to <file>\n"              \
+    "    --profile-folded=<file>\n"                                            \
+    "            profile, and also write folded stacks for flame graphs\n"     \
+    "    --tier-verify\n"                                                      \
+    "            with -t, run each compiled block in lockstep with the\n"      \
+    "            interpreter and report any block that disagrees\n"            \
+    "    --translate\n"                                                        \
+    "            with -o, write the program as C to compile ahead of time\n"   \
+    "            with the emulator's sources (see `make prog.aot')\n"          \
+    "    --stats\n"                                                            \
+    "            on exit, report instructions run, instructions per second\n"  \
+    "            and peak memory use (and, if built with -DEMU_STATS, where\n" \
+    "            the time went and how many addresses were looked up)\n"       \
+    "    --checkpoint=<file>\n"                                                \
+    "            write a checkpoint of the machine to <file> once the\n"       \
+    "            program has run --checkpoint-at instructions (default 0),\n"  \
+    "            then carry on running it\n"                                   \
+    "    --checkpoint-at=<n>\n"                                                \
+    "            how many instructions to run before the checkpoint\n"         \
+    "\n"                                                                       \
+    "Program images written with -o can be given instead of a .s file.\n"     \
+    "So can checkpoints, which carry on from where they were written.\n"       \
+    "Assembled programs are cached in $EMU_CACHE_DIR (default\n"              \
+    "~/.cache/emu); set EMU_CACHE_DIR= to turn the cache off.\n"              \
+    "\n"                                                                       \
+    "Each line of a batch manifest is `program [input [expected-output]]'.\n"  \
+    "Set EMU_BATCH_THREADS to choose how many jobs run at once.\n"             \
     "\n"                                                                       \
     "With no options, `emu' enters interactive mode.\n" EMU_REPL_HELP_MESSAGE  \
     "\n"                                                                       \
@@ -62,11 +165,12 @@ static int get_command(void);
     "    r       execute all remaining instructions\n"                         \
     "    q       quit\n"                                                       \
     "    h       this help message\n"                                          \
-    "    P       print Program\n"                                              \
+    "    P       print Program and its basic blocks\n"                         \
     "    R       print Registers\n"                                            \
     "    D       print Data segment\n"                                         \
     "    S       print Stack segment\n"                                        \
     "    T       print Text segment\n"                                         \
+    "    C file  write a Checkpoint of the machine to file\n"                  \
     "Entering nothing will re-send the previous command.\n"
 
 static void usage(void) {
@@ -75,40 +179,49 @@ static void usage(void) {
 }
 
 int main(int argc, char *argv[]) {
-    char *temporary_directory;
-    char template[] = "/tmp/emu.XXXXXX";
-    if ((temporary_directory = mkdtemp(template)) == NULL) {
-        fprintf(stderr,
-                "%s: can not open create temporary directory: ", argv[0]);
-        perror("");
-        return 1;
-    }
-
-    // atexit could be used here
-    char spim_asm_filename[PATH_LENGTH];
-    snprintf(spim_asm_filename, sizeof spim_asm_filename, "%s/emu.s",
-             temporary_directory);
-    char spim_out_filename[PATH_LENGTH];
-    snprintf(spim_out_filename, sizeof spim_out_filename, "%s/emu.s.out",
-             temporary_directory);
-
-    action_t action =
-        process_arguments(argc, argv, spim_asm_filename, spim_out_filename);
-
-    unlink(spim_asm_filename);
-    unlink(spim_out_filename);
-    rmdir(temporary_directory);
+    program_image_t image;
+    action_t action = process_arguments(argc, argv, &image);
 
     if (action == a_error) {
         return 1;
+    } else if (action == a_written) {
+        return 0;
+    } else if (action == a_batch) {
+        return run_batch(batch_filename,
+                         single_step_engine ? execute_next_block
+                         : jit_engine       ? jit_execute_program
+                         : tier_verify      ? tier_verify_program
+                         : tier_engine      ? tier_execute_program
+                                            : fast_execute_program);
+    }
+
+    emu_machine_t *machine;
+    if (resume_filename) {
+        machine = load_checkpoint(resume_filename, stdin, stdout);
+        if (!machine) {
+            return 1;
+        }
     } else {
-        return run_or_print_program(action);
+        machine = create_machine(&image, stdin, stdout);
+        if (!machine || (profiling && !start_profile(machine, &image))) {
+            perror(argv[0]);
+            return 1;
+        }
+        free_program_image(&image);
+    }
+    // unless emu reads commands from stdin too, a program reading from a
+    // file can read it all from memory
+    if (action == a_execute || action == a_execute_file) {
+        map_input(machine);
     }
+    int status = run_or_print_program(machine, action);
+    report_stats(machine);
+    free_machine(machine);
+    return status;
 }
 
 static action_t process_arguments(int argc, char *argv[],
-                                  char *spim_asm_filename,
-                                  char *spim_out_filename) {
+                                  program_image_t *image) {
     action_t action = a_interactive;
 
     if (argc < 2) {
@@ -116,8 +229,21 @@ static action_t process_arguments(int argc, char *argv[],
         return a_error;
     }
 
+    static const struct option long_options[] = {
+        {"profile", no_argument, NULL, 'f'},
+        {"profile-dump", required_argument, NULL, 'F'},
+        {"profile-folded", required_argument, NULL, 'G'},
+        {"stats", no_argument, NULL, 'S'},
+        {"translate", no_argument, NULL, 'T'},
+        {"tier-verify", no_argument, NULL, 'V'},
+        {"checkpoint", required_argument, NULL, 'K'},
+        {"checkpoint-at", required_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0},
+    };
+
     int c;
-    while ((c = getopt(argc, argv, "pePE")) != -1) {
+    while ((c = getopt_long(argc, argv, "pePEsjto:vB:", long_options, NULL)) !=
+           -1) {
         switch (c) {
         case 'p':
             action = a_print;
@@ -135,30 +261,115 @@ static action_t process_arguments(int argc, char *argv[],
             action = a_execute_file;
             break;
 
+        case 's':
+            single_step_engine = true;
+            break;
+
+        case 'j':
+            jit_engine = true;
+            break;
+
+        case 't':
+            tier_engine = true;
+            break;
+
+        case 'o':
+            image_filename = optarg;
+            break;
+
+        case 'v':
+            verbose = true;
+            break;
+
+        case 'B':
+            batch_filename = optarg;
+            break;
+
+        case 'f':
+            profiling = true;
+            break;
+
+        case 'F':
+            profiling = true;
+            profile_filename = optarg;
+            break;
+
+        case 'G':
+            profiling = true;
+            folded_filename = optarg;
+            break;
+
+        case 'S':
+            stats = true;
+            break;
+
+        case 'T':
+            translating = true;
+            break;
+
+        case 'V':
+            tier_engine = true;
+            tier_verify = true;
+            break;
+
+        case 'K':
+            checkpoint_filename = optarg;
+            break;
+
+        case 'A': {
+            char *endptr;
+            checkpoint_at = strtoull(optarg, &endptr, 0);
+            if (!optarg[0] || *endptr) {
+                usage();
+                return a_error;
+            }
+            break;
+        }
+
         default:
             usage();
             return a_error;
         }
     }
 
-    FILE *asm_stream = fopen(spim_asm_filename, "w");
-    if (!asm_stream) {
-        fprintf(stderr, "%s: can not open '%s': ", argv[0], spim_out_filename);
-        perror("");
+    if (translating && !image_filename) {
+        usage();
         return a_error;
     }
 
+    if (batch_filename) {
+        if (optind != argc) {
+            usage();
+            return a_error;
+        }
+        return a_batch;
+    }
+
     if (action == a_print || action == a_execute) {
-        fputs("main:\n", asm_stream);
+        char *source;
+        size_t source_length;
+        FILE *source_stream = open_memstream(&source, &source_length);
+        if (!source_stream) {
+            perror(argv[0]);
+            return a_error;
+        }
+
+        fputs("main:\n", source_stream);
         for (int arg = optind; arg < argc; arg++) {
             char *endptr;
             strtol(argv[arg], &endptr, 0);
             // if we are given a hex or decimal integer turn into a word directive
             if (argv[arg][0] && !*endptr) {
-                fputs(".word ", asm_stream);
+                fputs(".word ", source_stream);
             }
-            fputs(argv[arg], asm_stream);
-            fputc('\n', asm_stream);
+            fputs(argv[arg], source_stream);
+            fputc('\n', source_stream);
+        }
+        fclose(source_stream);
+
+        if (!assemble_source(argv[0], "<command-line>", source, source_length,
+                             image)) {
+            return a_error;
         }
     } else {
         if (optind != argc - 1) {
@@ -166,144 +377,274 @@ static action_t process_arguments(int argc, char *argv[],
             return a_error;
         }
 
-        FILE *in = fopen(argv[optind], "r");
-        if (!in) {
-            fprintf(stderr, "%s: can not open '%s': ", argv[0], argv[optind]);
-            perror("");
-            return a_error;
+        // a checkpoint is loaded in main instead of a program
+        if (is_checkpoint(argv[optind])) {
+            if (image_filename || profiling) {
+                fprintf(stderr,
+                        "%s: can not write or profile a checkpoint\n",
+                        argv[0]);
+                return a_error;
+            }
+            resume_filename = argv[optind];
+            return action;
         }
 
-        int byte;
-        while ((byte = fgetc(in)) != EOF) {
-            fputc(byte, asm_stream);
+        // a program image is used as it is, anything else is assembled
+        int mapped = map_program_image(argv[optind], image);
+        if (mapped < 0) {
+            return a_error;
+        } else if (mapped == 0) {
+            char *source;
+            size_t source_length;
+            if (!read_file(argv[0], argv[optind], &source, &source_length) ||
+                !assemble_source(argv[0], argv[optind], source, source_length,
+                                 image)) {
+                return a_error;
+            }
         }
-        fclose(in);
     }
-    fclose(asm_stream);
-
-    char assemble_command[256 + PATH_LENGTH];
-    snprintf(assemble_command, sizeof assemble_command,
-             "PATH=/home/cs1521/bin:$PATH spim -assemble -f %s >/dev/null",
-             spim_asm_filename);
-    int exit_status = system(assemble_command);
 
-    if (exit_status != 0) {
-        fprintf(stderr, "%s: could not assemble program\n", argv[0]);
-        return a_error;
+    if (image_filename) {
+        const char *source_name = action == a_print || action == a_execute
+                                      ? "<command-line>"
+                                      : argv[optind];
+        int written = translating
+                          ? translate_program(image, source_name,
+                                              image_filename)
+                          : write_program_image(image, image_filename);
+        free_program_image(image);
+        return written == 0 ? a_written : a_error;
     }
 
-    FILE *out_stream = fopen(spim_out_filename, "r");
-    if (!out_stream) {
-        fprintf(stderr, "%s: can not open '%s': ", argv[0], spim_out_filename);
-        perror("");
-        return a_error;
-    }
-    read_program(out_stream);
-    fclose(out_stream);
-
     return action;
 }
 
-static int run_or_print_program(action_t action) {
-    // set the stack pointer the same as SPIM does for consistency.
-    set_register(sp, 0x7FFFF8E4);
-
-    // set the same return address as SPIM does for consistency
-    // this is outside out text area so program will terminate on return
-    // in SPIM this is the kernel text segment
-    set_register(ra, 0x00400018);
-
-    // set the global pointer the same as SPIM does for consistency
-    set_register(gp, 0x10008000);
+// Assembles and then frees source
+static bool assemble_source(const char *program_name, const char *source_name,
+                            char *source, size_t source_length,
+                            program_image_t *image) {
+    assembly_cache_result_t cache_result;
+    int assembled = assemble_program_cached(source_name, source, source_length,
+                                            image, &cache_result);
+    free(source);
+    if (verbose) {
+        print_assembly_cache_result(stderr, source_name, cache_result);
+    }
+    if (assembled != 0) {
+        fprintf(stderr, "%s: could not assemble program\n", program_name);
+        return false;
+    }
+    return true;
+}
 
-    // set the frame pointer the same as SPIM does for consistency
-    // set_register(fp, 0x0);
+// Reads the whole of a file into a malloc'd buffer
+static bool read_file(const char *program_name, const char *filename,
+                      char **contents, size_t *length) {
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        fprintf(stderr, "%s: can not open '%s': ", program_name, filename);
+        perror("");
+        return false;
+    }
 
-    // set the PC to the same as SPIM so we can run code
-    uint32_t program_counter = 0x400024;
+    size_t capacity = BUFSIZ;
+    *contents = malloc(capacity);
+    *length = 0;
+    while (*contents) {
+        *length += fread(*contents + *length, 1, capacity - *length, in);
+        if (*length < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char *bigger = realloc(*contents, capacity);
+        if (!bigger) {
+            free(*contents);
+        }
+        *contents = bigger;
+    }
 
-    // set t1..t7 to non-zero values to facilitate testing
-    for (int i = 9; i < 16; i++) {
-        set_register(i, i - 8);
+    bool ok = *contents && !ferror(in);
+    if (!ok) {
+        fprintf(stderr, "%s: can not read '%s'\n", program_name, filename);
+        free(*contents);
     }
+    fclose(in);
+    return ok;
+}
 
+static int run_or_print_program(emu_machine_t *machine, action_t action) {
     int program_terminated = 0;
     if (action == a_print || action == a_print_file) {
-        print_program();
+        print_program(machine);
     } else if (action == a_execute || action == a_execute_file) {
-        if (get_text_segment_length() == 4) {
+        if (get_text_segment_length(machine) == 4) {
             // if we have a single instruction
             // exit even if doesn't update PC
-            step_program(&program_counter, &program_terminated);
+            step_program(machine, &program_terminated);
         } else {
-            run_program(&program_counter, &program_terminated);
+            run_program(machine, &program_terminated);
         }
         if (action == a_execute) {
-            print_registers();
+            print_registers(machine);
         }
     } else {
-        run_interactively(&program_counter);
+        run_interactively(machine);
     }
 
     return 0;
 }
 
 // interactive mode:
-static void run_interactively(uint32_t *program_counter) {
+static void run_interactively(emu_machine_t *machine) {
     int program_terminated = 0;
     while (true) {
         if (!program_terminated) {
             printf("PC = ");
-            print_instruction_at_address(*program_counter);
+            print_instruction_at_address(machine, machine->program_counter);
         }
 
-        if (!run_command(program_counter, &program_terminated)) {
+        if (!run_command(machine, &program_terminated)) {
             break;
         }
     }
 }
 
-static void step_program(uint32_t *program_counter, int *program_terminated) {
+static void step_program(emu_machine_t *machine, int *program_terminated) {
     if (*program_terminated) {
         printf("Can not step - program terminated.\n");
     } else {
-        *program_terminated = execute_next_instruction(program_counter);
+        double start = stats_seconds();
+        *program_terminated = run_guarded(machine, execute_next_instruction);
+        run_seconds += stats_seconds() - start;
+        flush_output(machine);
+        check_exited(machine);
     }
 }
 
-static void run_program(uint32_t *program_counter, int *program_terminated) {
+static void run_program(emu_machine_t *machine, int *program_terminated) {
     if (*program_terminated) {
         printf("Can not run - program terminated.\n");
+        return;
+    }
+    double start = stats_seconds();
+    if (checkpoint_filename) {
+        run_to_checkpoint(machine, program_terminated);
     }
     while (!*program_terminated) {
-        step_program(program_counter, program_terminated);
+        if (single_step_engine) {
+            *program_terminated = run_guarded(machine, execute_next_block);
+        } else if (jit_engine) {
+            *program_terminated = run_guarded(machine, jit_execute_program);
+        } else if (tier_verify) {
+            *program_terminated = run_guarded(machine, tier_verify_program);
+        } else if (tier_engine) {
+            *program_terminated = run_guarded(machine, tier_execute_program);
+        } else {
+            *program_terminated = run_guarded(machine, fast_execute_program);
+        }
+        if (machine->exited) {
+            run_seconds += stats_seconds() - start;
+            flush_output(machine);
+            check_exited(machine);
+        }
+    }
+    run_seconds += stats_seconds() - start;
+    flush_output(machine);
+    report_profile(machine);
+}
+
+// Runs the program an instruction at a time until it has run
+// --checkpoint-at instructions, then writes the --checkpoint file
+static void run_to_checkpoint(emu_machine_t *machine,
+                              int *program_terminated) {
+    while (!*program_terminated &&
+           machine->instruction_count < checkpoint_at) {
+        *program_terminated = run_guarded(machine, execute_next_instruction);
     }
+    if (*program_terminated) {
+        flush_output(machine);
+        fprintf(stderr,
+                "%s not written: the program stopped after %llu "
+                "instructions\n",
+                checkpoint_filename,
+                (unsigned long long)machine->instruction_count);
+    } else {
+        write_checkpoint(machine, checkpoint_filename);
+    }
+    checkpoint_filename = NULL;
+    flush_output(machine);
+    check_exited(machine);
 }
 
-static bool run_command(uint32_t *program_counter, int *program_terminated) {
+static void checkpoint_program(emu_machine_t *machine,
+                               int program_terminated) {
+    if (program_terminated) {
+        printf("Can not checkpoint - program terminated.\n");
+    } else if (!command_argument[0]) {
+        printf("Usage: C <file>\n");
+    } else if (write_checkpoint(machine, command_argument) == 0) {
+        printf("Checkpoint written to %s\n", command_argument);
+    }
+}
+
+// The exit syscall ends emu too
+static void check_exited(emu_machine_t *machine) {
+    if (machine->exited) {
+        report_profile(machine);
+        report_stats(machine);
+        free_machine(machine);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+// After running, if profiling
+static void report_profile(emu_machine_t *machine) {
+    if (machine->profile != NULL) {
+        print_profile(machine);
+        if (profile_filename) {
+            write_profile(machine, profile_filename);
+        }
+        if (folded_filename) {
+            write_profile_folded(machine, folded_filename);
+        }
+    }
+}
+
+// On exit, if asked for
+static void report_stats(emu_machine_t *machine) {
+    if (stats) {
+        print_stats(stderr, machine, run_seconds);
+    }
+}
+
+static bool run_command(emu_machine_t *machine, int *program_terminated) {
     int command = get_command();
 
     switch (command) {
     case 's':
-        step_program(program_counter, program_terminated);
+        step_program(machine, program_terminated);
         break;
     case 'r':
-        run_program(program_counter, program_terminated);
+        run_program(machine, program_terminated);
         break;
     case 'P':
-        print_program();
+        print_program(machine);
+        print_program_cfg(machine);
         break;
     case 'R':
-        print_registers();
+        print_registers(machine);
         break;
     case 'D':
-        print_data_segment();
+        print_data_segment(machine);
         break;
     case 'S':
-        print_stack_segment();
+        print_stack_segment(machine);
         break;
     case 'T':
-        print_text_segment();
+        print_text_segment(machine);
+        break;
+    case 'C':
+        checkpoint_program(machine, *program_terminated);
         break;
     case 'h':
     case '?':
@@ -335,6 +676,10 @@ static int get_command(void) {
     char c;
     if (sscanf(input, " %c", &c) == 1) {
         last_command = c;
+        char *argument = strchr(input, c) + 1;
+        argument += strspn(argument, " \t");
+        argument[strcspn(argument, "\r\n")] = '\0';
+        strcpy(command_argument, argument);
         return c;
     } else {
         return last_command;
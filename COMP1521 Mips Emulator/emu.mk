@@ -2,15 +2,82 @@ EXERCISES	+= emu
 CLEAN_FILES	+= emu emu.o $(addsuffix .o, $(basename ${SRCS.emu}))
 SRCS.emu	 = # emu.c  ##  for various reasons, this automatically appears
 SRCS.emu	+= ram.c registers.c execute_instruction.c print_instruction.c bitextract.c
+SRCS.emu	+= decode_instruction.c fast_execute.c jit.c
+SRCS.emu	+= assembler.c assembly_cache.c program_image.c machine.c batch.c
+SRCS.emu	+= profile.c stats.c guest_io.c translate.c tier.c cfg.c checkpoint.c
 SRCS.emu	+= # <<< if you add C files, add them to the list here.
 
+# Build with `make CPPFLAGS=-DEMU_GUARD_PAGES' to back guest memory with a
+# reserved 4 GiB address range and guard pages instead of a page table.
+# Build with `make CPPFLAGS=-DEMU_STATS' to have `--stats' report where the
+# time goes, at the cost of timing every load, store and syscall.
+
+# The batch runner (-B) runs jobs on several threads.
+LDLIBS		+= -pthread
+
+# `make check-decoder' runs every possible instruction word through both
+# decoders and the disassembler, checks they agree, and reports how fast
+# each decodes. Pass a range to look at fewer, like
+# `make check-decoder DECODE_CHECK_RANGE="0x00000000 0x0FFFFFFF"'.
+CLEAN_FILES	+= decode_check
+DECODE_CHECK_RANGE ?=
+.PHONY:		check-decoder
+check-decoder:	decode_check
+	./decode_check ${DECODE_CHECK_RANGE}
+
+# `make prog.aot' translates prog.s to C with `emu --translate' and compiles
+# it, with everything but emu.c, into a program that runs prog.s natively.
+AOT_CFLAGS	?= -O2
+CLEAN_FILES	+= *.aot *.aot.c
+.PRECIOUS:	%.aot.c
+%.aot.c:	%.s emu
+	./emu --translate -o $@ $<
+%.aot:		%.aot.c ${SRCS.emu}
+	${CC} ${AOT_CFLAGS} ${CPPFLAGS} -I. -o $@ $^ ${LDLIBS}
+
+# `make bench' times the programs in bench/ and writes bench-results.txt,
+# which can be diffed against the results from another build.
+BENCH_REPEATS	?= 5
+BENCH_RESULTS	?= bench-results.txt
+CLEAN_FILES	+= ${BENCH_RESULTS}
+.PHONY:		bench
+bench:		emu
+	sh bench/bench.sh ./emu ${BENCH_REPEATS} | tee ${BENCH_RESULTS}
+
 # Force only .c -> executable compilations (to preserve dcc analysis).
 .SUFFIXES:
 .SUFFIXES: .c
 
 emu:			${SRCS.emu}
-emu.o:			emu.c emu.h ram.h registers.h
-ram.o:			ram.c emu.h ram.h
-registers.o:		registers.c registers.h
-execute_instruction.o:	execute_instruction.c emu.h
+emu.o:			emu.c emu.h ram.h registers.h fast_execute.h jit.h assembly_cache.h \
+			program_image.h machine.h batch.h profile.h stats.h guest_io.h \
+			translate.h tier.h checkpoint.h
+ram.o:			ram.c emu.h ram.h decode_instruction.h program_image.h machine.h \
+			profile.h stats.h cfg.h
+registers.o:		registers.c registers.h machine.h
+execute_instruction.o:	execute_instruction.c emu.h decode_instruction.h machine.h stats.h \
+			guest_io.h
 print_instruction.o:	print_instruction.c emu.h 
+decode_instruction.o:	decode_instruction.c decode_instruction.h
+fast_execute.o:		fast_execute.c fast_execute.h emu.h ram.h registers.h machine.h \
+			profile.h stats.h
+jit.o:			jit.c jit.h fast_execute.h emu.h ram.h registers.h machine.h stats.h
+assembler.o:		assembler.c assembler.h program_image.h registers.h
+program_image.o:	program_image.c program_image.h
+assembly_cache.o:	assembly_cache.c assembly_cache.h assembler.h program_image.h
+machine.o:		machine.c machine.h jit.h ram.h registers.h program_image.h \
+			profile.h stats.h guest_io.h tier.h
+batch.o:		batch.c batch.h assembly_cache.h machine.h ram.h program_image.h \
+			guest_io.h checkpoint.h
+profile.o:		profile.c profile.h decode_instruction.h machine.h ram.h \
+			registers.h program_image.h
+stats.o:		stats.c stats.h machine.h
+guest_io.o:		guest_io.c guest_io.h machine.h ram.h
+tier.o:			tier.c tier.h fast_execute.h emu.h ram.h registers.h \
+			decode_instruction.h machine.h stats.h
+translate.o:		translate.c translate.h decode_instruction.h machine.h \
+			print_instruction.h ram.h
+cfg.o:			cfg.c cfg.h decode_instruction.h
+checkpoint.o:		checkpoint.c checkpoint.h guest_io.h machine.h ram.h \
+			registers.h stats.h
+decode_check:		decode_check.c decode_instruction.c bitextract.c print_instruction.c
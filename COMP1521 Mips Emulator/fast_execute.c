@@ -0,0 +1,270 @@
+#include <stdint.h>
+#include "emu.h"
+#include "ram.h"
+#include "registers.h"
+#include "decode_instruction.h"
+#include "fast_execute.h"
+#include "profile.h"
+#include "stats.h"
+
+// Use direct threading (a jump straight to the next opcode's code) where the
+// compiler supports taking the address of a label, otherwise a switch
+#if defined(__GNUC__) && !defined(EMU_NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO 1
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(opcode) target_##opcode
+#define DISPATCH() goto *dispatch[instruction->opcode]
+#define NEXT()                                                           \
+    do {                                                                 \
+        FETCH();                                                         \
+        DISPATCH();                                                      \
+    } while (0)
+#else
+#define TARGET(opcode) case opcode
+#define DISPATCH() continue
+#define NEXT() continue
+#endif
+
+// Looks up the next instruction, leaving the loop if the program counter
+// isn't pointing at a word of the text segment
+#define FETCH()                                                          \
+    do {                                                                 \
+        offset = pc - textFirstAddress;                                  \
+        if (offset >= textLength || offset % 4 != 0) {                   \
+            goto leave;                                                  \
+        }                                                                \
+        instruction = &text[offset / 4];                                 \
+        executed++;                                                      \
+    } while (0)
+
+// Counts the instruction about to run, decoding it first if need be so it
+// is counted as what it really is
+#define PROFILE()                                                        \
+    do {                                                                 \
+        if (instruction->opcode == op_undecoded) {                       \
+            decode_text_word(machine, pc);                               \
+        }                                                                \
+        profile_instruction(profile, offset, instruction);               \
+    } while (0)
+
+// $zero is kept zero by undoing any write to it straight away
+#define WRITE(reg, value)                                                \
+    do {                                                                 \
+        r[reg] = (value);                                                \
+        r[zero] = 0;                                                     \
+    } while (0)
+
+#define S (r[instruction->s])
+#define T (r[instruction->t])
+#define IMM (instruction->imm)
+
+// =============================================================================
+int fast_execute_program(emu_machine_t *machine) {
+    uint32_t textFirstAddress;
+    uint32_t textLength;
+    emu_profile_t *profile = machine->profile;
+    // the profiler counts each instruction of a superinstruction, so only
+    // gets the plain decoding
+    decoded_instruction_t *text =
+        profile ? get_decoded_text(machine, &textFirstAddress, &textLength)
+                : get_fused_text(machine, &textFirstAddress, &textLength);
+    const decoded_instruction_t *instruction;
+    uint32_t offset;
+    uint32_t pc = machine->program_counter;
+    uint32_t *r = machine->registers;
+    // added to machine->instruction_count on the way out
+    uint64_t executed = 0;
+
+#ifdef USE_COMPUTED_GOTO
+    static const void *const dispatchTable[N_FUSED_OPCODES] = {
+        [op_undecoded] = &&TARGET(op_undecoded),
+        [op_invalid] = &&TARGET(op_invalid),
+        [op_add] = &&TARGET(op_add),    [op_sub] = &&TARGET(op_sub),
+        [op_mul] = &&TARGET(op_mul),    [op_and] = &&TARGET(op_and),
+        [op_or] = &&TARGET(op_or),      [op_xor] = &&TARGET(op_xor),
+        [op_slt] = &&TARGET(op_slt),    [op_sllv] = &&TARGET(op_sllv),
+        [op_srlv] = &&TARGET(op_srlv),  [op_addi] = &&TARGET(op_addi),
+        [op_andi] = &&TARGET(op_andi),  [op_ori] = &&TARGET(op_ori),
+        [op_xori] = &&TARGET(op_xori),  [op_slti] = &&TARGET(op_slti),
+        [op_sll] = &&TARGET(op_sll),    [op_srl] = &&TARGET(op_srl),
+        [op_lui] = &&TARGET(op_lui),    [op_lb] = &&TARGET(op_lb),
+        [op_lh] = &&TARGET(op_lh),      [op_lw] = &&TARGET(op_lw),
+        [op_sb] = &&TARGET(op_sb),      [op_sh] = &&TARGET(op_sh),
+        [op_sw] = &&TARGET(op_sw),      [op_beq] = &&TARGET(op_beq),
+        [op_bne] = &&TARGET(op_bne),    [op_blez] = &&TARGET(op_blez),
+        [op_bgtz] = &&TARGET(op_bgtz),  [op_bltz] = &&TARGET(op_bltz),
+        [op_bgez] = &&TARGET(op_bgez),  [op_j] = &&TARGET(op_j),
+        [op_jal] = &&TARGET(op_jal),    [op_jr] = &&TARGET(op_jr),
+        [op_syscall] = &&TARGET(op_syscall),
+        [op_lui_ori] = &&TARGET(op_lui_ori),
+        [op_slt_bne] = &&TARGET(op_slt_bne),
+        [op_slt_beq] = &&TARGET(op_slt_beq),
+        [op_move] = &&TARGET(op_move),
+    };
+    // while profiling every opcode goes through countInstruction first, so
+    // running without the profiler doesn't pay for it
+    static const void *const profileTable[N_OPCODES] = {
+        [0 ... N_OPCODES - 1] = &&countInstruction,
+    };
+    const void *const *dispatch = profile ? profileTable : dispatchTable;
+    NEXT();
+
+countInstruction:
+    PROFILE();
+    goto *dispatchTable[instruction->opcode];
+#else
+    for (;;) {
+        FETCH();
+        if (profile != NULL) {
+            PROFILE();
+        }
+        switch (instruction->opcode) {
+#endif
+
+    TARGET(op_add):  WRITE(instruction->d, S + T);  pc += 4; NEXT();
+    TARGET(op_sub):  WRITE(instruction->d, S - T);  pc += 4; NEXT();
+    TARGET(op_mul):  WRITE(instruction->d, S * T);  pc += 4; NEXT();
+    TARGET(op_and):  WRITE(instruction->d, S & T);  pc += 4; NEXT();
+    TARGET(op_or):   WRITE(instruction->d, S | T);  pc += 4; NEXT();
+    TARGET(op_xor):  WRITE(instruction->d, S ^ T);  pc += 4; NEXT();
+    TARGET(op_slt):
+        WRITE(instruction->d, (int32_t)S < (int32_t)T);
+        pc += 4;
+        NEXT();
+    TARGET(op_sllv): WRITE(instruction->d, T << (S & 0x1F)); pc += 4; NEXT();
+    TARGET(op_srlv):
+        WRITE(instruction->d, (int32_t)T >> (S & 0x1F));
+        pc += 4;
+        NEXT();
+    TARGET(op_addi): WRITE(instruction->t, S + IMM); pc += 4; NEXT();
+    TARGET(op_andi): WRITE(instruction->t, S & IMM); pc += 4; NEXT();
+    TARGET(op_ori):  WRITE(instruction->t, S | IMM); pc += 4; NEXT();
+    TARGET(op_xori): WRITE(instruction->t, S ^ IMM); pc += 4; NEXT();
+    TARGET(op_slti): WRITE(instruction->t, (int32_t)S < IMM); pc += 4; NEXT();
+    TARGET(op_sll):
+        WRITE(instruction->d, T << instruction->shift);
+        pc += 4;
+        NEXT();
+    TARGET(op_srl):
+        WRITE(instruction->d, (int32_t)T >> instruction->shift);
+        pc += 4;
+        NEXT();
+
+    TARGET(op_lui): WRITE(instruction->t, (uint32_t)IMM << 16); pc += 4; NEXT();
+    TARGET(op_lb):
+        STATS_TIME(machine, stats_memory,
+                   WRITE(instruction->t, (int8_t)get_byte(machine, S + IMM)));
+        pc += 4;
+        NEXT();
+    TARGET(op_lh):
+        STATS_TIME(machine, stats_memory,
+                   WRITE(instruction->t, (int16_t)get_half(machine, S + IMM)));
+        pc += 4;
+        NEXT();
+    TARGET(op_lw):
+        STATS_TIME(machine, stats_memory,
+                   WRITE(instruction->t, get_word(machine, S + IMM)));
+        pc += 4;
+        NEXT();
+    TARGET(op_sb):
+        STATS_TIME(machine, stats_memory, set_byte(machine, S + IMM, T));
+        pc += 4;
+        NEXT();
+    TARGET(op_sh):
+        STATS_TIME(machine, stats_memory, set_half(machine, S + IMM, T));
+        pc += 4;
+        NEXT();
+    TARGET(op_sw):
+        STATS_TIME(machine, stats_memory, set_word(machine, S + IMM, T));
+        pc += 4;
+        NEXT();
+
+    TARGET(op_beq):
+        pc += (S == T) ? IMM * 4 : 4;
+        NEXT();
+    TARGET(op_bne):
+        pc += (S != T) ? IMM * 4 : 4;
+        NEXT();
+    TARGET(op_blez):
+        pc += ((int32_t)S <= 0) ? IMM * 4 : 4;
+        NEXT();
+    TARGET(op_bgtz):
+        pc += ((int32_t)S > 0) ? IMM * 4 : 4;
+        NEXT();
+    TARGET(op_bltz):
+        pc += ((int32_t)S < 0) ? IMM * 4 : 4;
+        NEXT();
+    TARGET(op_bgez):
+        pc += ((int32_t)S >= 0) ? IMM * 4 : 4;
+        NEXT();
+
+    TARGET(op_j):
+        pc = jump_target(pc, instruction);
+        NEXT();
+    TARGET(op_jal):
+        WRITE(ra, pc + 4);
+        pc = jump_target(pc, instruction);
+        NEXT();
+    TARGET(op_jr):
+        pc = S;
+        NEXT();
+
+    // Superinstructions, each counted as the instructions it replaces
+    TARGET(op_lui_ori):
+        WRITE(instruction->t, (uint32_t)IMM);
+        WRITE(instruction->d, (uint32_t)IMM | (int32_t)instruction->imm2);
+        executed++;
+        pc += 8;
+        NEXT();
+    TARGET(op_slt_bne): {
+        uint32_t less = (int32_t)S < (int32_t)T;
+        WRITE(instruction->d, less);
+        executed++;
+        pc += less ? 4 + instruction->imm2 * 4 : 8;
+        NEXT();
+    }
+    TARGET(op_slt_beq): {
+        uint32_t less = (int32_t)S < (int32_t)T;
+        WRITE(instruction->d, less);
+        executed++;
+        pc += less ? 8 : 4 + instruction->imm2 * 4;
+        NEXT();
+    }
+    TARGET(op_move): WRITE(instruction->d, S); pc += 4; NEXT();
+
+    TARGET(op_undecoded):
+        // the program wrote to this word since it was last decoded
+        decode_text_word(machine, pc);
+        DISPATCH();
+
+    // Leave the loop and let the slow path deal with these
+    TARGET(op_syscall):
+    TARGET(op_invalid):
+#ifndef USE_COMPUTED_GOTO
+        default:
+#endif
+        machine->program_counter = pc;
+        if (execute_decoded_instruction(machine, instruction)) {
+            machine->instruction_count += executed;
+            return 1;
+        }
+        pc = machine->program_counter;
+        NEXT();
+
+#ifndef USE_COMPUTED_GOTO
+        }
+    }
+#endif
+
+leave:
+    machine->program_counter = pc;
+    machine->instruction_count += executed;
+    if (offset < textLength) {
+        // not word aligned, let the slow path execute it
+        return execute_next_instruction(machine);
+    }
+    return -1;
+}
+// =============================================================================
@@ -0,0 +1,17 @@
+#ifndef FAST_EXECUTE_H
+#define FAST_EXECUTE_H
+
+#include <stdint.h>
+#include "machine.h"
+
+// Runs the machine's program from the predecoded text segment until it stops
+// being able to run it without help, keeping the program counter in a local
+// variable and working on the register file directly in the meantime.
+//
+// Returns the same as execute_next_instruction():
+//     -1 if the program counter leaves the text segment
+//      1 for syscall exit
+//      0 if the caller should call this function again
+int fast_execute_program(emu_machine_t *machine);
+
+#endif
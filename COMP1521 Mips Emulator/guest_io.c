@@ -0,0 +1,228 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "guest_io.h"
+#include "machine.h"
+#include "ram.h"
+
+static void output_bytes(emu_machine_t *machine, const void *bytes,
+                         size_t length);
+static int32_t stream_int(emu_machine_t *machine);
+static bool is_space(char c);
+
+void output_int(emu_machine_t *machine, int32_t value) {
+    // filled in from the end, "-2147483648" at the longest
+    char digits[11];
+    char *first = digits + sizeof digits;
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    do {
+        *--first = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--first = '-';
+    }
+    output_bytes(machine, first, digits + sizeof digits - first);
+}
+
+void output_string(emu_machine_t *machine, uint32_t address) {
+    // copy a segment's worth at a time, up to the NUL
+    for (;;) {
+        uint32_t length;
+        const uint8_t *bytes = get_bytes(machine, address, &length);
+        if (bytes == NULL) {
+            // get_byte reports the invalid address, and reads it as a NUL
+            get_byte(machine, address);
+            return;
+        }
+        const uint8_t *nul = memchr(bytes, '\0', length);
+        if (nul != NULL) {
+            output_bytes(machine, bytes, nul - bytes);
+            return;
+        }
+        output_bytes(machine, bytes, length);
+        address += length;
+    }
+}
+
+void output_char(emu_machine_t *machine, uint8_t c) {
+    if (machine->output_length == OUTPUT_BUFFER_SIZE) {
+        flush_output(machine);
+    }
+    machine->output_buffer[machine->output_length++] = c;
+}
+
+void flush_output(emu_machine_t *machine) {
+    if (machine->output == NULL) {
+        // between batch jobs, see `batch.c'
+        return;
+    }
+    if (machine->output_length > 0) {
+        fwrite(machine->output_buffer, 1, machine->output_length,
+               machine->output);
+        machine->output_length = 0;
+    }
+    fflush(machine->output);
+}
+
+static void output_bytes(emu_machine_t *machine, const void *bytes,
+                         size_t length) {
+    if (length > OUTPUT_BUFFER_SIZE - machine->output_length) {
+        flush_output(machine);
+        if (length >= OUTPUT_BUFFER_SIZE) {
+            fwrite(bytes, 1, length, machine->output);
+            return;
+        }
+    }
+    memcpy(machine->output_buffer + machine->output_length, bytes, length);
+    machine->output_length += length;
+}
+
+bool map_input(emu_machine_t *machine) {
+    struct stat status;
+    int fd = fileno(machine->input);
+    if (fd < 0 || fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        return false;
+    }
+    // carry on from wherever stdio has got to
+    off_t position = ftello(machine->input);
+    if (position < 0) {
+        return false;
+    }
+    if (status.st_size == 0) {
+        set_input_buffer(machine, "", 0);
+        return true;
+    }
+    void *bytes = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (bytes == MAP_FAILED) {
+        return false;
+    }
+    madvise(bytes, status.st_size, MADV_SEQUENTIAL);
+    set_input_buffer(machine, bytes, status.st_size);
+    machine->input_position =
+        position < status.st_size ? (size_t)position : (size_t)status.st_size;
+    machine->input_mapped = true;
+    return true;
+}
+
+void set_input_buffer(emu_machine_t *machine, const char *bytes,
+                      size_t length) {
+    free_input(machine);
+    machine->input_bytes = bytes;
+    machine->input_length = length;
+    machine->input_position = 0;
+}
+
+void free_input(emu_machine_t *machine) {
+    if (machine->input_mapped) {
+        munmap((void *)machine->input_bytes, machine->input_length);
+        machine->input_mapped = false;
+    }
+    machine->input_bytes = NULL;
+}
+
+int32_t input_int(emu_machine_t *machine) {
+    if (machine->input_bytes == NULL) {
+        flush_output(machine);
+        return stream_int(machine);
+    }
+
+    // the same as scanf("%d"), except that too many digits wrap around
+    const char *bytes = machine->input_bytes;
+    size_t length = machine->input_length;
+    size_t i = machine->input_position;
+    while (i < length && is_space(bytes[i])) {
+        i++;
+    }
+    bool negative = false;
+    if (i < length && (bytes[i] == '-' || bytes[i] == '+')) {
+        negative = bytes[i] == '-';
+        i++;
+    }
+    uint32_t value = 0;
+    while (i < length && bytes[i] >= '0' && bytes[i] <= '9') {
+        value = value * 10 + (bytes[i] - '0');
+        i++;
+    }
+    machine->input_position = i;
+    return negative ? -value : value;
+}
+
+void input_string(emu_machine_t *machine, uint32_t address, uint32_t length) {
+    if (machine->input_bytes != NULL) {
+        size_t available = machine->input_length - machine->input_position;
+        uint32_t n = length < available ? length : available;
+        set_bytes(machine, address,
+                  (const uint8_t *)machine->input_bytes +
+                      machine->input_position, n);
+        machine->input_position += n;
+        address += n;
+        length -= n;
+    } else {
+        flush_output(machine);
+    }
+
+    // a chunk at a time from the stream, and EOF (0xFF) past its end
+    uint8_t chunk[BUFSIZ];
+    while (length > 0) {
+        size_t n = length < sizeof chunk ? length : sizeof chunk;
+        size_t got = 0;
+        if (machine->input_bytes == NULL) {
+            got = fread(chunk, 1, n, machine->input);
+            machine->input_position += got;
+        }
+        memset(chunk + got, (uint8_t)EOF, n - got);
+        set_bytes(machine, address, chunk, n);
+        address += n;
+        length -= n;
+    }
+}
+
+int32_t input_char(emu_machine_t *machine) {
+    if (machine->input_bytes == NULL) {
+        flush_output(machine);
+        int c = getc(machine->input);
+        if (c != EOF) {
+            machine->input_position++;
+        }
+        return c;
+    }
+    if (machine->input_position == machine->input_length) {
+        return EOF;
+    }
+    return (uint8_t)machine->input_bytes[machine->input_position++];
+}
+
+// input_int from the stream, a character at a time so that input_position
+// counts exactly what it reads
+static int32_t stream_int(emu_machine_t *machine) {
+    FILE *input = machine->input;
+    int c;
+    while ((c = getc(input)) != EOF && is_space(c)) {
+        machine->input_position++;
+    }
+    bool negative = false;
+    if (c == '-' || c == '+') {
+        negative = c == '-';
+        machine->input_position++;
+        c = getc(input);
+    }
+    uint32_t value = 0;
+    while (c >= '0' && c <= '9') {
+        value = value * 10 + (c - '0');
+        machine->input_position++;
+        c = getc(input);
+    }
+    if (c != EOF) {
+        ungetc(c, input);
+    }
+    return negative ? -value : value;
+}
+
+// isspace() in the C locale, which scanf skips
+static bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
@@ -0,0 +1,54 @@
+#ifndef GUEST_IO_H
+#define GUEST_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "machine.h"
+
+// The print syscalls don't write to machine->output straight away: they
+// collect their output in the machine's output buffer, which is written out
+// when it fills up, before the program reads any input, and when the machine
+// stops or is freed.
+
+// syscall 1: print_int
+void output_int(emu_machine_t *machine, int32_t value);
+
+// syscall 4: print_string, the NUL-terminated string at address
+void output_string(emu_machine_t *machine, uint32_t address);
+
+// syscall 11: print_character
+void output_char(emu_machine_t *machine, uint8_t c);
+
+// Writes out anything buffered to machine->output
+void flush_output(emu_machine_t *machine);
+
+// The read syscalls read from machine->input one value at a time, unless
+// the whole input has been put in memory with one of these. Then they parse
+// it in place, and don't need to flush the output first, as nobody is
+// waiting to see a prompt. Either way machine->input_position says how far
+// into the input they have got.
+
+// Reads the rest of machine->input from memory, if it is a regular file that
+// can be mapped. Returns whether it could.
+bool map_input(emu_machine_t *machine);
+
+// Reads the length bytes at bytes as the input. They must outlive the
+// machine.
+void set_input_buffer(emu_machine_t *machine, const char *bytes,
+                      size_t length);
+
+// Unmaps the input, if it was mapped
+void free_input(emu_machine_t *machine);
+
+// syscall 5: read_int, or 0 if there isn't one
+int32_t input_int(emu_machine_t *machine);
+
+// syscall 8: read_string, length bytes into memory at address; bytes past
+// the end of the input read as 0xFF
+void input_string(emu_machine_t *machine, uint32_t address, uint32_t length);
+
+// syscall 12: read_character, or -1 at the end of the input
+int32_t input_char(emu_machine_t *machine);
+
+#endif
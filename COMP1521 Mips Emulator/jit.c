@@ -0,0 +1,562 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+#include "ram.h"
+#include "registers.h"
+#include "decode_instruction.h"
+#include "fast_execute.h"
+#include "jit.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && !defined(EMU_NO_JIT)
+
+#include <sys/mman.h>
+
+// Generated code is entered as `uint32_t block(emu_machine_t *machine)',
+// keeps the machine in %rbx, and returns the address of the next
+// instruction to run in %eax.  The registers are at the start of the
+// machine, so register R is at R*4(%rbx).  Each block adds the number of
+// instructions it runs to machine->instruction_count as it starts.
+typedef uint32_t (*compiled_block_t)(emu_machine_t *machine);
+
+_Static_assert(offsetof(emu_machine_t, registers) == 0,
+               "generated code expects the registers first");
+
+#define CODE_CACHE_SIZE (16 * 1024 * 1024)
+// most bytes a single translated instruction can take, exit stubs included
+#define MAX_INSTRUCTION_BYTES 64
+#define MAX_BLOCK_INSTRUCTIONS 128
+// push %rbx; mov %rdi, %rbx (chained blocks jump past this)
+#define PROLOGUE_BYTES 4
+#define INSTRUCTION_COUNT_OFFSET offsetof(emu_machine_t, instruction_count)
+
+// An exit from a block to another address in the text segment, that can be
+// patched into a direct jump once the block it exits to is compiled
+typedef struct exit_stub {
+    uint8_t *code;
+    uint32_t targetIndex;
+} exit_stub_t;
+
+// Everything the JIT keeps for one machine
+typedef struct jit_state {
+    int disabled;
+    uint8_t *codeCache;
+    uint8_t *codeNext;
+    uint8_t *codeEnd;
+
+    decoded_instruction_t *text;
+    uint32_t textFirstAddress;
+    uint32_t textLength;
+    // native code for the block starting at each word of the text segment
+    uint8_t **blockEntry;
+
+    exit_stub_t *exitStubs;
+    uint32_t nExitStubs;
+    uint32_t exitStubsCapacity;
+
+    // get_text_write_count() when the JIT started, compiled code is stale
+    // once it changes
+    uint32_t textWriteCount;
+} jit_state_t;
+
+// ========================== My Helper Functions ==============================
+// Set up the code cache and block table the first time the JIT is used
+static jit_state_t *startJit(emu_machine_t *machine);
+
+// Translates the block starting at the given word of the text segment,
+// returning NULL if the code cache is full
+static uint8_t *compileBlock(jit_state_t *jit, uint32_t index);
+
+// Emits a return to the C runtime with the given program counter
+static void emitReturn(jit_state_t *jit, uint32_t targetPc);
+
+// Same as emitReturn, but patched into a jump once code for that address
+// exists, so that blocks chain together without going back to C
+static void emitExit(jit_state_t *jit, uint32_t targetPc);
+static void patchExit(uint8_t *stub, uint8_t *target);
+static void patchExitsTo(jit_state_t *jit, uint32_t index);
+
+// Emit one x86-64 instruction (or a common sequence) at codeNext
+static void emitBytes(jit_state_t *jit, int n, ...);
+static void emit32(jit_state_t *jit, uint32_t value);
+static void emitLoad(jit_state_t *jit, uint8_t modrmReg, uint32_t mipsReg);
+static void emitStore(jit_state_t *jit, uint32_t mipsReg);
+static void emitCall(jit_state_t *jit, void *function);
+
+// Memory accesses are done by calling back into C with the machine. The
+// stores return whether the program has written to its text segment.
+static uint32_t loadByte(emu_machine_t *machine, uint32_t address);
+static uint32_t loadHalf(emu_machine_t *machine, uint32_t address);
+static uint32_t loadWord(emu_machine_t *machine, uint32_t address);
+static int storeByte(emu_machine_t *machine, uint32_t address, uint32_t value);
+static int storeHalf(emu_machine_t *machine, uint32_t address, uint32_t value);
+static int storeWord(emu_machine_t *machine, uint32_t address, uint32_t value);
+
+// x86 register numbers, used in the reg field of a ModRM byte
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_EDX 2
+#define X86_ESI 6
+
+// x86 condition codes, for jcc
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+
+// =============================================================================
+int jit_execute_program(emu_machine_t *machine) {
+    if (machine->jit == NULL) {
+        machine->jit = startJit(machine);
+    }
+    jit_state_t *jit = machine->jit;
+    // translated code doesn't count each instruction
+    if (jit->disabled || machine->profile != NULL) {
+        return fast_execute_program(machine);
+    }
+
+    uint32_t pc = machine->program_counter;
+
+    for (;;) {
+        uint32_t offset = pc - jit->textFirstAddress;
+        if (offset >= jit->textLength || offset % 4 != 0) {
+            break;
+        }
+
+        uint32_t index = offset / 4;
+        uint8_t opcode = jit->text[index].opcode;
+        if (opcode == op_syscall || opcode == op_invalid ||
+            opcode == op_undecoded) {
+            // blocks never start with these, run them the slow way
+            machine->program_counter = pc;
+            int status = execute_next_instruction(machine);
+            if (status) {
+                return status;
+            }
+            pc = machine->program_counter;
+            if (get_text_write_count(machine) != jit->textWriteCount) {
+                jit->disabled = 1;
+                break;
+            }
+            continue;
+        }
+
+        uint8_t *entry = jit->blockEntry[index];
+        if (entry == NULL) {
+            STATS_TIME(machine, stats_translate,
+                       entry = compileBlock(jit, index));
+        }
+        if (entry == NULL) {
+            // out of room for code, carry on in the interpreter
+            jit->disabled = 1;
+            break;
+        }
+
+        pc = ((compiled_block_t)entry)(machine);
+
+        if (get_text_write_count(machine) != jit->textWriteCount) {
+            // compiled code may be stale, carry on in the interpreter
+            jit->disabled = 1;
+            break;
+        }
+    }
+
+    machine->program_counter = pc;
+    if (jit->disabled) {
+        // let the interpreter take it from here
+        return 0;
+    }
+    if (pc - jit->textFirstAddress < jit->textLength) {
+        // not word aligned, let the slow path execute it
+        return execute_next_instruction(machine);
+    }
+    return -1;
+}
+
+void free_jit(emu_machine_t *machine) {
+    jit_state_t *jit = machine->jit;
+    if (jit == NULL) {
+        return;
+    }
+    if (jit->codeCache != NULL) {
+        munmap(jit->codeCache, CODE_CACHE_SIZE);
+    }
+    free(jit->blockEntry);
+    free(jit->exitStubs);
+    free(jit);
+    machine->jit = NULL;
+}
+
+static jit_state_t *startJit(emu_machine_t *machine) {
+    jit_state_t *jit = calloc(1, sizeof *jit);
+    if (jit == NULL) {
+        abort();
+    }
+
+    void *cache = mmap(NULL, CODE_CACHE_SIZE,
+                       PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        jit->disabled = 1;
+        return jit;
+    }
+
+    jit->text = get_decoded_text(machine, &jit->textFirstAddress,
+                                 &jit->textLength);
+    jit->textWriteCount = get_text_write_count(machine);
+    jit->blockEntry = calloc(jit->textLength / 4 + 1, sizeof *jit->blockEntry);
+    if (jit->blockEntry == NULL) {
+        munmap(cache, CODE_CACHE_SIZE);
+        jit->disabled = 1;
+        return jit;
+    }
+
+    jit->codeCache = cache;
+    jit->codeNext = jit->codeCache;
+    jit->codeEnd = jit->codeCache + CODE_CACHE_SIZE;
+    return jit;
+}
+
+static uint8_t *compileBlock(jit_state_t *jit, uint32_t index) {
+    uint32_t startIndex = index;
+    uint8_t *entry = jit->codeNext;
+    uint32_t pc = jit->textFirstAddress + index * 4;
+    if (jit->codeEnd - jit->codeNext < 2 * MAX_INSTRUCTION_BYTES) {
+        return NULL;
+    }
+
+    // push %rbx; mov %rdi, %rbx
+    emitBytes(jit, 4, 0x53, 0x48, 0x89, 0xFB);
+
+    // addq $n, instruction_count(%rbx), n is filled in once it's known
+    emitBytes(jit, 3, 0x48, 0x81, 0x83);
+    emit32(jit, INSTRUCTION_COUNT_OFFSET);
+    uint8_t *blockCount = jit->codeNext;
+    emit32(jit, 0);
+
+    // where an early exit after a store takes back the instructions it
+    // didn't run, and how many it did run
+    uint8_t *uncount[MAX_BLOCK_INSTRUCTIONS];
+    uint32_t uncountRan[MAX_BLOCK_INSTRUCTIONS];
+    int nUncount = 0;
+
+    // instructions in the block, including a branch or jump that ends it
+    int n;
+    for (n = 0; ; n++, index++, pc += 4) {
+        if (jit->codeEnd - jit->codeNext < MAX_INSTRUCTION_BYTES) {
+            jit->codeNext = entry;
+            return NULL;
+        }
+
+        if (pc - jit->textFirstAddress >= jit->textLength || n == MAX_BLOCK_INSTRUCTIONS) {
+            emitExit(jit, pc);
+            break;
+        }
+
+        const decoded_instruction_t *i = &jit->text[index];
+        if (i->opcode == op_syscall || i->opcode == op_invalid ||
+            i->opcode == op_undecoded) {
+            emitExit(jit, pc);
+            break;
+        }
+
+        switch (i->opcode) {
+            // mov s, %eax; op t, %eax; mov %eax, d
+            case op_add: case op_sub: case op_mul:
+            case op_and: case op_or: case op_xor: {
+                if (i->d == zero) {
+                    break;
+                }
+                emitLoad(jit, X86_EAX, i->s);
+                switch (i->opcode) {
+                    case op_add: emitBytes(jit, 1, 0x03); break;
+                    case op_sub: emitBytes(jit, 1, 0x2B); break;
+                    case op_mul: emitBytes(jit, 2, 0x0F, 0xAF); break;
+                    case op_and: emitBytes(jit, 1, 0x23); break;
+                    case op_or: emitBytes(jit, 1, 0x0B); break;
+                    case op_xor: emitBytes(jit, 1, 0x33); break;
+                }
+                emitBytes(jit, 2, 0x43, i->t * 4);
+                emitStore(jit, i->d);
+                break;
+            }
+            case op_slt:
+                if (i->d == zero) {
+                    break;
+                }
+                emitLoad(jit, X86_EAX, i->s);
+                emitBytes(jit, 3, 0x3B, 0x43, i->t * 4);         // cmp t, %eax
+                emitBytes(jit, 6, 0x0F, 0x9C, 0xC0, 0x0F, 0xB6, 0xC0); // setl; movzx
+                emitStore(jit, i->d);
+                break;
+            case op_sllv:
+            case op_srlv:
+                if (i->d == zero) {
+                    break;
+                }
+                emitLoad(jit, X86_ECX, i->s);
+                emitLoad(jit, X86_EAX, i->t);
+                // shl/sar %cl, %eax (x86 masks the count to 5 bits too)
+                emitBytes(jit, 2, 0xD3, i->opcode == op_sllv ? 0xE0 : 0xF8);
+                emitStore(jit, i->d);
+                break;
+            case op_addi: case op_andi: case op_ori: case op_xori:
+                if (i->t == zero) {
+                    break;
+                }
+                emitLoad(jit, X86_EAX, i->s);
+                switch (i->opcode) {
+                    case op_addi: emitBytes(jit, 1, 0x05); break;
+                    case op_andi: emitBytes(jit, 1, 0x25); break;
+                    case op_ori: emitBytes(jit, 1, 0x0D); break;
+                    case op_xori: emitBytes(jit, 1, 0x35); break;
+                }
+                emit32(jit, i->imm);
+                emitStore(jit, i->t);
+                break;
+            case op_slti:
+                if (i->t == zero) {
+                    break;
+                }
+                emitLoad(jit, X86_EAX, i->s);
+                emitBytes(jit, 1, 0x3D);                         // cmp $imm, %eax
+                emit32(jit, i->imm);
+                emitBytes(jit, 6, 0x0F, 0x9C, 0xC0, 0x0F, 0xB6, 0xC0);
+                emitStore(jit, i->t);
+                break;
+            case op_sll:
+            case op_srl:
+                if (i->d == zero) {
+                    break;
+                }
+                emitLoad(jit, X86_EAX, i->t);
+                emitBytes(jit, 3, 0xC1, i->opcode == op_sll ? 0xE0 : 0xF8, i->shift);
+                emitStore(jit, i->d);
+                break;
+            case op_lui:
+                if (i->t == zero) {
+                    break;
+                }
+                emitBytes(jit, 3, 0xC7, 0x43, i->t * 4);         // movl $imm, t
+                emit32(jit, (uint32_t)i->imm << 16);
+                break;
+
+            case op_lb: case op_lh: case op_lw:
+                emitLoad(jit, X86_ESI, i->s);
+                emitBytes(jit, 2, 0x81, 0xC6);                   // add $imm, %esi
+                emit32(jit, i->imm);
+                emitCall(jit, i->opcode == op_lb ? (void *)loadByte :
+                         i->opcode == op_lh ? (void *)loadHalf :
+                                              (void *)loadWord);
+                if (i->t != zero) {
+                    emitStore(jit, i->t);
+                }
+                break;
+            case op_sb: case op_sh: case op_sw: {
+                emitLoad(jit, X86_ESI, i->s);
+                emitBytes(jit, 2, 0x81, 0xC6);
+                emit32(jit, i->imm);
+                emitLoad(jit, X86_EDX, i->t);
+                emitCall(jit, i->opcode == op_sb ? (void *)storeByte :
+                         i->opcode == op_sh ? (void *)storeHalf :
+                                              (void *)storeWord);
+                // test %eax, %eax; jz over a return to the C runtime, which
+                // does subq $unrun, instruction_count(%rbx) first
+                emitBytes(jit, 4, 0x85, 0xC0, 0x74, 18);
+                emitBytes(jit, 3, 0x48, 0x81, 0xAB);
+                emit32(jit, INSTRUCTION_COUNT_OFFSET);
+                uncount[nUncount] = jit->codeNext;
+                uncountRan[nUncount++] = n + 1;
+                emit32(jit, 0);
+                emitReturn(jit, pc + 4);
+                break;
+            }
+
+            case op_beq: case op_bne:
+            case op_blez: case op_bgtz: case op_bltz: case op_bgez: {
+                int cc;
+                if (i->opcode == op_beq || i->opcode == op_bne) {
+                    emitLoad(jit, X86_EAX, i->s);
+                    emitBytes(jit, 3, 0x3B, 0x43, i->t * 4);     // cmp t, %eax
+                    cc = i->opcode == op_beq ? CC_E : CC_NE;
+                } else {
+                    emitBytes(jit, 4, 0x83, 0x7B, i->s * 4, 0);  // cmpl $0, s
+                    cc = i->opcode == op_blez ? CC_LE :
+                         i->opcode == op_bgtz ? CC_G :
+                         i->opcode == op_bltz ? CC_L : CC_GE;
+                }
+                // jcc over the not-taken exit
+                emitBytes(jit, 2, 0x0F, 0x80 | cc);
+                emit32(jit, 7);
+                emitExit(jit, pc + 4);
+                emitExit(jit, pc + i->imm * 4);
+                n++;
+                goto blockEnd;
+            }
+
+            case op_jal:
+                emitBytes(jit, 3, 0xC7, 0x43, ra * 4);           // movl $pc + 4, ra
+                emit32(jit, pc + 4);
+                // fall through
+            case op_j:
+                emitExit(jit, jump_target(pc, i));
+                n++;
+                goto blockEnd;
+            case op_jr:
+                // the target isn't known until now, so let the C side find
+                // its block: mov s, %eax; pop %rbx; ret
+                emitLoad(jit, X86_EAX, i->s);
+                emitBytes(jit, 2, 0x5B, 0xC3);
+                n++;
+                goto blockEnd;
+        }
+    }
+blockEnd:
+
+    memcpy(blockCount, &n, sizeof n);
+    for (int u = 0; u < nUncount; u++) {
+        uint32_t unrun = n - uncountRan[u];
+        memcpy(uncount[u], &unrun, sizeof unrun);
+    }
+
+    jit->blockEntry[startIndex] = entry;
+    patchExitsTo(jit, startIndex);
+    return entry;
+}
+
+static void emitReturn(jit_state_t *jit, uint32_t targetPc) {
+    // mov $targetPc, %eax; pop %rbx; ret
+    emitBytes(jit, 1, 0xB8);
+    emit32(jit, targetPc);
+    emitBytes(jit, 2, 0x5B, 0xC3);
+}
+
+static void emitExit(jit_state_t *jit, uint32_t targetPc) {
+    uint8_t *stub = jit->codeNext;
+    emitReturn(jit, targetPc);
+
+    uint32_t offset = targetPc - jit->textFirstAddress;
+    if (offset >= jit->textLength || offset % 4 != 0) {
+        return;
+    }
+    uint32_t index = offset / 4;
+    if (jit->blockEntry[index] != NULL) {
+        patchExit(stub, jit->blockEntry[index]);
+        return;
+    }
+
+    if (jit->nExitStubs == jit->exitStubsCapacity) {
+        jit->exitStubsCapacity = jit->exitStubsCapacity ? jit->exitStubsCapacity * 2 : 256;
+        jit->exitStubs = realloc(jit->exitStubs, jit->exitStubsCapacity * sizeof *jit->exitStubs);
+        if (jit->exitStubs == NULL) {
+            abort();
+        }
+    }
+    jit->exitStubs[jit->nExitStubs].code = stub;
+    jit->exitStubs[jit->nExitStubs].targetIndex = index;
+    jit->nExitStubs++;
+}
+
+static void patchExit(uint8_t *stub, uint8_t *target) {
+    // jmp straight past the target block's prologue
+    int32_t displacement = (target + PROLOGUE_BYTES) - (stub + 5);
+    stub[0] = 0xE9;
+    memcpy(&stub[1], &displacement, sizeof displacement);
+}
+
+static void patchExitsTo(jit_state_t *jit, uint32_t index) {
+    uint32_t kept = 0;
+    for (uint32_t e = 0; e < jit->nExitStubs; e++) {
+        if (jit->exitStubs[e].targetIndex == index) {
+            patchExit(jit->exitStubs[e].code, jit->blockEntry[index]);
+        } else {
+            jit->exitStubs[kept++] = jit->exitStubs[e];
+        }
+    }
+    jit->nExitStubs = kept;
+}
+
+static void emitBytes(jit_state_t *jit, int n, ...) {
+    va_list bytes;
+    va_start(bytes, n);
+    for (int b = 0; b < n; b++) {
+        *jit->codeNext++ = (uint8_t)va_arg(bytes, int);
+    }
+    va_end(bytes);
+}
+
+static void emit32(jit_state_t *jit, uint32_t value) {
+    memcpy(jit->codeNext, &value, sizeof value);
+    jit->codeNext += sizeof value;
+}
+
+// mov mipsReg(%rbx), %reg
+static void emitLoad(jit_state_t *jit, uint8_t modrmReg, uint32_t mipsReg) {
+    emitBytes(jit, 3, 0x8B, 0x43 | (modrmReg << 3), mipsReg * 4);
+}
+
+// mov %eax, mipsReg(%rbx)
+static void emitStore(jit_state_t *jit, uint32_t mipsReg) {
+    emitBytes(jit, 3, 0x89, 0x43, mipsReg * 4);
+}
+
+// mov %rbx, %rdi; movabs $function, %rax; call *%rax
+static void emitCall(jit_state_t *jit, void *function) {
+    uint64_t address = (uint64_t)(uintptr_t)function;
+    emitBytes(jit, 5, 0x48, 0x89, 0xDF, 0x48, 0xB8);
+    memcpy(jit->codeNext, &address, sizeof address);
+    jit->codeNext += sizeof address;
+    emitBytes(jit, 2, 0xFF, 0xD0);
+}
+
+static uint32_t loadByte(emu_machine_t *machine, uint32_t address) {
+    uint32_t value;
+    STATS_TIME(machine, stats_memory,
+               value = (int8_t)get_byte(machine, address));
+    return value;
+}
+
+static uint32_t loadHalf(emu_machine_t *machine, uint32_t address) {
+    uint32_t value;
+    STATS_TIME(machine, stats_memory,
+               value = (int16_t)get_half(machine, address));
+    return value;
+}
+
+static uint32_t loadWord(emu_machine_t *machine, uint32_t address) {
+    uint32_t value;
+    STATS_TIME(machine, stats_memory, value = get_word(machine, address));
+    return value;
+}
+
+static int storeByte(emu_machine_t *machine, uint32_t address, uint32_t value) {
+    STATS_TIME(machine, stats_memory, set_byte(machine, address, value));
+    return get_text_write_count(machine) != machine->jit->textWriteCount;
+}
+
+static int storeHalf(emu_machine_t *machine, uint32_t address, uint32_t value) {
+    STATS_TIME(machine, stats_memory, set_half(machine, address, value));
+    return get_text_write_count(machine) != machine->jit->textWriteCount;
+}
+
+static int storeWord(emu_machine_t *machine, uint32_t address, uint32_t value) {
+    STATS_TIME(machine, stats_memory, set_word(machine, address, value));
+    return get_text_write_count(machine) != machine->jit->textWriteCount;
+}
+// =============================================================================
+
+#else
+
+int jit_execute_program(emu_machine_t *machine) {
+    return fast_execute_program(machine);
+}
+
+void free_jit(emu_machine_t *machine) {
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include "machine.h"
+
+// Runs the machine's program by translating basic blocks of the text segment into
+// native x86-64 code. Falls back to fast_execute_program() on other hosts,
+// when the code cache can't be created or fills up, once the program
+// writes to its own text segment, and while the machine is being profiled.
+//
+// Returns the same as fast_execute_program().
+int jit_execute_program(emu_machine_t *machine);
+
+// Frees the code the JIT translated for a machine
+void free_jit(emu_machine_t *machine);
+
+#endif
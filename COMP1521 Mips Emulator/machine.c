@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include "guest_io.h"
+#include "jit.h"
+#include "machine.h"
+#include "profile.h"
+#include "ram.h"
+#include "registers.h"
+#include "stats.h"
+#include "tier.h"
+
+// What snapshot_machine saves that isn't in memory
+struct machine_snapshot {
+    uint32_t registers[N_REGISTERS];
+    uint32_t program_counter;
+    uint64_t instruction_count;
+    bool exited;
+};
+
+emu_machine_t *create_machine(const program_image_t *image, FILE *input,
+                              FILE *output) {
+    emu_machine_t *machine = calloc(1, sizeof *machine);
+    if (machine == NULL) {
+        return NULL;
+    }
+    machine->input = input;
+    machine->output = output;
+    start_stats(machine);
+    load_program(machine, image);
+
+    // set the stack pointer the same as SPIM does for consistency.
+    set_register(machine, sp, 0x7FFFF8E4);
+
+    // set the same return address as SPIM does for consistency
+    // this is outside out text area so program will terminate on return
+    // in SPIM this is the kernel text segment
+    set_register(machine, ra, 0x00400018);
+
+    // set the global pointer the same as SPIM does for consistency
+    set_register(machine, gp, 0x10008000);
+
+    // set the PC to the same as SPIM so we can run code
+    machine->program_counter = 0x400024;
+
+    // set t1..t7 to non-zero values to facilitate testing
+    for (int i = 9; i < 16; i++) {
+        set_register(machine, i, i - 8);
+    }
+
+    return machine;
+}
+
+bool snapshot_machine(emu_machine_t *machine) {
+    if (machine->snapshot == NULL) {
+        machine->snapshot = malloc(sizeof *machine->snapshot);
+        if (machine->snapshot == NULL) {
+            return false;
+        }
+    }
+    struct machine_snapshot *snapshot = machine->snapshot;
+    memcpy(snapshot->registers, machine->registers, sizeof machine->registers);
+    snapshot->program_counter = machine->program_counter;
+    snapshot->instruction_count = machine->instruction_count;
+    snapshot->exited = machine->exited;
+    snapshot_memory(machine);
+    return true;
+}
+
+void reset_machine(emu_machine_t *machine) {
+    struct machine_snapshot *snapshot = machine->snapshot;
+    flush_output(machine);
+    memcpy(machine->registers, snapshot->registers, sizeof machine->registers);
+    machine->program_counter = snapshot->program_counter;
+    machine->instruction_count = snapshot->instruction_count;
+    machine->exited = snapshot->exited;
+    reset_memory(machine);
+}
+
+void free_machine(emu_machine_t *machine) {
+    flush_output(machine);
+    free_input(machine);
+    free_jit(machine);
+    free_tier(machine);
+    free_profile(machine);
+    free_program(machine);
+    free(machine->snapshot);
+    free(machine);
+}
@@ -0,0 +1,80 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "program_image.h"
+#include "registers.h"
+#include "stats.h"
+
+// How much syscall output a machine collects before writing it out
+#define OUTPUT_BUFFER_SIZE 4096
+
+// Everything about one emulated MIPS machine.  Nothing is shared between
+// machines, so any number of them can run in one process, one per thread.
+struct emu_machine {
+    // first, so generated code can use the machine as the register array
+    uint32_t registers[N_REGISTERS];
+    uint32_t program_counter;
+    // instructions fetched so far, including one that stopped the program
+    uint64_t instruction_count;
+
+    // the program's segments, owned by `ram.c'
+    struct emu_memory *memory;
+    // translated code, owned by `jit.c', NULL until the JIT is used
+    struct jit_state *jit;
+    // compiled hot blocks, owned by `tier.c', NULL until the tiers are used
+    struct tier_state *tier;
+    // execution counts, owned by `profile.c', NULL unless profiling
+    struct emu_profile *profile;
+    // what reset_machine goes back to, owned by `machine.c', NULL until
+    // snapshot_machine is called
+    struct machine_snapshot *snapshot;
+
+    // where syscalls read from and write to
+    FILE *input;
+    FILE *output;
+    // all of the input, when it is in memory instead of read from input,
+    // see `guest_io.h'
+    const char *input_bytes;
+    size_t input_length;
+    // how many bytes into the input the program has read, from memory or
+    // from input
+    size_t input_position;
+    bool input_mapped;          // input_bytes needs unmapping
+
+    // set by the exit syscall
+    bool exited;
+
+#ifdef EMU_STATS
+    // the emulator's own performance counters, for --stats
+    emu_stats_t stats;
+#endif
+
+    // syscall output not yet written to output, see `guest_io.h'
+    size_t output_length;
+    char output_buffer[OUTPUT_BUFFER_SIZE];
+};
+
+// Creates a machine with a program loaded, and the registers set up the
+// same as SPIM does
+emu_machine_t *create_machine(const program_image_t *image, FILE *input,
+                              FILE *output);
+
+// Saves the machine's registers, program counter and instruction count, and
+// starts tracking which pages of memory the program stores to.  Returns
+// false if out of memory.
+bool snapshot_machine(emu_machine_t *machine);
+
+// Puts a machine back the way it was when snapshot_machine was last called,
+// restoring only the pages stored to since, so a program can be run again
+// (e.g. on another input) without loading it again.  Any buffered output is
+// written out first.  The input and output streams are left alone.
+void reset_machine(emu_machine_t *machine);
+
+// Frees a machine and everything it owns, after writing out any buffered
+// output (but doesn't close its streams)
+void free_machine(emu_machine_t *machine);
+
+#endif
@@ -5,20 +5,32 @@
 #include "ram.h"
 #include "registers.h"
 #include "bitextract.h"
+#include "print_instruction.h"
 
 // ========================== My Helper Functions ==============================
 // Given a command string, like "mul", determine what info to extract, then
-// print the formatted string
-static void extractAndPrint(uint32_t instruction, char *command);
+// write the formatted string into text
+static void extractAndFormat(uint32_t instruction, char *command, char *text);
 
 // =============================================================================
 void print_instruction(uint32_t instruction) {
+    char text[INSTRUCTION_TEXT_SIZE];
+    format_instruction(instruction, text);
+    printf("%s", text);
+}
+
+bool format_instruction(uint32_t instruction, char *text) {
     char *command = getCommand(instruction);
-    extractAndPrint(instruction, command);
+    if (command == NULL) {
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "invalid instruction");
+        return false;
+    }
+    extractAndFormat(instruction, command, text);
     free(command);
+    return true;
 }
 
-static void extractAndPrint(uint32_t instruction, char *command) {
+static void extractAndFormat(uint32_t instruction, char *command, char *text) {
     // For commands of bit pattern: 000000|sssss|ttttt|ddddd|00000|OPCODE
     // Format: command $d, $s, $t
     if (strcmp(command, "add") == 0 ||
@@ -31,7 +43,8 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         uint32_t dReg = extractBitSlice(instruction, 11, 15);
         uint32_t sReg = extractBitSlice(instruction, 21, 25);
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
-        printf("%s $%d, $%d, $%d", command, dReg, sReg, tReg);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, $%d",
+                 command, dReg, sReg, tReg);
     } 
     // Format: command $d, $t, $s
     if (strcmp(command, "sllv") == 0 ||
@@ -39,7 +52,8 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         uint32_t dReg = extractBitSlice(instruction, 11, 15);
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
         uint32_t sReg = extractBitSlice(instruction, 21, 25);
-        printf("%s $%d, $%d, $%d", command, dReg, tReg, sReg);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, $%d",
+                 command, dReg, tReg, sReg);
     }
     // For commands of bit pattern: OPCODE|sssss|ttttt|IIIIIIIIIIIIIIII
     // Format: command $t, $s, I
@@ -51,7 +65,8 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
         uint32_t sReg = extractBitSlice(instruction, 21, 25);
         int16_t imm = extractBitSlice(instruction, 0, 15);
-        printf("%s $%d, $%d, %d", command, tReg, sReg, imm);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, %d",
+                 command, tReg, sReg, imm);
     }
     // Format: command $s, $t, I
     if (strcmp(command, "beq") == 0 ||
@@ -59,7 +74,8 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         uint32_t sReg = extractBitSlice(instruction, 21, 25);
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
         int16_t imm = extractBitSlice(instruction, 0, 15); 
-        printf("%s $%d, $%d, %d", command, sReg, tReg, imm); 
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, %d",
+                 command, sReg, tReg, imm);
     }
     // For commands of bit pattern: 000000|0000X|ttttt|ddddd|IIIII|OPCODE
     // Format: command $d, $t, I
@@ -68,14 +84,16 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         uint32_t dReg = extractBitSlice(instruction, 11, 15);
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
         int16_t imm = extractBitSlice(instruction, 6, 10);
-        printf("%s $%d, $%d, %d", command, dReg, tReg, imm);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, $%d, %d",
+                 command, dReg, tReg, imm);
     }
     // For commands of bit pattern: OPCODE|00000|ttttt|IIIIIIIIIIIIIIII 
     // Format: command $t, I
     if (strcmp(command, "lui") == 0) {
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
         int16_t imm = extractBitSlice(instruction, 0, 15);
-        printf("%s $%d, %d", command, tReg, imm);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, %d",
+                 command, tReg, imm);
     }
     // For commands of bit pattern: OPCODE|bbbbb|ttttt|OOOOOOOOOOOOOOOO
     // Format: command $t, O($b)
@@ -88,7 +106,8 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         uint32_t tReg = extractBitSlice(instruction, 16, 20);
         uint32_t offset = extractBitSlice(instruction, 0, 15);
         uint32_t base = extractBitSlice(instruction, 21, 25);
-        printf("%s $%d, %d($%d)", command, tReg, offset, base);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, %d($%d)",
+                 command, tReg, offset, base);
     }
     // For commands of bit pattern: OPCODE|sssss|0000X|IIIIIIIIIIIIIIII
     // Format: command $s, I
@@ -98,25 +117,29 @@ static void extractAndPrint(uint32_t instruction, char *command) {
         strcmp(command, "bgez") == 0) {
         uint32_t sReg = extractBitSlice(instruction, 21, 25);
         int16_t imm = extractBitSlice(instruction, 0, 15);
-        printf("%s $%d, %d", command, sReg, imm);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d, %d",
+                 command, sReg, imm);
     }
     // For commands of bit pattern: OPCODE|XXXXXXXXXXXXXXXXXXXXXXXXXX
     // Format: command X
     if (strcmp(command, "j") == 0 ||
         strcmp(command, "jal") == 0 ) {
         uint32_t target = extractBitSlice(instruction, 0, 25);
-        printf("%s 0x%x", command, target);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s 0x%x",
+                 command, target);
     }
     // For commands of bit pattern: 000000|sssss|000000000000000|OPCODE
     // Format: command $s
     if (strcmp(command, "jr") == 0) { 
         uint32_t sReg = extractBitSlice(instruction, 21, 25);
-        printf("%s $%d", command, sReg);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s $%d",
+                 command, sReg);
     } 
     // For commands of bit pattern: 000000|00000000000000000|OPCODE
     // Format: syscall
     if (strcmp(command, "syscall") == 0) {
-        printf("%s", command);
+        snprintf(text, INSTRUCTION_TEXT_SIZE, "%s",
+                 command);
     }
 }
 // =============================================================================
@@ -1,4 +1,16 @@
 #ifndef PRINT_INSTRUCTION
 #define PRINT_INSTRUCTION
 
-#endif
\ No newline at end of file
+#include <stdbool.h>
+#include <stdint.h>
+
+// Room for the longest disassembly, like "sllv $31, $31, $31" or
+// "sw $31, 65535($31)"
+#define INSTRUCTION_TEXT_SIZE 32
+
+// Writes the disassembly print_instruction() prints into text, which has room
+// for INSTRUCTION_TEXT_SIZE characters. Returns false (and writes "invalid
+// instruction") if the word isn't an instruction the emulator knows.
+bool format_instruction(uint32_t instruction, char *text);
+
+#endif
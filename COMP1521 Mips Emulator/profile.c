@@ -0,0 +1,638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "ram.h"
+#include "registers.h"
+
+// How many of the hottest blocks, instructions and opcode pairs to print
+#define PROFILE_REPORT_LINES 15
+
+// Marks a call node that couldn't be created
+#define NO_CALL_NODE UINT32_MAX
+
+// Something counted, and which block, instruction or opcode(s) it is
+typedef struct profile_entry {
+    uint64_t count;
+    uint32_t first;
+    uint32_t second;
+} profile_entry_t;
+
+// Everything counted for one function, over all of its calling contexts
+typedef struct profile_function {
+    uint32_t address;
+    uint64_t inclusive;
+    uint64_t exclusive;
+    uint64_t calls;
+} profile_function_t;
+
+static bool copy_symbols(emu_profile_t *profile, const program_image_t *image);
+static int compare_symbols(const void *a, const void *b);
+static uint32_t add_call_node(emu_profile_t *profile, uint32_t parent,
+                              uint32_t address);
+static void settle_calls(emu_profile_t *profile);
+static const char *function_name(const emu_profile_t *profile,
+                                 uint32_t address, char *buffer);
+static uint32_t summarise_functions(emu_profile_t *profile,
+                                    profile_function_t **functions);
+static int compare_function_addresses(const void *a, const void *b);
+static void print_functions(emu_profile_t *profile, uint64_t total);
+static void write_folded_stack(FILE *f, const emu_profile_t *profile,
+                               uint32_t node);
+static uint64_t total_count(const emu_profile_t *profile);
+static uint64_t opcode_count(const emu_profile_t *profile, opcode_t opcode);
+static bool *find_block_starts(emu_machine_t *machine);
+static void print_hot_blocks(emu_machine_t *machine, uint64_t total);
+static void print_hot_instructions(emu_machine_t *machine, uint64_t total);
+static void print_opcode_mix(const emu_profile_t *profile, uint64_t total);
+static void print_opcode_pairs(const emu_profile_t *profile, uint64_t total);
+static void sort_entries(profile_entry_t *entries, uint32_t n_entries);
+static int compare_entries(const void *a, const void *b);
+static double percent(uint64_t count, uint64_t total);
+
+bool start_profile(emu_machine_t *machine, const program_image_t *image) {
+    if (machine->profile != NULL) {
+        return true;
+    }
+
+    emu_profile_t *profile = calloc(1, sizeof *profile);
+    if (profile == NULL) {
+        return false;
+    }
+    machine->profile = profile;
+
+    uint32_t text_length;
+    get_decoded_text(machine, &profile->text_first_address, &text_length);
+    profile->text_words = text_length / 4;
+    profile->pc_counts =
+        calloc(profile->text_words + 1, sizeof *profile->pc_counts);
+    profile->previous_opcode = op_undecoded;
+
+    // the program starts off in whatever function it starts in
+    if (profile->pc_counts == NULL || !copy_symbols(profile, image) ||
+        add_call_node(profile, 0, machine->program_counter) != 0) {
+        free_profile(machine);
+        return false;
+    }
+    return true;
+}
+
+void free_profile(emu_machine_t *machine) {
+    emu_profile_t *profile = machine->profile;
+    if (profile != NULL) {
+        for (uint32_t i = 0; i < profile->n_symbols; i++) {
+            free(profile->symbols[i].name);
+        }
+        free(profile->symbols);
+        free(profile->call_nodes);
+        free(profile->pc_counts);
+        free(profile);
+        machine->profile = NULL;
+    }
+}
+
+void profile_jump(emu_profile_t *profile, uint32_t offset,
+                  const decoded_instruction_t *decoded) {
+    if (decoded->opcode == op_jal) {
+        // the jal itself was run by the caller
+        settle_calls(profile);
+        uint32_t pc = profile->text_first_address + offset;
+        uint32_t callee = add_call_node(profile, profile->current_call_node,
+                                        jump_target(pc, decoded));
+        if (callee != NO_CALL_NODE) {
+            profile->call_nodes[callee].calls++;
+            profile->current_call_node = callee;
+        }
+    } else if (decoded->opcode == op_jr && decoded->s == ra) {
+        // and the jr $ra by the callee
+        settle_calls(profile);
+        if (profile->current_call_node != 0) {
+            profile->current_call_node =
+                profile->call_nodes[profile->current_call_node].parent;
+        }
+    }
+}
+
+void print_profile(emu_machine_t *machine) {
+    emu_profile_t *profile = machine->profile;
+    uint64_t total = total_count(profile);
+    printf("Profile of %llu instructions\n", (unsigned long long)total);
+    if (total == 0) {
+        return;
+    }
+    print_functions(profile, total);
+    print_hot_blocks(machine, total);
+    print_hot_instructions(machine, total);
+    print_opcode_mix(profile, total);
+    print_opcode_pairs(profile, total);
+}
+
+int write_profile(emu_machine_t *machine, const char *filename) {
+    emu_profile_t *profile = machine->profile;
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "can not write '%s': ", filename);
+        perror("");
+        return -1;
+    }
+
+    decoded_instruction_t decoded;
+    for (uint32_t i = 0; i < profile->text_words; i++) {
+        if (profile->pc_counts[i] != 0) {
+            uint32_t address = profile->text_first_address + i * 4;
+            decode_instruction(get_word(machine, address), &decoded);
+            fprintf(f, "instruction %08X %llu %s\n", address,
+                    (unsigned long long)profile->pc_counts[i],
+                    opcode_name(decoded.opcode));
+        }
+    }
+    for (int opcode = op_invalid; opcode < N_OPCODES; opcode++) {
+        uint64_t count = opcode_count(profile, opcode);
+        if (count != 0) {
+            fprintf(f, "opcode %s %llu\n", opcode_name(opcode),
+                    (unsigned long long)count);
+        }
+    }
+    for (int first = op_invalid; first < N_OPCODES; first++) {
+        for (int second = op_invalid; second < N_OPCODES; second++) {
+            uint64_t count = profile->pair_counts[first][second];
+            if (count != 0) {
+                fprintf(f, "pair %s %s %llu\n", opcode_name(first),
+                        opcode_name(second), (unsigned long long)count);
+            }
+        }
+    }
+
+    profile_function_t *functions;
+    uint32_t n_functions = summarise_functions(profile, &functions);
+    char buffer[16];
+    for (uint32_t i = 0; i < n_functions; i++) {
+        fprintf(f, "function %08X %s %llu %llu %llu\n", functions[i].address,
+                function_name(profile, functions[i].address, buffer),
+                (unsigned long long)functions[i].inclusive,
+                (unsigned long long)functions[i].exclusive,
+                (unsigned long long)functions[i].calls);
+    }
+    free(functions);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "can not write '%s': ", filename);
+        perror("");
+        return -1;
+    }
+    return 0;
+}
+
+int write_profile_folded(emu_machine_t *machine, const char *filename) {
+    emu_profile_t *profile = machine->profile;
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "can not write '%s': ", filename);
+        perror("");
+        return -1;
+    }
+
+    settle_calls(profile);
+    for (uint32_t n = 0; n < profile->n_call_nodes; n++) {
+        if (profile->call_nodes[n].self != 0) {
+            write_folded_stack(f, profile, n);
+            fprintf(f, " %llu\n",
+                    (unsigned long long)profile->call_nodes[n].self);
+        }
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "can not write '%s': ", filename);
+        perror("");
+        return -1;
+    }
+    return 0;
+}
+
+// Keeps the text segment's labels, sorted by address
+static bool copy_symbols(emu_profile_t *profile, const program_image_t *image) {
+    profile->symbols = calloc(image->n_symbols + 1, sizeof *profile->symbols);
+    if (profile->symbols == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < image->n_symbols; i++) {
+        uint32_t offset = image->symbols[i].address - profile->text_first_address;
+        if (offset >= profile->text_words * 4) {
+            continue;
+        }
+        program_symbol_t *symbol = &profile->symbols[profile->n_symbols];
+        symbol->name = strdup(image->symbols[i].name);
+        symbol->address = image->symbols[i].address;
+        if (symbol->name == NULL) {
+            return false;
+        }
+        profile->n_symbols++;
+    }
+    qsort(profile->symbols, profile->n_symbols, sizeof *profile->symbols,
+          compare_symbols);
+    return true;
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    const program_symbol_t *x = a;
+    const program_symbol_t *y = b;
+    if (x->address != y->address) {
+        return x->address < y->address ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Returns the child of parent for the function at address, adding it if
+// it's new, or NO_CALL_NODE if there isn't enough memory
+static uint32_t add_call_node(emu_profile_t *profile, uint32_t parent,
+                              uint32_t address) {
+    call_node_t *nodes = profile->call_nodes;
+    if (profile->n_call_nodes != 0) {
+        for (uint32_t child = nodes[parent].first_child; child != 0;
+             child = nodes[child].next_sibling) {
+            if (nodes[child].address == address) {
+                return child;
+            }
+        }
+    }
+
+    if (profile->n_call_nodes == profile->call_nodes_capacity) {
+        uint32_t capacity = profile->call_nodes_capacity
+                                ? profile->call_nodes_capacity * 2
+                                : 256;
+        nodes = realloc(nodes, capacity * sizeof *nodes);
+        if (nodes == NULL) {
+            return NO_CALL_NODE;
+        }
+        profile->call_nodes = nodes;
+        profile->call_nodes_capacity = capacity;
+    }
+
+    // node 0 is the root, which is no one's child
+    uint32_t node = profile->n_call_nodes++;
+    nodes[node] = (call_node_t){.address = address, .parent = parent};
+    if (node != 0) {
+        nodes[node].next_sibling = nodes[parent].first_child;
+        nodes[parent].first_child = node;
+    }
+    return node;
+}
+
+// Gives the instructions run since the last call or return to the function
+// they ran in
+static void settle_calls(emu_profile_t *profile) {
+    profile->call_nodes[profile->current_call_node].self +=
+        profile->executed - profile->attributed;
+    profile->attributed = profile->executed;
+}
+
+// Returns the first label at address, or else the address in hexadecimal
+// (written into buffer)
+static const char *function_name(const emu_profile_t *profile,
+                                 uint32_t address, char *buffer) {
+    uint32_t low = 0;
+    uint32_t high = profile->n_symbols;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (profile->symbols[middle].address < address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < profile->n_symbols && profile->symbols[low].address == address) {
+        return profile->symbols[low].name;
+    }
+    sprintf(buffer, "0x%08X", address);
+    return buffer;
+}
+
+// Adds up each function's counts over every context it was called in,
+// counting a recursive function's inclusive instructions only at its
+// outermost call.  Returns how many functions there are, with their counts
+// in a malloc'd array sorted by address (NULL if there isn't enough memory).
+static uint32_t summarise_functions(emu_profile_t *profile,
+                                    profile_function_t **functions) {
+    settle_calls(profile);
+    uint32_t n_nodes = profile->n_call_nodes;
+    const call_node_t *nodes = profile->call_nodes;
+
+    *functions = calloc(n_nodes, sizeof **functions);
+    uint64_t *inclusive = calloc(n_nodes, sizeof *inclusive);
+    uint32_t *node_function = calloc(n_nodes, sizeof *node_function);
+    uint32_t *active = calloc(n_nodes, sizeof *active);
+    if (*functions == NULL || inclusive == NULL || node_function == NULL ||
+        active == NULL) {
+        free(*functions);
+        *functions = NULL;
+        free(inclusive);
+        free(node_function);
+        free(active);
+        return 0;
+    }
+
+    // children are numbered after their parents
+    for (uint32_t n = n_nodes; n-- > 0;) {
+        inclusive[n] += nodes[n].self;
+        if (n != 0) {
+            inclusive[nodes[n].parent] += inclusive[n];
+        }
+    }
+
+    uint32_t n_functions = 0;
+    for (uint32_t n = 0; n < n_nodes; n++) {
+        (*functions)[n_functions++].address = nodes[n].address;
+    }
+    qsort(*functions, n_functions, sizeof **functions,
+          compare_function_addresses);
+    uint32_t n_unique = 0;
+    for (uint32_t f = 0; f < n_functions; f++) {
+        if (n_unique == 0 ||
+            (*functions)[n_unique - 1].address != (*functions)[f].address) {
+            (*functions)[n_unique++] = (*functions)[f];
+        }
+    }
+    n_functions = n_unique;
+    for (uint32_t n = 0; n < n_nodes; n++) {
+        profile_function_t key = {.address = nodes[n].address};
+        profile_function_t *function =
+            bsearch(&key, *functions, n_functions, sizeof key,
+                    compare_function_addresses);
+        node_function[n] = function - *functions;
+        function->exclusive += nodes[n].self;
+        function->calls += nodes[n].calls;
+    }
+
+    // walk the tree depth first, so active says which functions are
+    // already on the stack above each node
+    uint32_t n = 0;
+    for (;;) {
+        if (active[node_function[n]]++ == 0) {
+            (*functions)[node_function[n]].inclusive += inclusive[n];
+        }
+        if (nodes[n].first_child != 0) {
+            n = nodes[n].first_child;
+            continue;
+        }
+        while (n != 0 && nodes[n].next_sibling == 0) {
+            active[node_function[n]]--;
+            n = nodes[n].parent;
+        }
+        if (n == 0) {
+            break;
+        }
+        active[node_function[n]]--;
+        n = nodes[n].next_sibling;
+    }
+
+    free(inclusive);
+    free(node_function);
+    free(active);
+    return n_functions;
+}
+
+static int compare_function_addresses(const void *a, const void *b) {
+    const profile_function_t *x = a;
+    const profile_function_t *y = b;
+    return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static void print_functions(emu_profile_t *profile, uint64_t total) {
+    profile_function_t *functions;
+    uint32_t n_functions = summarise_functions(profile, &functions);
+    profile_entry_t *entries = calloc(n_functions + 1, sizeof *entries);
+    if (entries == NULL) {
+        free(functions);
+        return;
+    }
+    for (uint32_t f = 0; f < n_functions; f++) {
+        entries[f].count = functions[f].inclusive;
+        entries[f].first = f;
+    }
+    sort_entries(entries, n_functions);
+
+    printf("\nFunctions (instructions run including and excluding calls, "
+           "times called):\n");
+    char buffer[16];
+    for (uint32_t e = 0; e < n_functions && e < PROFILE_REPORT_LINES; e++) {
+        const profile_function_t *function = &functions[entries[e].first];
+        printf("%12llu %6.2f%% %12llu %6.2f%% %12llu  %s\n",
+               (unsigned long long)function->inclusive,
+               percent(function->inclusive, total),
+               (unsigned long long)function->exclusive,
+               percent(function->exclusive, total),
+               (unsigned long long)function->calls,
+               function_name(profile, function->address, buffer));
+    }
+
+    free(entries);
+    free(functions);
+}
+
+// Writes the names of the functions from the root down to node, separated
+// by semicolons
+static void write_folded_stack(FILE *f, const emu_profile_t *profile,
+                               uint32_t node) {
+    uint32_t depth = 0;
+    for (uint32_t n = node; n != 0; n = profile->call_nodes[n].parent) {
+        depth++;
+    }
+    uint32_t *path = malloc((depth + 1) * sizeof *path);
+    if (path == NULL) {
+        return;
+    }
+    uint32_t n = node;
+    for (uint32_t d = depth + 1; d-- > 0;) {
+        path[d] = n;
+        n = profile->call_nodes[n].parent;
+    }
+
+    char buffer[16];
+    for (uint32_t d = 0; d <= depth; d++) {
+        fprintf(f, "%s%s", d ? ";" : "",
+                function_name(profile, profile->call_nodes[path[d]].address,
+                              buffer));
+    }
+    free(path);
+}
+
+static uint64_t total_count(const emu_profile_t *profile) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < profile->text_words; i++) {
+        total += profile->pc_counts[i];
+    }
+    return total;
+}
+
+// Every execution of an opcode is the second half of exactly one pair
+static uint64_t opcode_count(const emu_profile_t *profile, opcode_t opcode) {
+    uint64_t count = 0;
+    for (int previous = 0; previous < N_OPCODES; previous++) {
+        count += profile->pair_counts[previous][opcode];
+    }
+    return count;
+}
+
+// Marks the first instruction of each basic block: the start of the text,
+// anything a branch or jump goes to, and anything straight after a branch,
+// jump, syscall or invalid instruction
+static bool *find_block_starts(emu_machine_t *machine) {
+    emu_profile_t *profile = machine->profile;
+    bool *starts = calloc(profile->text_words + 1, sizeof *starts);
+    if (starts == NULL) {
+        return NULL;
+    }
+    starts[0] = true;
+
+    decoded_instruction_t decoded;
+    for (uint32_t i = 0; i < profile->text_words; i++) {
+        uint32_t address = profile->text_first_address + i * 4;
+        decode_instruction(get_word(machine, address), &decoded);
+
+        uint32_t target = address;
+        if (decoded.handler == handler_branch) {
+            target = address + decoded.imm * 4;
+        } else if (decoded.opcode == op_j || decoded.opcode == op_jal) {
+            target = (address & 0xF0000000) | (uint32_t)decoded.imm << 2;
+        } else if (decoded.handler != handler_jump &&
+                   decoded.handler != handler_syscall &&
+                   decoded.handler != handler_invalid) {
+            continue;
+        }
+
+        uint32_t target_index = (target - profile->text_first_address) / 4;
+        if (target_index < profile->text_words) {
+            starts[target_index] = true;
+        }
+        starts[i + 1] = true;
+    }
+    return starts;
+}
+
+static void print_hot_blocks(emu_machine_t *machine, uint64_t total) {
+    emu_profile_t *profile = machine->profile;
+    bool *starts = find_block_starts(machine);
+    profile_entry_t *blocks = calloc(profile->text_words, sizeof *blocks);
+    if (starts == NULL || blocks == NULL) {
+        free(starts);
+        free(blocks);
+        return;
+    }
+
+    uint32_t n_blocks = 0;
+    for (uint32_t i = 0; i < profile->text_words; i++) {
+        if (starts[i]) {
+            blocks[n_blocks].first = i;
+            n_blocks++;
+        }
+        blocks[n_blocks - 1].second = i;
+        blocks[n_blocks - 1].count += profile->pc_counts[i];
+    }
+    sort_entries(blocks, n_blocks);
+
+    printf("\nHottest basic blocks (instructions run, times entered):\n");
+    for (uint32_t b = 0; b < n_blocks && b < PROFILE_REPORT_LINES; b++) {
+        if (blocks[b].count == 0) {
+            break;
+        }
+        printf("%12llu %6.2f%% %12llu  [%08X-%08X] %u instruction%s\n",
+               (unsigned long long)blocks[b].count,
+               percent(blocks[b].count, total),
+               (unsigned long long)profile->pc_counts[blocks[b].first],
+               profile->text_first_address + blocks[b].first * 4,
+               profile->text_first_address + blocks[b].second * 4,
+               blocks[b].second - blocks[b].first + 1,
+               blocks[b].second == blocks[b].first ? "" : "s");
+    }
+
+    free(starts);
+    free(blocks);
+}
+
+static void print_hot_instructions(emu_machine_t *machine, uint64_t total) {
+    emu_profile_t *profile = machine->profile;
+    profile_entry_t *instructions =
+        calloc(profile->text_words, sizeof *instructions);
+    if (instructions == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < profile->text_words; i++) {
+        instructions[i].count = profile->pc_counts[i];
+        instructions[i].first = i;
+    }
+    sort_entries(instructions, profile->text_words);
+
+    printf("\nHottest instructions:\n");
+    for (uint32_t i = 0; i < profile->text_words && i < PROFILE_REPORT_LINES;
+         i++) {
+        if (instructions[i].count == 0) {
+            break;
+        }
+        printf("%12llu %6.2f%%  ", (unsigned long long)instructions[i].count,
+               percent(instructions[i].count, total));
+        print_instruction_at_address(
+            machine, profile->text_first_address + instructions[i].first * 4);
+    }
+
+    free(instructions);
+}
+
+static void print_opcode_mix(const emu_profile_t *profile, uint64_t total) {
+    profile_entry_t opcodes[N_OPCODES];
+    for (int opcode = 0; opcode < N_OPCODES; opcode++) {
+        opcodes[opcode].count = opcode_count(profile, opcode);
+        opcodes[opcode].first = opcode;
+    }
+    sort_entries(opcodes, N_OPCODES);
+
+    printf("\nOpcode mix:\n");
+    for (int o = 0; o < N_OPCODES && opcodes[o].count != 0; o++) {
+        printf("%12llu %6.2f%%  %s\n", (unsigned long long)opcodes[o].count,
+               percent(opcodes[o].count, total),
+               opcode_name(opcodes[o].first));
+    }
+}
+
+static void print_opcode_pairs(const emu_profile_t *profile, uint64_t total) {
+    profile_entry_t pairs[N_OPCODES * N_OPCODES];
+    uint32_t n_pairs = 0;
+    for (int first = op_invalid; first < N_OPCODES; first++) {
+        for (int second = op_invalid; second < N_OPCODES; second++) {
+            if (profile->pair_counts[first][second] != 0) {
+                pairs[n_pairs].count = profile->pair_counts[first][second];
+                pairs[n_pairs].first = first;
+                pairs[n_pairs].second = second;
+                n_pairs++;
+            }
+        }
+    }
+    sort_entries(pairs, n_pairs);
+
+    printf("\nCommonest opcode pairs:\n");
+    for (uint32_t p = 0; p < n_pairs && p < PROFILE_REPORT_LINES; p++) {
+        printf("%12llu %6.2f%%  %s, %s\n", (unsigned long long)pairs[p].count,
+               percent(pairs[p].count, total), opcode_name(pairs[p].first),
+               opcode_name(pairs[p].second));
+    }
+}
+
+// Sorts hottest first, then in address or opcode order
+static void sort_entries(profile_entry_t *entries, uint32_t n_entries) {
+    qsort(entries, n_entries, sizeof *entries, compare_entries);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const profile_entry_t *x = a;
+    const profile_entry_t *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    if (x->first != y->first) {
+        return x->first < y->first ? -1 : 1;
+    }
+    return x->second < y->second ? -1 : x->second > y->second;
+}
+
+static double percent(uint64_t count, uint64_t total) {
+    return 100.0 * count / total;
+}
@@ -0,0 +1,98 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "decode_instruction.h"
+#include "machine.h"
+#include "program_image.h"
+
+// One calling context: a function (named by its address), reached through
+// the calls of every node above it.  Nodes are numbered in the order they
+// were first called, so a node's parent always has a smaller number.
+typedef struct call_node {
+    uint32_t address;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    // instructions run in this context but not in anything it called
+    uint64_t self;
+    uint64_t calls;
+} call_node_t;
+
+// How often each instruction of the text segment has run, which opcodes
+// ran straight after which, and which function they ran in.  Counting is
+// just indexing arrays, so leaving it on costs little.
+typedef struct emu_profile {
+    uint32_t text_first_address;
+    uint32_t text_words;
+    // executions of each word of the text segment
+    uint64_t *pc_counts;
+    // pair_counts[a][b] is how often opcode b ran straight after opcode a,
+    // with op_undecoded standing for the start of the program
+    uint64_t pair_counts[N_OPCODES][N_OPCODES];
+    uint8_t previous_opcode;
+
+    // instructions counted, and how many of them are in call_nodes' selfs
+    uint64_t executed;
+    uint64_t attributed;
+    // a shadow call stack, kept as a tree of every calling context seen:
+    // jal calls a function and jr $ra returns from the current one
+    call_node_t *call_nodes;
+    uint32_t n_call_nodes;
+    uint32_t call_nodes_capacity;
+    uint32_t current_call_node;
+
+    // the program's labels, for naming functions
+    uint32_t n_symbols;
+    program_symbol_t *symbols;
+} emu_profile_t;
+
+// Starts counting the instructions a machine runs, returning false if
+// there isn't enough memory.  Profiling can't stop once it has started.
+// Functions are named after image's labels.
+bool start_profile(emu_machine_t *machine, const program_image_t *image);
+
+// Frees a machine's profile, if it has one
+void free_profile(emu_machine_t *machine);
+
+// Moves up or down the shadow call stack for a jump about to run
+void profile_jump(emu_profile_t *profile, uint32_t offset,
+                  const decoded_instruction_t *decoded);
+
+// Counts one execution of the (decoded) instruction at offset bytes into
+// the text segment
+static inline void profile_instruction(emu_profile_t *profile,
+                                       uint32_t offset,
+                                       const decoded_instruction_t *decoded) {
+    profile->pc_counts[offset / 4]++;
+    profile->pair_counts[profile->previous_opcode][decoded->opcode]++;
+    profile->previous_opcode = decoded->opcode;
+    profile->executed++;
+    if (decoded->handler == handler_jump) {
+        profile_jump(profile, offset, decoded);
+    }
+}
+
+// Prints the functions that ran the most instructions (including what they
+// called), the hottest basic blocks and instructions (with their
+// disassembly), the opcode mix and the commonest opcode pairs
+void print_profile(emu_machine_t *machine);
+
+// Writes every count to a file, one per line, for other programs to read:
+//
+//     instruction <address> <count> <opcode>
+//     opcode <opcode> <count>
+//     pair <first opcode> <second opcode> <count>
+//     function <address> <name> <inclusive> <exclusive> <calls>
+//
+// Addresses are hexadecimal, and only non-zero counts are written.
+// Returns 0 on success, or prints why not and returns -1.
+int write_profile(emu_machine_t *machine, const char *filename);
+
+// Writes the instructions run in each calling context in the folded stack
+// format flame graph tools read, e.g. `main;fib;fib 1234'.  Returns 0 on
+// success, or prints why not and returns -1.
+int write_profile_folded(emu_machine_t *machine, const char *filename);
+
+#endif
@@ -0,0 +1,207 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "program_image.h"
+
+#define HEADER_LENGTH 40
+#define SYMBOL_ENTRY_LENGTH 8
+// segments must end below the range kept for the stack
+#define STACK_RANGE_ADDRESS 0x7F000000
+
+static uint32_t read_le32(const uint8_t *bytes);
+static void write_le32(uint8_t *bytes, uint32_t value);
+static uint32_t align4(uint32_t offset);
+static int in_file(uint64_t offset, uint64_t length, size_t file_length);
+static int below_stack(uint32_t address, uint32_t length);
+
+void free_program_image(program_image_t *image) {
+    if (image->mapping != NULL) {
+        // everything but the symbol array lives in the mapping
+        munmap(image->mapping, image->mapping_length);
+    } else {
+        free(image->text);
+        free(image->data);
+        for (uint32_t i = 0; i < image->n_symbols; i++) {
+            free(image->symbols[i].name);
+        }
+    }
+    free(image->symbols);
+    image->text = NULL;
+    image->data = NULL;
+    image->symbols = NULL;
+    image->n_symbols = 0;
+    image->mapping = NULL;
+    image->mapping_length = 0;
+}
+
+int write_program_image(const program_image_t *image, const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    int ok = f != NULL && write_program_image_to(image, f) == 0;
+    if (f != NULL && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "can not write '%s': ", filename);
+        perror("");
+    }
+    return ok ? 0 : -1;
+}
+
+int write_program_image_to(const program_image_t *image, FILE *f) {
+    uint32_t text_offset = HEADER_LENGTH;
+    uint32_t data_offset = align4(text_offset + image->text_length);
+    uint32_t symbols_offset = align4(data_offset + image->data_length);
+    uint32_t names_offset =
+        symbols_offset + image->n_symbols * SYMBOL_ENTRY_LENGTH;
+    uint32_t length = names_offset;
+    for (uint32_t i = 0; i < image->n_symbols; i++) {
+        length += strlen(image->symbols[i].name) + 1;
+    }
+
+    uint8_t *contents = calloc(length, 1);
+    if (contents == NULL) {
+        return -1;
+    }
+
+    memcpy(contents, PROGRAM_IMAGE_MAGIC, 4);
+    write_le32(contents + 4, PROGRAM_IMAGE_VERSION);
+    write_le32(contents + 8, image->text_address);
+    write_le32(contents + 12, image->text_length);
+    write_le32(contents + 16, text_offset);
+    write_le32(contents + 20, image->data_address);
+    write_le32(contents + 24, image->data_length);
+    write_le32(contents + 28, data_offset);
+    write_le32(contents + 32, image->n_symbols);
+    write_le32(contents + 36, symbols_offset);
+    memcpy(contents + text_offset, image->text, image->text_length);
+    memcpy(contents + data_offset, image->data, image->data_length);
+
+    uint32_t name_offset = names_offset;
+    for (uint32_t i = 0; i < image->n_symbols; i++) {
+        uint8_t *entry = contents + symbols_offset + i * SYMBOL_ENTRY_LENGTH;
+        write_le32(entry, name_offset);
+        write_le32(entry + 4, image->symbols[i].address);
+        size_t name_length = strlen(image->symbols[i].name) + 1;
+        memcpy(contents + name_offset, image->symbols[i].name, name_length);
+        name_offset += name_length;
+    }
+
+    int ok = fwrite(contents, 1, length, f) == length;
+    free(contents);
+    return ok ? 0 : -1;
+}
+
+int map_program_image(const char *filename, program_image_t *image) {
+    memset(image, 0, sizeof *image);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "can not open '%s': ", filename);
+        perror("");
+        return -1;
+    }
+
+    char magic[4];
+    struct stat s;
+    if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) ||
+        pread(fd, magic, sizeof magic, 0) != sizeof magic ||
+        memcmp(magic, PROGRAM_IMAGE_MAGIC, sizeof magic) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t length = s.st_size;
+    uint8_t *contents = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (contents == MAP_FAILED) {
+        fprintf(stderr, "can not map '%s': ", filename);
+        perror("");
+        return -1;
+    }
+    image->mapping = contents;
+    image->mapping_length = length;
+
+    const char *problem = NULL;
+    if (length < HEADER_LENGTH) {
+        problem = "truncated";
+    } else if (read_le32(contents + 4) != PROGRAM_IMAGE_VERSION) {
+        problem = "unsupported version";
+    } else {
+        image->text_address = read_le32(contents + 8);
+        image->text_length = read_le32(contents + 12);
+        image->data_address = read_le32(contents + 20);
+        image->data_length = read_le32(contents + 24);
+        uint32_t text_offset = read_le32(contents + 16);
+        uint32_t data_offset = read_le32(contents + 28);
+        uint32_t n_symbols = read_le32(contents + 32);
+        uint32_t symbols_offset = read_le32(contents + 36);
+
+        if (!in_file(text_offset, image->text_length, length) ||
+            !in_file(data_offset, image->data_length, length) ||
+            !in_file(symbols_offset,
+                     (uint64_t)n_symbols * SYMBOL_ENTRY_LENGTH, length)) {
+            problem = "truncated";
+        } else if (!below_stack(image->text_address, image->text_length) ||
+                   !below_stack(image->data_address, image->data_length) ||
+                   image->text_address % 4 != 0) {
+            problem = "bad";
+        } else {
+            image->text = contents + text_offset;
+            image->data = contents + data_offset;
+            image->symbols = calloc(n_symbols + 1, sizeof *image->symbols);
+            if (image->symbols == NULL) {
+                problem = "out of memory";
+            }
+        }
+
+        // names are used where they are, they just need to be checked
+        for (uint32_t i = 0; problem == NULL && i < n_symbols; i++) {
+            const uint8_t *entry =
+                contents + symbols_offset + i * SYMBOL_ENTRY_LENGTH;
+            uint32_t name_offset = read_le32(entry);
+            if (name_offset >= length ||
+                memchr(contents + name_offset, '\0',
+                       length - name_offset) == NULL) {
+                problem = "bad symbol table";
+                break;
+            }
+            image->symbols[i].name = (char *)contents + name_offset;
+            image->symbols[i].address = read_le32(entry + 4);
+            image->n_symbols++;
+        }
+    }
+
+    if (problem != NULL) {
+        fprintf(stderr, "%s: %s program image\n", filename, problem);
+        free_program_image(image);
+        return -1;
+    }
+    return 1;
+}
+
+static uint32_t read_le32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void write_le32(uint8_t *bytes, uint32_t value) {
+    for (int b = 0; b < 4; b++) {
+        bytes[b] = value >> (b * 8);
+    }
+}
+
+static uint32_t align4(uint32_t offset) {
+    return (offset + 3) & ~(uint32_t)3;
+}
+
+static int in_file(uint64_t offset, uint64_t length, size_t file_length) {
+    return offset + length <= file_length;
+}
+
+static int below_stack(uint32_t address, uint32_t length) {
+    return (uint64_t)address + length <= STACK_RANGE_ADDRESS;
+}
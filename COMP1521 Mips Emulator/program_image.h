@@ -0,0 +1,66 @@
+#ifndef PROGRAM_IMAGE_H
+#define PROGRAM_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A label and the address it stands for
+typedef struct program_symbol {
+    char *name;
+    uint32_t address;
+} program_symbol_t;
+
+// An assembled program: the initial contents of its text and data segments
+// (little-endian, as they appear in memory) and the labels it defines
+typedef struct program_image {
+    uint32_t text_address;
+    uint32_t text_length;
+    uint8_t *text;
+    uint32_t data_address;
+    uint32_t data_length;
+    uint8_t *data;
+    uint32_t n_symbols;
+    program_symbol_t *symbols;
+
+    // the file text, data and the symbol names point into, if it was mapped
+    // by map_program_image(), otherwise NULL
+    void *mapping;
+    size_t mapping_length;
+} program_image_t;
+
+// Binary program image files start with this, followed by the version
+#define PROGRAM_IMAGE_MAGIC "EMUI"
+#define PROGRAM_IMAGE_VERSION 1
+
+// Frees everything a program image points to
+void free_program_image(program_image_t *image);
+
+// Writes a program image to a file in the binary format:
+//
+//     offset  (each field is a little-endian uint32_t)
+//          0  magic "EMUI"
+//          4  version
+//          8  text address, text length, offset of the text in the file
+//         20  data address, data length, offset of the data in the file
+//         32  number of symbols, offset of the symbol table
+//         40  ... text and data, as raw little-endian bytes
+//             symbol table: for each symbol, the file offset of its
+//             NUL-terminated name, then its address
+//
+// Returns 0 on success, or prints why not and returns -1.
+int write_program_image(const program_image_t *image, const char *filename);
+
+// Writes a program image to an already open stream in the same format,
+// returning 0 on success or -1 without printing anything
+int write_program_image_to(const program_image_t *image, FILE *f);
+
+// Maps a binary program image file into memory and points image at it,
+// without copying or parsing the segments.
+//
+// Returns 1 if it was mapped, 0 if the file isn't a program image (e.g. it's
+// assembly source), or prints why not and returns -1 if it's a program image
+// that can't be used.
+int map_program_image(const char *filename, program_image_t *image);
+
+#endif
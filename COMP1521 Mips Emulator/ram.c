@@ -7,82 +7,703 @@
 // // // // // // // DO NOT MODIFY THIS FILE! // // // // // // // // //
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#ifdef EMU_GUARD_PAGES
+#include <setjmp.h>
+#include <signal.h>
+#endif
+
+#include "cfg.h"
 #include "emu.h"
+#include "machine.h"
+#include "profile.h"
 #include "ram.h"
+#include "stats.h"
+
+// Guest memory is handed out in 4 KiB pages, and only once it is stored to
+#define PAGE_BITS 12
+#define GUEST_PAGE_SIZE (1u << PAGE_BITS)
+#define PAGE_OFFSET_MASK (GUEST_PAGE_SIZE - 1)
+
+// The stack starts out as the 64 KiB below 0x80000000, and grows down to
+// any page above STACK_LOWEST_ADDRESS the program uses
+#define STACK_FIRST_ADDRESS 0x7FFF0000
+#define STACK_LOWEST_ADDRESS 0x7F000000
+
+// The heap starts at the page after the data segment, and the heap segment
+// grows in chunks of this many bytes as sbrk moves the break past its end
+#define HEAP_CHUNK_SIZE (2u << 20)
+
+// A page stored to since the snapshot, and what it held then.  Without
+// guard pages before is the segment's page itself (NULL if it had none),
+// with them a copy of it in the segment's copies.
+typedef struct dirty_page {
+    uint32_t address;
+    uint8_t *before;
+} dirty_page_t;
 
 typedef struct memory_segment {
     uint32_t first_address;
     uint32_t last_address;
+#ifdef EMU_GUARD_PAGES
+    // guest_memory + first_address
     uint8_t *bytes;
+#else
+    // the pages from the one holding first_address to the one holding
+    // last_address + 3 (so segment_word can read a word at the end), each
+    // NULL until something is stored in it
+    uint8_t **pages;
+    // pages[p] if it can be stored to in place, NULL if it has to be
+    // allocated or (after a snapshot) copied first, see write_page
+    uint8_t **writable;
+    uint32_t n_pages;
+    // the checkpoint the pages were mapped from by map_memory, if any
+    // (pages in it aren't freed, see free_page)
+    uint8_t *mapping;
+    size_t mapping_length;
+#endif
+    // whether stores are being tracked for reset_memory, and the pages
+    // stored to since snapshot_memory
+    bool tracking;
+    dirty_page_t *dirty;
+    uint32_t n_dirty;
+    uint32_t dirty_capacity;
+#ifdef EMU_GUARD_PAGES
+    // room for a copy of each of the dirty_capacity pages the segment had at
+    // the snapshot, taken in the fault handler, which can't allocate
+    uint8_t *copies;
+#endif
     struct memory_segment *next;
 } memory_segment_t;
 
-// segments chained with next pointers
-static memory_segment_t *text_segment;
-static memory_segment_t *data_segment;
-static memory_segment_t *stack_segment;
+#ifdef EMU_GUARD_PAGES
+// The whole 4 GiB guest address space is reserved up front with every page
+// inaccessible, and only the pages holding segments are made accessible.
+// Guest address A lives at guest_memory + A, and an access outside the
+// segments' pages is caught as a SIGSEGV instead of being checked for.  The
+// kernel only gives the reservation memory as pages are touched.
+// one extra page so that a word access at 0xFFFFFFFF faults too
+#define GUEST_MEMORY_SIZE (((uint64_t)1 << 32) + GUEST_PAGE_SIZE)
+
+// the machine running on this thread, if any, and where to go if it faults
+static __thread struct emu_memory *running_memory;
+static __thread sigjmp_buf *fault_recovery;
+static __thread uint32_t fault_address;
+#else
+// Guest memory is found through a two level page table, mapping each 4 KiB
+// page of the address space to the segment it belongs to.
+#define PAGE_TABLE_BITS 10
+#define N_PAGE_TABLE_ENTRIES (1 << PAGE_TABLE_BITS)
+
+// what pages nothing has been stored to read as
+static const uint8_t zero_page[GUEST_PAGE_SIZE];
+#endif
+
+// A machine's memory
+typedef struct emu_memory {
+#ifdef EMU_GUARD_PAGES
+    uint8_t *guest_memory;
+#else
+    memory_segment_t **page_directory[N_PAGE_TABLE_ENTRIES];
+#endif
+
+    // segments chained with next pointers
+    memory_segment_t *text_segment;
+    memory_segment_t *data_segment;
+    memory_segment_t *stack_segment;
+    // NULL until the program first calls sbrk
+    memory_segment_t *heap_segment;
+    // where the heap starts, and where sbrk has moved its end to
+    uint32_t heap_start;
+    uint32_t heap_break;
+
+    // text segment decoded ahead of time, indexed by
+    // (address - first_address) / 4
+    decoded_instruction_t *text_decoded;
+    // the same, with superinstructions where they can be made
+    decoded_instruction_t *text_fused;
+    // number of times the program has written to its text segment
+    uint32_t text_write_count;
+    // the text segment's basic blocks, as they were when text_write_count
+    // was cfg_write_count
+    cfg_t *cfg;
+    uint32_t cfg_write_count;
+
+    // what snapshot_memory saw, for reset_memory to go back to
+    bool has_snapshot;
+    uint32_t snapshot_stack_first;
+    uint32_t snapshot_heap_last;    // 0 if there was no heap
+    uint32_t snapshot_heap_break;
+} emu_memory_t;
 
 static int in_segment(uint32_t address, memory_segment_t *segment);
-static memory_segment_t *read_segment(FILE *f, uint32_t start_word,
-                                      uint32_t finish_word, int is_text);
-static memory_segment_t *create_segment(uint32_t start_word,
+static memory_segment_t *load_segment(emu_memory_t *memory,
+                                      uint32_t start_word,
+                                      const uint8_t *bytes, uint32_t length,
+                                      int is_text);
+static memory_segment_t *create_segment(emu_memory_t *memory,
+                                        uint32_t start_word,
                                         uint32_t finish_word);
+static void free_segment(memory_segment_t *segment);
+static memory_segment_t *find_segment(emu_memory_t *memory, uint32_t address);
+static bool grow_stack(emu_memory_t *memory, uint32_t address);
+static void grow_heap(emu_memory_t *memory, uint32_t end);
+static void load_bytes(memory_segment_t *segment, uint32_t address,
+                       const uint8_t *bytes, uint32_t length);
 static void print_segment(memory_segment_t *segment);
 static uint32_t word_n_repeats(memory_segment_t *segment, uint32_t address);
-static uint32_t get_word(memory_segment_t *segment, uint32_t address);
+static uint32_t segment_word(memory_segment_t *segment, uint32_t address);
+static decoded_instruction_t *predecode_segment(memory_segment_t *segment);
+static decoded_instruction_t *fuse_segment(memory_segment_t *segment,
+                                           decoded_instruction_t *decoded);
+static void fuse_word(emu_memory_t *memory, uint32_t w);
+static void text_written(emu_memory_t *memory, uint32_t address);
+static void decode_text(emu_machine_t *machine, uint32_t n_words);
+static cfg_t *current_cfg(emu_machine_t *machine);
+static void restore_dirty_page(emu_memory_t *memory,
+                               memory_segment_t *segment,
+                               const dirty_page_t *dirty);
+static void forget_dirty_pages(memory_segment_t *segment);
+static void shrink_stack(emu_memory_t *memory, uint32_t first_address);
+static void shrink_heap(emu_memory_t *memory, uint32_t last_address);
+static void link_segments(emu_memory_t *memory);
+static uint32_t checkpoint_n_pages(const checkpoint_segment_t *segment);
+static bool map_checkpoint_pages(emu_memory_t *memory,
+                                 memory_segment_t *segment,
+                                 const checkpoint_segment_t *extent, int fd);
+static bool all_zero(const uint8_t *page);
 
-static memory_segment_t *address2segment(uint32_t address) {
-    for (memory_segment_t *s = text_segment; s != NULL; s = s->next) {
-        if (address >= s->first_address && address <= s->last_address) {
-            return s;
+// Where the byte at address in a segment is kept: read_bytes for reading it
+// and write_bytes for storing to it, which gives the segment the page first
+// if it hasn't got it yet.  Both can go as far as contiguous_length bytes
+// on from address.
+#ifdef EMU_GUARD_PAGES
+static inline const uint8_t *read_bytes(memory_segment_t *segment,
+                                        uint32_t address) {
+    return segment->bytes + (address - segment->first_address);
+}
+
+static inline uint8_t *write_bytes(memory_segment_t *segment,
+                                   uint32_t address) {
+    return segment->bytes + (address - segment->first_address);
+}
+
+static inline uint32_t contiguous_length(memory_segment_t *segment,
+                                         uint32_t address) {
+    return segment->last_address - address + 1;
+}
+#else
+static uint8_t *write_page(memory_segment_t *segment, uint32_t p);
+
+static inline uint32_t page_index(memory_segment_t *segment,
+                                  uint32_t address) {
+    return (address >> PAGE_BITS) - (segment->first_address >> PAGE_BITS);
+}
+
+static inline const uint8_t *read_bytes(memory_segment_t *segment,
+                                        uint32_t address) {
+    const uint8_t *page = segment->pages[page_index(segment, address)];
+    return (page != NULL ? page : zero_page) + (address & PAGE_OFFSET_MASK);
+}
+
+static inline uint8_t *write_bytes(memory_segment_t *segment,
+                                   uint32_t address) {
+    uint32_t p = page_index(segment, address);
+    uint8_t *page = segment->writable[p];
+    if (page == NULL) {
+        page = write_page(segment, p);
+    }
+    return page + (address & PAGE_OFFSET_MASK);
+}
+
+static inline uint32_t contiguous_length(memory_segment_t *segment,
+                                         uint32_t address) {
+    uint32_t to_page_end = GUEST_PAGE_SIZE - (address & PAGE_OFFSET_MASK);
+    uint32_t to_segment_end = segment->last_address - address + 1;
+    return to_page_end < to_segment_end ? to_page_end : to_segment_end;
+}
+#endif
+
+#ifdef EMU_GUARD_PAGES
+static void reserve_guest_memory(emu_memory_t *memory);
+static void protect_pages(void *address, size_t length, int protection);
+static void guest_fault_handler(int signal, siginfo_t *info, void *context);
+static void reserve_dirty_pages(memory_segment_t *segment);
+static bool save_dirty_page(emu_memory_t *memory, uint32_t address);
+
+// The pages a segment has accessible, from the one holding first_address to
+// the one holding last_address + 3
+static inline uint64_t segment_first_page(memory_segment_t *segment) {
+    return segment->first_address & ~(uint64_t)PAGE_OFFSET_MASK;
+}
+
+static inline uint64_t segment_end_page(memory_segment_t *segment) {
+    return ((uint64_t)segment->last_address + 3 + GUEST_PAGE_SIZE) &
+           ~(uint64_t)PAGE_OFFSET_MASK;
+}
+
+uint8_t get_byte(emu_machine_t *machine, uint32_t address) {
+    return machine->memory->guest_memory[address];
+}
+
+void set_byte(emu_machine_t *machine, uint32_t address, uint8_t value) {
+    emu_memory_t *memory = machine->memory;
+    memory->guest_memory[address] = value;
+    if (in_segment(address, memory->text_segment)) {
+        text_written(memory, address);
+    }
+}
+
+uint16_t get_half(emu_machine_t *machine, uint32_t address) {
+    uint8_t *bytes = &machine->memory->guest_memory[address];
+    return bytes[0] | bytes[1] << 8;
+}
+
+uint32_t get_word(emu_machine_t *machine, uint32_t address) {
+    uint8_t *bytes = &machine->memory->guest_memory[address];
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+// Stores that might touch the text segment go through set_byte
+#define MIGHT_WRITE_TEXT(memory, address, n_bytes)                          \
+    ((address) + (n_bytes) - 1 >= (memory)->text_segment->first_address &&  \
+     (address) <= (memory)->text_segment->last_address)
+
+void set_half(emu_machine_t *machine, uint32_t address, uint16_t value) {
+    if (MIGHT_WRITE_TEXT(machine->memory, address, 2)) {
+        set_byte(machine, address, value);
+        set_byte(machine, address + 1, value >> 8);
+        return;
+    }
+    uint8_t *bytes = &machine->memory->guest_memory[address];
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+}
+
+void set_word(emu_machine_t *machine, uint32_t address, uint32_t value) {
+    if (MIGHT_WRITE_TEXT(machine->memory, address, 4)) {
+        set_byte(machine, address, value);
+        set_byte(machine, address + 1, value >> 8);
+        set_byte(machine, address + 2, value >> 16);
+        set_byte(machine, address + 3, value >> 24);
+        return;
+    }
+    uint8_t *bytes = &machine->memory->guest_memory[address];
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+}
+
+int run_guarded(emu_machine_t *machine, int (*run)(emu_machine_t *machine)) {
+    sigjmp_buf recovery;
+    if (sigsetjmp(recovery, 0)) {
+        fault_recovery = NULL;
+        running_memory = NULL;
+        STATS_COUNT(machine, invalid_addresses);
+        fprintf(stderr, "invalid address used: %08X\n", fault_address);
+        return -1;
+    }
+    running_memory = machine->memory;
+    fault_recovery = &recovery;
+    int status = run(machine);
+    fault_recovery = NULL;
+    running_memory = NULL;
+    return status;
+}
+
+static void reserve_guest_memory(emu_memory_t *memory) {
+    memory->guest_memory =
+        mmap(NULL, GUEST_MEMORY_SIZE, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(memory->guest_memory != MAP_FAILED);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = guest_fault_handler;
+    // SIGSEGV stays unblocked after jumping out of the handler
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, NULL) != 0) {
+        perror("sigaction");
+        abort();
+    }
+}
+
+// Changes the protection of pages of guest memory.  mprotect only fails if
+// the kernel runs out of memory, and the guest can't carry on without the
+// change, so that ends emu.
+static void protect_pages(void *address, size_t length, int protection) {
+    if (mprotect(address, length, protection) != 0) {
+        perror("mprotect");
+        abort();
+    }
+}
+
+static void guest_fault_handler(int signal, siginfo_t *info, void *context) {
+    (void)signal;
+    (void)context;
+    uint8_t *host_address = info->si_addr;
+    if (fault_recovery == NULL || host_address < running_memory->guest_memory ||
+        host_address >= running_memory->guest_memory + GUEST_MEMORY_SIZE) {
+        // a bug in the emulator itself, crash the usual way
+        struct sigaction action;
+        memset(&action, 0, sizeof action);
+        action.sa_handler = SIG_DFL;
+        sigaction(SIGSEGV, &action, NULL);
+        return;
+    }
+    fault_address = host_address - running_memory->guest_memory;
+    if (save_dirty_page(running_memory, fault_address)) {
+        // try the store again, now that the page can be written
+        return;
+    }
+    if (grow_stack(running_memory, fault_address)) {
+        // try the access again, now that the stack reaches it
+        return;
+    }
+    siglongjmp(*fault_recovery, 1);
+}
+
+// Makes room for copies of all of a segment's pages before they are made
+// read-only, as only those pages fault and the copies are taken in the
+// fault handler.  The room is only given memory as copies are made.
+static void reserve_dirty_pages(memory_segment_t *segment) {
+    uint32_t n_pages =
+        (segment_end_page(segment) - segment_first_page(segment)) >> PAGE_BITS;
+    if (n_pages == segment->dirty_capacity) {
+        return;
+    }
+    if (segment->copies != NULL) {
+        munmap(segment->copies,
+               (size_t)segment->dirty_capacity * GUEST_PAGE_SIZE);
+    }
+    segment->copies = mmap(NULL, (size_t)n_pages * GUEST_PAGE_SIZE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(segment->copies != MAP_FAILED);
+    segment->dirty = realloc(segment->dirty, n_pages * sizeof *segment->dirty);
+    assert(segment->dirty);
+    segment->dirty_capacity = n_pages;
+}
+
+// After a snapshot the segments' pages are read-only, so the first store to
+// each one faults.  If address is in one of those pages, copies it for
+// reset_memory and makes it writable, returning whether it did.  This runs
+// in the fault handler, so only uses room reserve_dirty_pages made.
+static bool save_dirty_page(emu_memory_t *memory, uint32_t address) {
+    for (memory_segment_t *s = memory->text_segment; s != NULL; s = s->next) {
+        if (!s->tracking || address < segment_first_page(s) ||
+            address >= segment_end_page(s) ||
+            s->n_dirty == s->dirty_capacity) {
+            continue;
         }
+        uint32_t page = address & ~PAGE_OFFSET_MASK;
+        uint8_t *before = s->copies + (size_t)s->n_dirty * GUEST_PAGE_SIZE;
+        memcpy(before, memory->guest_memory + page, GUEST_PAGE_SIZE);
+        s->dirty[s->n_dirty++] = (dirty_page_t){page, before};
+        return mprotect(memory->guest_memory + page, GUEST_PAGE_SIZE,
+                        PROT_READ | PROT_WRITE) == 0;
     }
-    fprintf(stderr, "invalid address used: %08X\n", address);
-    return NULL;
+    return false;
 }
+#else
+static void map_segment(emu_memory_t *memory, memory_segment_t *segment);
+static void add_dirty_page(memory_segment_t *segment, uint32_t address,
+                           uint8_t *before);
+static void free_page(memory_segment_t *segment, uint8_t *page);
+static void unmap_pages(emu_memory_t *memory, memory_segment_t *segment,
+                        uint32_t first_address, uint32_t last_address);
 
-uint8_t get_byte(uint32_t address) {
-    memory_segment_t *s = address2segment(address);
-    return s ? s->bytes[address - s->first_address] : 0;
+static inline memory_segment_t *page_segment(emu_memory_t *memory,
+                                             uint32_t address) {
+    memory_segment_t **table =
+        memory->page_directory[address >> (PAGE_BITS + PAGE_TABLE_BITS)];
+    if (table == NULL) {
+        return NULL;
+    }
+    return table[(address >> PAGE_BITS) & (N_PAGE_TABLE_ENTRIES - 1)];
 }
 
-void set_byte(uint32_t address, uint8_t value) {
-    memory_segment_t *s = address2segment(address);
+static memory_segment_t *address2segment(emu_memory_t *memory,
+                                         uint32_t address) {
+    memory_segment_t *page = page_segment(memory, address);
+    if (page != NULL && in_segment(address, page)) {
+        return page;
+    }
+
+    // a page shared by two segments only points at one of them
+    memory_segment_t *s = find_segment(memory, address);
+    if (s == NULL) {
+        fprintf(stderr, "invalid address used: %08X\n", address);
+    }
+    return s;
+}
+
+uint8_t get_byte(emu_machine_t *machine, uint32_t address) {
+    memory_segment_t *s = address2segment(machine->memory, address);
+    STATS_COUNT(machine, segment_lookups);
+    if (s == NULL) {
+        STATS_COUNT(machine, invalid_addresses);
+    }
+    return s ? *read_bytes(s, address) : 0;
+}
+
+void set_byte(emu_machine_t *machine, uint32_t address, uint8_t value) {
+    emu_memory_t *memory = machine->memory;
+    memory_segment_t *s = address2segment(memory, address);
+    STATS_COUNT(machine, segment_lookups);
+    if (s == NULL) {
+        STATS_COUNT(machine, invalid_addresses);
+    }
     if (s) {
-        s->bytes[address - s->first_address] = value;
+        *write_bytes(s, address) = value;
+        if (s == memory->text_segment) {
+            text_written(memory, address);
+        }
+    }
+}
+
+// Returns the segment holding all of [address, address + n_bytes), or NULL
+// if the bytes are spread over pages or segments or aren't all valid
+static inline memory_segment_t *range2segment(emu_memory_t *memory,
+                                              uint32_t address,
+                                              uint32_t n_bytes) {
+    memory_segment_t *s = page_segment(memory, address);
+    if (s != NULL && address >= s->first_address &&
+        n_bytes - 1 <= s->last_address - address &&
+        (address & PAGE_OFFSET_MASK) <= GUEST_PAGE_SIZE - n_bytes) {
+        return s;
+    }
+    return NULL;
+}
+
+uint16_t get_half(emu_machine_t *machine, uint32_t address) {
+    memory_segment_t *s = range2segment(machine->memory, address, 2);
+    STATS_COUNT(machine, page_lookups);
+    if (s == NULL) {
+        return get_byte(machine, address) |
+               get_byte(machine, address + 1) << 8;
     }
+    const uint8_t *bytes = read_bytes(s, address);
+    return bytes[0] | bytes[1] << 8;
 }
 
-void read_program(FILE *f) {
-    uint32_t start_word, finish_word;
+uint32_t get_word(emu_machine_t *machine, uint32_t address) {
+    memory_segment_t *s = range2segment(machine->memory, address, 4);
+    STATS_COUNT(machine, page_lookups);
+    if (s == NULL) {
+        return (uint32_t)get_byte(machine, address) |
+               (uint32_t)get_byte(machine, address + 1) << 8 |
+               (uint32_t)get_byte(machine, address + 2) << 16 |
+               (uint32_t)get_byte(machine, address + 3) << 24;
+    }
+    const uint8_t *bytes = read_bytes(s, address);
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
 
-    assert(fscanf(f, ".text # %X .. %X\n", &start_word, &finish_word) == 2);
-    text_segment = read_segment(f, start_word, finish_word, 1);
+void set_half(emu_machine_t *machine, uint32_t address, uint16_t value) {
+    memory_segment_t *s = range2segment(machine->memory, address, 2);
+    STATS_COUNT(machine, page_lookups);
+    if (s == NULL || s == machine->memory->text_segment) {
+        set_byte(machine, address, value);
+        set_byte(machine, address + 1, value >> 8);
+        return;
+    }
+    uint8_t *bytes = write_bytes(s, address);
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+}
 
-    assert(fscanf(f, ".data # %X .. %X\n", &start_word, &finish_word) == 2);
-    data_segment = read_segment(f, start_word, finish_word, 0);
+void set_word(emu_machine_t *machine, uint32_t address, uint32_t value) {
+    memory_segment_t *s = range2segment(machine->memory, address, 4);
+    STATS_COUNT(machine, page_lookups);
+    if (s == NULL || s == machine->memory->text_segment) {
+        // set_byte deals with the program modifying its own instructions
+        set_byte(machine, address, value);
+        set_byte(machine, address + 1, value >> 8);
+        set_byte(machine, address + 2, value >> 16);
+        set_byte(machine, address + 3, value >> 24);
+        return;
+    }
+    uint8_t *bytes = write_bytes(s, address);
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+}
 
-    stack_segment = create_segment(0x7FFF0000, 0x7FFFFFFF);
+int run_guarded(emu_machine_t *machine, int (*run)(emu_machine_t *machine)) {
+    // invalid addresses are reported as they are used
+    return run(machine);
+}
+#endif
 
-    text_segment->next = data_segment;
-    data_segment->next = stack_segment;
+static void text_written(emu_memory_t *memory, uint32_t address) {
+    // program has modified itself, decode this word again when run
+    uint32_t w = (address - memory->text_segment->first_address) / 4;
+    memory->text_decoded[w].opcode = op_undecoded;
+    memory->text_fused[w].opcode = op_undecoded;
+    // and don't run it as the second half of a superinstruction
+    if (w > 0 && memory->text_fused[w - 1].opcode >= N_OPCODES) {
+        memory->text_fused[w - 1] = memory->text_decoded[w - 1];
+    }
+    memory->text_write_count++;
+}
+
+const uint8_t *get_bytes(emu_machine_t *machine, uint32_t address,
+                         uint32_t *length) {
+    STATS_COUNT(machine, segment_lookups);
+    memory_segment_t *s = find_segment(machine->memory, address);
+    if (s == NULL) {
+        return NULL;
+    }
+    *length = contiguous_length(s, address);
+    return read_bytes(s, address);
+}
+
+void set_bytes(emu_machine_t *machine, uint32_t address, const uint8_t *bytes,
+               uint32_t length) {
+    emu_memory_t *memory = machine->memory;
+    while (length > 0) {
+        memory_segment_t *s = find_segment(memory, address);
+        STATS_COUNT(machine, segment_lookups);
+        if (s == NULL || s == memory->text_segment) {
+            // set_byte reports invalid addresses and notices the program
+            // modifying its own instructions
+            set_byte(machine, address, *bytes);
+            if (s == NULL) {
+                return;
+            }
+            address++;
+            bytes++;
+            length--;
+            continue;
+        }
+        uint32_t n = contiguous_length(s, address);
+        n = n < length ? n : length;
+        memcpy(write_bytes(s, address), bytes, n);
+        address += n;
+        bytes += n;
+        length -= n;
+    }
 }
 
-void print_instruction_at_address(uint32_t address) {
-    uint32_t word = get_word(text_segment, address);
+void load_program(emu_machine_t *machine, const program_image_t *image) {
+    emu_memory_t *memory = calloc(1, sizeof *memory);
+    assert(memory);
+    machine->memory = memory;
+#ifdef EMU_GUARD_PAGES
+    reserve_guest_memory(memory);
+#endif
+
+    memory->text_segment = load_segment(memory, image->text_address,
+                                        image->text, image->text_length, 1);
+    decode_text(machine, image->text_length / 4);
+
+    memory->data_segment = load_segment(memory, image->data_address,
+                                        image->data, image->data_length, 0);
+
+    memory->stack_segment =
+        create_segment(memory, STACK_FIRST_ADDRESS, 0x7FFFFFFF);
+
+    memory->heap_start = (memory->data_segment->last_address + 1 +
+                          PAGE_OFFSET_MASK) & ~PAGE_OFFSET_MASK;
+    memory->heap_break = memory->heap_start;
+
+    link_segments(memory);
+}
+
+// Decodes the text segment ahead of time, and finds the basic blocks of its
+// first n_words words
+static void decode_text(emu_machine_t *machine, uint32_t n_words) {
+    emu_memory_t *memory = machine->memory;
+    STATS_TIME(machine, stats_decode,
+               memory->text_decoded = predecode_segment(memory->text_segment));
+    STATS_TIME(machine, stats_decode,
+               memory->text_fused = fuse_segment(memory->text_segment,
+                                                 memory->text_decoded));
+    STATS_TIME(machine, stats_decode,
+               memory->cfg = build_cfg(memory->text_decoded,
+                                       memory->text_segment->first_address,
+                                       n_words));
+    assert(memory->cfg);
+}
+
+// Chains the segments together in address order and, without guard pages,
+// puts them in the page table
+static void link_segments(emu_memory_t *memory) {
+    memory->text_segment->next = memory->data_segment;
+    if (memory->heap_segment != NULL) {
+        memory->data_segment->next = memory->heap_segment;
+        memory->heap_segment->next = memory->stack_segment;
+    } else {
+        memory->data_segment->next = memory->stack_segment;
+    }
+    memory->stack_segment->next = NULL;
+
+#ifndef EMU_GUARD_PAGES
+    map_segment(memory, memory->text_segment);
+    map_segment(memory, memory->data_segment);
+    map_segment(memory, memory->stack_segment);
+    if (memory->heap_segment != NULL) {
+        map_segment(memory, memory->heap_segment);
+    }
+#endif
+}
+
+void free_program(emu_machine_t *machine) {
+    emu_memory_t *memory = machine->memory;
+    if (memory == NULL) {
+        return;
+    }
+
+    memory_segment_t *segment = memory->text_segment;
+    while (segment != NULL) {
+        memory_segment_t *next = segment->next;
+        free_segment(segment);
+        segment = next;
+    }
+    free(memory->text_decoded);
+    free(memory->text_fused);
+    free_cfg(memory->cfg);
+#ifdef EMU_GUARD_PAGES
+    munmap(memory->guest_memory, GUEST_MEMORY_SIZE);
+#else
+    for (int t = 0; t < N_PAGE_TABLE_ENTRIES; t++) {
+        free(memory->page_directory[t]);
+    }
+#endif
+    free(memory);
+    machine->memory = NULL;
+}
+
+void print_instruction_at_address(emu_machine_t *machine, uint32_t address) {
+    uint32_t word = segment_word(machine->memory->text_segment, address);
     printf("[%08X] %08X ", address, word);
     print_instruction(word);
     printf("\n");
 }
 
-void print_program(void) {
+void print_program(emu_machine_t *machine) {
+    memory_segment_t *text_segment = machine->memory->text_segment;
     for (uint32_t address = text_segment->first_address;
          address < text_segment->last_address; address += 4)
-        print_instruction_at_address(address);
+        print_instruction_at_address(machine, address);
+}
+
+void print_program_cfg(emu_machine_t *machine) {
+    print_cfg(stdout, current_cfg(machine));
 }
 
 static int in_segment(uint32_t address, memory_segment_t *segment) {
@@ -93,53 +714,247 @@ static int in_segment(uint32_t address, memory_segment_t *segment) {
 // returns -1 if outside text_segment before or after execution
 // returns 1 for syscall exit
 // returns 0 otherwise
-int execute_next_instruction(uint32_t *program_counter) {
-    if (!in_segment(*program_counter, text_segment)) {
+int execute_next_instruction(emu_machine_t *machine) {
+    emu_memory_t *memory = machine->memory;
+    memory_segment_t *text_segment = memory->text_segment;
+    if (!in_segment(machine->program_counter, text_segment)) {
         return -1;
     }
 
-    uint32_t instruction = get_word(text_segment, *program_counter);
+    machine->instruction_count++;
+    uint32_t offset = machine->program_counter - text_segment->first_address;
+    if (offset % 4 == 0) {
+        decoded_instruction_t *decoded = &memory->text_decoded[offset / 4];
+        if (decoded->opcode == op_undecoded) {
+            decode_text_word(machine, machine->program_counter);
+        }
+        if (machine->profile != NULL) {
+            profile_instruction(machine->profile, offset, decoded);
+        }
+        if (execute_decoded_instruction(machine, decoded)) {
+            return 1;
+        }
+    } else {
+        uint32_t instruction =
+            segment_word(text_segment, machine->program_counter);
+        if (execute_instruction(machine, instruction)) {
+            return 1;
+        }
+    }
 
-    if (execute_instruction(instruction, program_counter)) {
-        return 1;
+    if (!in_segment(machine->program_counter, text_segment)) {
+        return -1;
     }
 
-    if (!in_segment(*program_counter, text_segment)) {
+    return 0;
+}
+
+// the same as execute_next_instruction, but for the rest of a basic block:
+// only the instructions that end blocks can go anywhere but the next word,
+// so the program counter is checked once on the way in and once on the
+// way out
+int execute_next_block(emu_machine_t *machine) {
+    emu_memory_t *memory = machine->memory;
+    memory_segment_t *text_segment = memory->text_segment;
+    if (!in_segment(machine->program_counter, text_segment)) {
+        return -1;
+    }
+    uint32_t offset = machine->program_counter - text_segment->first_address;
+    cfg_t *cfg = current_cfg(machine);
+    if (offset % 4 != 0 || offset / 4 >= cfg->n_words) {
+        return execute_next_instruction(machine);
+    }
+
+    uint32_t w = offset / 4;
+    uint32_t last = cfg->blocks[cfg->block_of[w]].last;
+    for (;; w++) {
+        machine->instruction_count++;
+        decoded_instruction_t *decoded = &memory->text_decoded[w];
+        if (machine->profile != NULL) {
+            profile_instruction(machine->profile, w * 4, decoded);
+        }
+        if (execute_decoded_instruction(machine, decoded)) {
+            return 1;
+        }
+        // a store into the text segment can change the blocks
+        if (w == last || memory->text_write_count != memory->cfg_write_count) {
+            break;
+        }
+    }
+
+    if (!in_segment(machine->program_counter, text_segment)) {
         return -1;
     }
 
     return 0;
 }
 
-static memory_segment_t *read_segment(
-    FILE *f, uint32_t start_word, uint32_t finish_word, int is_text
+// the blocks for the text as it is now, decoding any words the program has
+// written to first
+static cfg_t *current_cfg(emu_machine_t *machine) {
+    emu_memory_t *memory = machine->memory;
+    if (memory->cfg_write_count != memory->text_write_count) {
+        memory_segment_t *text_segment = memory->text_segment;
+        uint32_t n_words = memory->cfg->n_words;
+        for (uint32_t w = 0; w < n_words; w++) {
+            if (memory->text_decoded[w].opcode == op_undecoded) {
+                decode_text_word(machine, text_segment->first_address + w * 4);
+            }
+        }
+        free_cfg(memory->cfg);
+        STATS_TIME(machine, stats_decode,
+                   memory->cfg = build_cfg(memory->text_decoded,
+                                           text_segment->first_address,
+                                           n_words));
+        assert(memory->cfg);
+        memory->cfg_write_count = memory->text_write_count;
+    }
+    return memory->cfg;
+}
+
+static memory_segment_t *load_segment(
+    emu_memory_t *memory, uint32_t start_word, const uint8_t *bytes,
+    uint32_t length, int is_text
 ) {
-    memory_segment_t *segment = create_segment(start_word, finish_word);
+    memory_segment_t *segment =
+        create_segment(memory, start_word, start_word + length);
+    load_bytes(segment, start_word, bytes, length);
+    if (is_text) {
+        // addu is executed as add
+        for (uint32_t w = 0; w < length / 4; w++) {
+            uint32_t word = segment_word(segment, start_word + w * 4);
+            if ((word & 0xFA00003F) == 0x21) {
+                *write_bytes(segment, start_word + w * 4) &= ~1;
+            }
+        }
+    }
+    return segment;
+}
+
+// Copies bytes into a new segment, leaving out the pages that would only
+// get zeros (like those of a big .space), so they cost nothing until the
+// program stores to them
+static void load_bytes(memory_segment_t *segment, uint32_t address,
+                       const uint8_t *bytes, uint32_t length) {
+    while (length > 0) {
+        uint32_t n = GUEST_PAGE_SIZE - (address & PAGE_OFFSET_MASK);
+        n = n < length ? n : length;
+        for (uint32_t i = 0; i < n; i++) {
+            if (bytes[i] != 0) {
+                memcpy(write_bytes(segment, address), bytes, n);
+                break;
+            }
+        }
+        address += n;
+        bytes += n;
+        length -= n;
+    }
+}
 
-    fscanf(f, ".word");
-    if (finish_word - start_word == 0) {
-        fgetc(f); // read newline
-        fgetc(f); // read newline
+static decoded_instruction_t *predecode_segment(memory_segment_t *segment) {
+    uint32_t n_words =
+        (segment->last_address - segment->first_address) / 4 + 1;
+    decoded_instruction_t *decoded = calloc(n_words, sizeof *decoded);
+    assert(decoded);
+    for (uint32_t w = 0; w < n_words; w++) {
+        decode_instruction(
+            segment_word(segment, segment->first_address + w * 4), &decoded[w]);
     }
-    // `spim -assemble` can output HALF WORD aligned finish_word
-    // so we need to round up
-    uint32_t n_words = 1 + (((finish_word - start_word) - 1) / 4);
+    return decoded;
+}
+
+static decoded_instruction_t *fuse_segment(memory_segment_t *segment,
+                                           decoded_instruction_t *decoded) {
+    uint32_t n_words =
+        (segment->last_address - segment->first_address) / 4 + 1;
+    decoded_instruction_t *fused = malloc(n_words * sizeof *fused);
+    assert(fused);
     for (uint32_t w = 0; w < n_words; w++) {
-        uint32_t word;
-        assert(fscanf(f, "%X", &word) == 1);
-        if (is_text && (word & 0xFA00003F) == 0x21) {
-            word &= ~(uint32_t)1;
+        const decoded_instruction_t *next = w + 1 < n_words ? &decoded[w + 1]
+                                                            : NULL;
+        if (!make_superinstruction(&decoded[w], next, &fused[w])) {
+            fused[w] = decoded[w];
         }
-        for (unsigned int b = 0; b < 4; b++) {
-            segment->bytes[w * 4 + b] = (word >> (b * 8)) & 0xFF;
+    }
+    return fused;
+}
+
+// Brings text_fused up to date with a word of text_decoded that has just
+// been decoded again
+static void fuse_word(emu_memory_t *memory, uint32_t w) {
+    memory_segment_t *text_segment = memory->text_segment;
+    uint32_t n_words =
+        (text_segment->last_address - text_segment->first_address) / 4 + 1;
+    const decoded_instruction_t *next = NULL;
+    if (w + 1 < n_words && memory->text_decoded[w + 1].opcode != op_undecoded) {
+        next = &memory->text_decoded[w + 1];
+    }
+    if (!make_superinstruction(&memory->text_decoded[w], next,
+                               &memory->text_fused[w])) {
+        memory->text_fused[w] = memory->text_decoded[w];
+    }
+}
+
+#ifndef EMU_GUARD_PAGES
+static void map_segment(emu_memory_t *memory, memory_segment_t *segment) {
+    uint32_t first_page = segment->first_address >> PAGE_BITS;
+    uint32_t last_page = segment->last_address >> PAGE_BITS;
+    for (uint32_t page = first_page; page <= last_page; page++) {
+        memory_segment_t ***table =
+            &memory->page_directory[page >> PAGE_TABLE_BITS];
+        if (*table == NULL) {
+            *table = calloc(N_PAGE_TABLE_ENTRIES, sizeof **table);
+            assert(*table);
+        }
+        memory_segment_t **entry =
+            &(*table)[page & (N_PAGE_TABLE_ENTRIES - 1)];
+        if (*entry == NULL) {
+            *entry = segment;
         }
-        fgetc(f); // read ',' or newline
     }
-    return segment;
 }
 
+// Takes the pages from the one holding first_address to the one holding
+// last_address out of the page table, where they are segment's
+static void unmap_pages(emu_memory_t *memory, memory_segment_t *segment,
+                        uint32_t first_address, uint32_t last_address) {
+    for (uint32_t page = first_address >> PAGE_BITS;
+         page <= last_address >> PAGE_BITS; page++) {
+        memory_segment_t **table =
+            memory->page_directory[page >> PAGE_TABLE_BITS];
+        if (table != NULL &&
+            table[page & (N_PAGE_TABLE_ENTRIES - 1)] == segment) {
+            table[page & (N_PAGE_TABLE_ENTRIES - 1)] = NULL;
+        }
+    }
+}
+
+// Gives a segment page p of its own to store to: a new page of zeros if it
+// hasn't got one, or a copy of the page the snapshot has, which is kept for
+// reset_memory to put back
+static uint8_t *write_page(memory_segment_t *segment, uint32_t p) {
+    uint8_t *before = segment->pages[p];
+    uint8_t *page = malloc(GUEST_PAGE_SIZE);
+    assert(page);
+    if (before != NULL) {
+        memcpy(page, before, GUEST_PAGE_SIZE);
+    } else {
+        memset(page, 0, GUEST_PAGE_SIZE);
+    }
+    if (segment->tracking) {
+        add_dirty_page(segment,
+                       ((segment->first_address >> PAGE_BITS) + p)
+                           << PAGE_BITS,
+                       before);
+    }
+    segment->pages[p] = page;
+    segment->writable[p] = page;
+    return page;
+}
+#endif
+
 static memory_segment_t *create_segment(
-    uint32_t start_word, uint32_t finish_word
+    emu_memory_t *memory, uint32_t start_word, uint32_t finish_word
 ) {
     memory_segment_t *segment = malloc(sizeof *segment);
     assert(segment);
@@ -149,28 +964,535 @@ static memory_segment_t *create_segment(
         finish_word = start_word + 4;
     }
     segment->last_address = finish_word - 1;
-    segment->bytes = calloc(finish_word - start_word, 4);
-    assert(segment->bytes);
+#ifdef EMU_GUARD_PAGES
+    // segment_word can read up to 3 bytes past a half word aligned end
+    uint64_t first_page = start_word & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+    uint64_t end_page = ((uint64_t)finish_word + 3 + GUEST_PAGE_SIZE - 1) &
+                        ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+    protect_pages(memory->guest_memory + first_page, end_page - first_page,
+                  PROT_READ | PROT_WRITE);
+    segment->bytes = memory->guest_memory + start_word;
+    segment->copies = NULL;
+#else
+    (void)memory;
+    segment->n_pages = ((segment->last_address + (uint64_t)3) >> PAGE_BITS) -
+                       (start_word >> PAGE_BITS) + 1;
+    segment->pages = calloc(segment->n_pages, sizeof *segment->pages);
+    segment->writable = calloc(segment->n_pages, sizeof *segment->writable);
+    assert(segment->pages && segment->writable);
+    segment->mapping = NULL;
+    segment->mapping_length = 0;
+#endif
+    segment->tracking = false;
+    segment->dirty = NULL;
+    segment->n_dirty = 0;
+    segment->dirty_capacity = 0;
     segment->next = NULL;
     return segment;
 }
 
-void print_text_segment(void) {
-    print_segment(text_segment);
+static void free_segment(memory_segment_t *segment) {
+    forget_dirty_pages(segment);
+    free(segment->dirty);
+#ifdef EMU_GUARD_PAGES
+    if (segment->copies != NULL) {
+        munmap(segment->copies,
+               (size_t)segment->dirty_capacity * GUEST_PAGE_SIZE);
+    }
+#else
+    // with guard pages the bytes are part of the guest memory reservation
+    for (uint32_t p = 0; p < segment->n_pages; p++) {
+        free_page(segment, segment->pages[p]);
+    }
+    free(segment->pages);
+    free(segment->writable);
+    if (segment->mapping != NULL) {
+        munmap(segment->mapping, segment->mapping_length);
+    }
+#endif
+    free(segment);
+}
+
+#ifndef EMU_GUARD_PAGES
+static void free_page(memory_segment_t *segment, uint8_t *page) {
+    if (page >= segment->mapping &&
+        page < segment->mapping + segment->mapping_length) {
+        return;
+    }
+    free(page);
+}
+#endif
+
+uint32_t move_heap_break(emu_machine_t *machine, int32_t increment) {
+    emu_memory_t *memory = machine->memory;
+    uint32_t old_break = memory->heap_break;
+    // keep the break word aligned, so everything sbrk hands out is too
+    int64_t new_break = old_break + (((int64_t)increment + 3) & ~(int64_t)3);
+    if (new_break < memory->heap_start || new_break > STACK_LOWEST_ADDRESS) {
+        return 0xFFFFFFFF;
+    }
+    uint32_t heap_end = memory->heap_segment != NULL
+                            ? memory->heap_segment->last_address + 1
+                            : memory->heap_start;
+    if (new_break > heap_end) {
+        grow_heap(memory, new_break);
+    }
+    memory->heap_break = new_break;
+    return old_break;
+}
+
+// Makes the heap segment reach at least as far as end (exclusive), a whole
+// number of chunks from the start of the heap.  Growing it only adds pages,
+// so nothing already in the heap moves.
+static void grow_heap(emu_memory_t *memory, uint32_t end) {
+    uint64_t chunks = ((uint64_t)end - memory->heap_start + HEAP_CHUNK_SIZE -
+                       1) / HEAP_CHUNK_SIZE;
+    uint64_t finish = memory->heap_start + chunks * HEAP_CHUNK_SIZE;
+    if (finish > STACK_LOWEST_ADDRESS) {
+        finish = STACK_LOWEST_ADDRESS;
+    }
+
+    memory_segment_t *heap = memory->heap_segment;
+    if (heap == NULL) {
+        heap = create_segment(memory, memory->heap_start, finish);
+        heap->next = memory->data_segment->next;
+        memory->data_segment->next = heap;
+        memory->heap_segment = heap;
+    } else {
+#ifdef EMU_GUARD_PAGES
+        // only the new pages: after a snapshot the old ones are read-only
+        uint64_t first_page = segment_end_page(heap);
+        uint64_t end_page = (finish + 3 + GUEST_PAGE_SIZE - 1) &
+                            ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+        if (end_page > first_page) {
+            protect_pages(memory->guest_memory + first_page,
+                          end_page - first_page,
+                          PROT_READ | PROT_WRITE);
+        }
+#else
+        uint32_t n_pages = ((finish - 1 + (uint64_t)3) >> PAGE_BITS) -
+                           (heap->first_address >> PAGE_BITS) + 1;
+        uint8_t **pages = realloc(heap->pages, n_pages * sizeof *pages);
+        uint8_t **writable =
+            realloc(heap->writable, n_pages * sizeof *writable);
+        assert(pages && writable);
+        memset(pages + heap->n_pages, 0,
+               (n_pages - heap->n_pages) * sizeof *pages);
+        memset(writable + heap->n_pages, 0,
+               (n_pages - heap->n_pages) * sizeof *writable);
+        heap->pages = pages;
+        heap->writable = writable;
+        heap->n_pages = n_pages;
+#endif
+        heap->last_address = finish - 1;
+    }
+#ifdef EMU_GUARD_PAGES
+#ifdef MADV_HUGEPAGE
+    // the heap is the one place big enough for huge pages to be worth it
+    madvise(memory->guest_memory + heap->first_address,
+            heap->last_address + 1 - heap->first_address, MADV_HUGEPAGE);
+#endif
+#else
+    map_segment(memory, heap);
+#endif
+}
+
+// Returns the segment address is in, or NULL if it isn't in one.  An
+// address below the stack, but not too far below, gets the stack grown
+// down to it.
+static memory_segment_t *find_segment(emu_memory_t *memory, uint32_t address) {
+    for (memory_segment_t *s = memory->text_segment; s != NULL; s = s->next) {
+        if (in_segment(address, s)) {
+            return s;
+        }
+    }
+    if (grow_stack(memory, address)) {
+        return memory->stack_segment;
+    }
+    return NULL;
+}
+
+// Moves the start of the stack down to the page holding address, if it is
+// between STACK_LOWEST_ADDRESS and the stack, returning whether it did.
+// With guard pages this is also called from the SIGSEGV handler, so it only
+// changes page protections.
+static bool grow_stack(emu_memory_t *memory, uint32_t address) {
+    memory_segment_t *stack = memory->stack_segment;
+    if (stack == NULL || address < STACK_LOWEST_ADDRESS ||
+        address >= stack->first_address) {
+        return false;
+    }
+    uint32_t first_address = address & ~PAGE_OFFSET_MASK;
+#ifdef EMU_GUARD_PAGES
+    if (mprotect(memory->guest_memory + first_address,
+                 stack->first_address - first_address,
+                 PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    stack->bytes = memory->guest_memory + first_address;
+#else
+    uint32_t n_new = (stack->first_address - first_address) >> PAGE_BITS;
+    uint8_t **pages =
+        realloc(stack->pages, (stack->n_pages + n_new) * sizeof *pages);
+    uint8_t **writable =
+        realloc(stack->writable, (stack->n_pages + n_new) * sizeof *writable);
+    assert(pages && writable);
+    memmove(pages + n_new, pages, stack->n_pages * sizeof *pages);
+    memset(pages, 0, n_new * sizeof *pages);
+    memmove(writable + n_new, writable, stack->n_pages * sizeof *writable);
+    memset(writable, 0, n_new * sizeof *writable);
+    stack->pages = pages;
+    stack->writable = writable;
+    stack->n_pages += n_new;
+#endif
+    stack->first_address = first_address;
+#ifndef EMU_GUARD_PAGES
+    map_segment(memory, stack);
+#endif
+    return true;
+}
+
+void snapshot_memory(emu_machine_t *machine) {
+    emu_memory_t *memory = machine->memory;
+    for (memory_segment_t *s = memory->text_segment; s != NULL; s = s->next) {
+        // what the last snapshot had won't be gone back to
+        forget_dirty_pages(s);
+        s->tracking = true;
+#ifdef EMU_GUARD_PAGES
+        reserve_dirty_pages(s);
+        protect_pages(memory->guest_memory + segment_first_page(s),
+                      segment_end_page(s) - segment_first_page(s),
+                      PROT_READ);
+#else
+        memset(s->writable, 0, s->n_pages * sizeof *s->writable);
+#endif
+    }
+    memory->has_snapshot = true;
+    memory->snapshot_stack_first = memory->stack_segment->first_address;
+    memory->snapshot_heap_last = memory->heap_segment != NULL
+                                     ? memory->heap_segment->last_address
+                                     : 0;
+    memory->snapshot_heap_break = memory->heap_break;
+}
+
+void reset_memory(emu_machine_t *machine) {
+    emu_memory_t *memory = machine->memory;
+    assert(memory->has_snapshot);
+    for (memory_segment_t *s = memory->text_segment; s != NULL; s = s->next) {
+        for (uint32_t d = 0; d < s->n_dirty; d++) {
+            restore_dirty_page(memory, s, &s->dirty[d]);
+        }
+        s->n_dirty = 0;
+    }
+    shrink_stack(memory, memory->snapshot_stack_first);
+    shrink_heap(memory, memory->snapshot_heap_last);
+    memory->heap_break = memory->snapshot_heap_break;
+}
+
+#ifndef EMU_GUARD_PAGES
+static void add_dirty_page(memory_segment_t *segment, uint32_t address,
+                           uint8_t *before) {
+    if (segment->n_dirty == segment->dirty_capacity) {
+        segment->dirty_capacity =
+            segment->dirty_capacity ? 2 * segment->dirty_capacity : 16;
+        segment->dirty = realloc(segment->dirty, segment->dirty_capacity *
+                                                     sizeof *segment->dirty);
+        assert(segment->dirty);
+    }
+    segment->dirty[segment->n_dirty++] = (dirty_page_t){address, before};
+}
+#endif
+
+// Puts a page back the way it was at the snapshot, ready to be tracked again
+static void restore_dirty_page(emu_memory_t *memory,
+                               memory_segment_t *segment,
+                               const dirty_page_t *dirty) {
+#ifdef EMU_GUARD_PAGES
+    uint8_t *page = memory->guest_memory + dirty->address;
+    memcpy(page, dirty->before, GUEST_PAGE_SIZE);
+    protect_pages(page, GUEST_PAGE_SIZE, PROT_READ);
+#else
+    uint32_t p = page_index(segment, dirty->address);
+    free_page(segment, segment->pages[p]);
+    segment->pages[p] = dirty->before;
+    segment->writable[p] = NULL;
+#endif
+    if (segment == memory->text_segment) {
+        // the program may have modified its instructions in this page
+        uint32_t first = dirty->address > segment->first_address
+                             ? dirty->address
+                             : segment->first_address;
+        uint32_t last = dirty->address + PAGE_OFFSET_MASK;
+        last = last < segment->last_address ? last : segment->last_address;
+        for (uint64_t address = first; address <= last; address += 4) {
+            text_written(memory, address);
+        }
+    }
+}
+
+static void forget_dirty_pages(memory_segment_t *segment) {
+#ifndef EMU_GUARD_PAGES
+    for (uint32_t d = 0; d < segment->n_dirty; d++) {
+        free_page(segment, segment->dirty[d].before);
+    }
+#endif
+    segment->n_dirty = 0;
+}
+
+// Gives back the pages the stack has grown down into since the snapshot,
+// which restore_dirty_page has already emptied
+static void shrink_stack(emu_memory_t *memory, uint32_t first_address) {
+    memory_segment_t *stack = memory->stack_segment;
+    if (stack->first_address >= first_address) {
+        return;
+    }
+#ifdef EMU_GUARD_PAGES
+    // zero them for next time, and make them inaccessible again
+    uint8_t *bytes = memory->guest_memory + stack->first_address;
+    size_t length = first_address - stack->first_address;
+    madvise(bytes, length, MADV_DONTNEED);
+    protect_pages(bytes, length, PROT_NONE);
+    stack->bytes = memory->guest_memory + first_address;
+#else
+    uint32_t n_old = (first_address - stack->first_address) >> PAGE_BITS;
+    for (uint32_t p = 0; p < n_old; p++) {
+        free_page(stack, stack->pages[p]);
+    }
+    stack->n_pages -= n_old;
+    memmove(stack->pages, stack->pages + n_old,
+            stack->n_pages * sizeof *stack->pages);
+    memmove(stack->writable, stack->writable + n_old,
+            stack->n_pages * sizeof *stack->writable);
+    unmap_pages(memory, stack, stack->first_address, first_address - 1);
+#endif
+    stack->first_address = first_address;
 }
 
-void print_data_segment(void) {
-    print_segment(data_segment);
+// Cuts the heap segment back to end at last_address, or removes it if
+// last_address is 0, giving back pages restore_dirty_page has already
+// emptied
+static void shrink_heap(emu_memory_t *memory, uint32_t last_address) {
+    memory_segment_t *heap = memory->heap_segment;
+    if (heap == NULL || heap->last_address == last_address) {
+        return;
+    }
+#ifdef EMU_GUARD_PAGES
+    uint64_t first_page = last_address != 0
+                              ? ((uint64_t)last_address + 3 +
+                                 GUEST_PAGE_SIZE) & ~(uint64_t)PAGE_OFFSET_MASK
+                              : segment_first_page(heap);
+    uint64_t end_page = segment_end_page(heap);
+    madvise(memory->guest_memory + first_page, end_page - first_page,
+            MADV_DONTNEED);
+    if (last_address == 0) {
+        // the first page can be the data segment's last, which it reads a
+        // word at a time
+        uint64_t data_end = segment_end_page(memory->data_segment);
+        if (data_end > first_page) {
+            protect_pages(memory->guest_memory + first_page,
+                          data_end - first_page, PROT_READ);
+            first_page = data_end;
+        }
+    }
+    if (end_page > first_page) {
+        protect_pages(memory->guest_memory + first_page,
+                      end_page - first_page, PROT_NONE);
+    }
+#else
+    uint32_t n_pages = last_address != 0
+                           ? ((last_address + (uint64_t)3) >> PAGE_BITS) -
+                                 (heap->first_address >> PAGE_BITS) + 1
+                           : 0;
+    for (uint32_t p = n_pages; p < heap->n_pages; p++) {
+        free_page(heap, heap->pages[p]);
+        heap->pages[p] = NULL;
+        heap->writable[p] = NULL;
+    }
+    heap->n_pages = n_pages;
+    unmap_pages(memory, heap,
+                last_address != 0 ? (last_address | PAGE_OFFSET_MASK) + 1
+                                  : heap->first_address,
+                heap->last_address);
+#endif
+    if (last_address != 0) {
+        heap->last_address = last_address;
+        return;
+    }
+    // the heap didn't exist at the snapshot
+    memory_segment_t *s = memory->text_segment;
+    while (s->next != heap) {
+        s = s->next;
+    }
+    s->next = heap->next;
+    free_segment(heap);
+    memory->heap_segment = NULL;
+}
+
+uint64_t get_memory_layout(emu_machine_t *machine, uint32_t offset,
+                           memory_layout_t *layout) {
+    emu_memory_t *memory = machine->memory;
+    memory_segment_t *segments[MAX_CHECKPOINT_SEGMENTS] = {
+        memory->text_segment, memory->data_segment, memory->stack_segment,
+        memory->heap_segment};
+    layout->n_segments = memory->heap_segment != NULL ? 4 : 3;
+    uint64_t end = offset;
+    for (uint32_t i = 0; i < layout->n_segments; i++) {
+        checkpoint_segment_t *extent = &layout->segments[i];
+        extent->first_address = segments[i]->first_address;
+        extent->last_address = segments[i]->last_address;
+        extent->offset = end;
+        end += (uint64_t)checkpoint_n_pages(extent) << PAGE_BITS;
+    }
+    layout->heap_start = memory->heap_start;
+    layout->heap_break = memory->heap_break;
+    return end;
 }
 
-void print_stack_segment(void) {
-    print_segment(stack_segment);
+bool write_memory(emu_machine_t *machine, const memory_layout_t *layout,
+                  int fd) {
+    emu_memory_t *memory = machine->memory;
+    memory_segment_t *segments[MAX_CHECKPOINT_SEGMENTS] = {
+        memory->text_segment, memory->data_segment, memory->stack_segment,
+        memory->heap_segment};
+    for (uint32_t i = 0; i < layout->n_segments; i++) {
+        const checkpoint_segment_t *extent = &layout->segments[i];
+        uint32_t n_pages = checkpoint_n_pages(extent);
+        for (uint32_t p = 0; p < n_pages; p++) {
+#ifdef EMU_GUARD_PAGES
+            const uint8_t *page = memory->guest_memory +
+                                  segment_first_page(segments[i]) +
+                                  ((uint64_t)p << PAGE_BITS);
+#else
+            const uint8_t *page = segments[i]->pages[p];
+#endif
+            if (page == NULL || all_zero(page)) {
+                continue;
+            }
+            if (pwrite(fd, page, GUEST_PAGE_SIZE,
+                       extent->offset + ((off_t)p << PAGE_BITS)) !=
+                GUEST_PAGE_SIZE) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool map_memory(emu_machine_t *machine, const memory_layout_t *layout,
+                int fd) {
+    struct stat status;
+    if (fstat(fd, &status) != 0 || layout->n_segments < 3 ||
+        layout->n_segments > MAX_CHECKPOINT_SEGMENTS ||
+        layout->heap_break < layout->heap_start) {
+        return false;
+    }
+    for (uint32_t i = 0; i < layout->n_segments; i++) {
+        const checkpoint_segment_t *extent = &layout->segments[i];
+        if (extent->first_address > extent->last_address ||
+            extent->last_address > 0x7FFFFFFF ||
+            extent->offset % GUEST_PAGE_SIZE != 0 ||
+            extent->offset + ((uint64_t)checkpoint_n_pages(extent)
+                              << PAGE_BITS) >
+                (uint64_t)status.st_size) {
+            return false;
+        }
+    }
+
+    emu_memory_t *memory = calloc(1, sizeof *memory);
+    assert(memory);
+    machine->memory = memory;
+#ifdef EMU_GUARD_PAGES
+    reserve_guest_memory(memory);
+#endif
+
+    memory_segment_t *segments[MAX_CHECKPOINT_SEGMENTS] = {NULL};
+    bool mapped = true;
+    for (uint32_t i = 0; mapped && i < layout->n_segments; i++) {
+        const checkpoint_segment_t *extent = &layout->segments[i];
+        segments[i] = create_segment(memory, extent->first_address,
+                                     extent->last_address + 1);
+        mapped = map_checkpoint_pages(memory, segments[i], extent, fd);
+    }
+    memory->text_segment = segments[0];
+    memory->data_segment = segments[1];
+    memory->stack_segment = segments[2];
+    memory->heap_segment = segments[3];
+    if (!mapped) {
+        // chain what there is, for free_program
+        for (uint32_t i = 0;
+             i + 1 < MAX_CHECKPOINT_SEGMENTS && segments[i + 1] != NULL; i++) {
+            segments[i]->next = segments[i + 1];
+        }
+        free_program(machine);
+        return false;
+    }
+    memory->heap_start = layout->heap_start;
+    memory->heap_break = layout->heap_break;
+
+    link_segments(memory);
+    memory_segment_t *text_segment = memory->text_segment;
+    decode_text(machine, (text_segment->last_address -
+                          text_segment->first_address + 1) / 4);
+    return true;
+}
+
+static uint32_t checkpoint_n_pages(const checkpoint_segment_t *segment) {
+    return ((segment->last_address + (uint64_t)3) >> PAGE_BITS) -
+           (segment->first_address >> PAGE_BITS) + 1;
+}
+
+// Maps a segment's pages from a checkpoint, where it has none of its own
+// yet.  With guard pages they go straight into the guest memory.
+static bool map_checkpoint_pages(emu_memory_t *memory,
+                                 memory_segment_t *segment,
+                                 const checkpoint_segment_t *extent, int fd) {
+    size_t length = (size_t)checkpoint_n_pages(extent) << PAGE_BITS;
+#ifdef EMU_GUARD_PAGES
+    return mmap(memory->guest_memory + segment_first_page(segment), length,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                extent->offset) != MAP_FAILED;
+#else
+    (void)memory;
+    uint8_t *bytes = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, extent->offset);
+    if (bytes == MAP_FAILED) {
+        return false;
+    }
+    segment->mapping = bytes;
+    segment->mapping_length = length;
+    for (uint32_t p = 0; p < segment->n_pages; p++) {
+        segment->pages[p] = bytes + ((size_t)p << PAGE_BITS);
+        segment->writable[p] = segment->pages[p];
+    }
+    return true;
+#endif
+}
+
+static bool all_zero(const uint8_t *page) {
+    for (uint32_t i = 0; i < GUEST_PAGE_SIZE; i++) {
+        if (page[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_text_segment(emu_machine_t *machine) {
+    print_segment(machine->memory->text_segment);
+}
+
+void print_data_segment(emu_machine_t *machine) {
+    print_segment(machine->memory->data_segment);
+}
+
+void print_stack_segment(emu_machine_t *machine) {
+    print_segment(machine->memory->stack_segment);
 }
 
 static void print_segment(memory_segment_t *segment) {
     for (uint32_t address = segment->first_address;
          address < segment->last_address; address += 4) {
-        uint32_t word = get_word(segment, address);
+        uint32_t word = segment_word(segment, address);
         uint32_t repeat_count = word_n_repeats(segment, address);
 
         if (repeat_count > 3) {
@@ -184,10 +1506,10 @@ static void print_segment(memory_segment_t *segment) {
 }
 
 static uint32_t word_n_repeats(memory_segment_t *segment, uint32_t address) {
-    uint32_t first_word = get_word(segment, address);
+    uint32_t first_word = segment_word(segment, address);
     unsigned int n_repeats = 0;
     for (uint32_t a = address + 4; a <= segment->last_address; a += 4) {
-        if (get_word(segment, a) != first_word) {
+        if (segment_word(segment, a) != first_word) {
             break;
         }
         n_repeats++;
@@ -195,16 +1517,46 @@ static uint32_t word_n_repeats(memory_segment_t *segment, uint32_t address) {
     return n_repeats;
 }
 
-static uint32_t get_word(memory_segment_t *segment, uint32_t address) {
+static uint32_t segment_word(memory_segment_t *segment, uint32_t address) {
     uint32_t word = 0;
     for (unsigned int b = 0; b < 4; b++) {
-        uint32_t byte = segment->bytes[address - segment->first_address + b];
+        uint32_t byte = *read_bytes(segment, address + b);
         word |= byte << (b * 8);
     }
     return word;
 }
 
-int get_text_segment_length(void) {
+int get_text_segment_length(emu_machine_t *machine) {
+    memory_segment_t *text_segment = machine->memory->text_segment;
     return text_segment->last_address - text_segment->first_address + 1;
 };
 
+decoded_instruction_t *get_decoded_text(emu_machine_t *machine,
+                                        uint32_t *first_address,
+                                        uint32_t *length) {
+    *first_address = machine->memory->text_segment->first_address;
+    *length = get_text_segment_length(machine);
+    return machine->memory->text_decoded;
+}
+
+uint32_t get_text_write_count(emu_machine_t *machine) {
+    return machine->memory->text_write_count;
+}
+
+void decode_text_word(emu_machine_t *machine, uint32_t address) {
+    emu_memory_t *memory = machine->memory;
+    memory_segment_t *text_segment = memory->text_segment;
+    uint32_t w = (address - text_segment->first_address) / 4;
+    STATS_TIME(machine, stats_decode,
+               decode_instruction(segment_word(text_segment, address),
+                                  &memory->text_decoded[w]);
+               fuse_word(memory, w));
+}
+
+decoded_instruction_t *get_fused_text(emu_machine_t *machine,
+                                      uint32_t *first_address,
+                                      uint32_t *length) {
+    *first_address = machine->memory->text_segment->first_address;
+    *length = get_text_segment_length(machine);
+    return machine->memory->text_fused;
+}
@@ -6,29 +6,149 @@
 //
 // // // // // // // DO NOT MODIFY THIS FILE! // // // // // // // // //
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 
+#include "decode_instruction.h"
+#include "machine.h"
+#include "program_image.h"
+
 #ifndef CS1521_ASS1__RAM_H
 #define CS1521_ASS1__RAM_H
 
 //
 // You can call these functions from `execute_instruction.c':
 //
-uint8_t get_byte(uint32_t address);
-void set_byte(uint32_t address, uint8_t value);
+uint8_t get_byte(emu_machine_t *machine, uint32_t address);
+void set_byte(emu_machine_t *machine, uint32_t address, uint8_t value);
+
+//
+// Little-endian halfword and word versions of get_byte/set_byte, which find
+// the memory with a single lookup.  Addresses don't need to be aligned.
+//
+uint16_t get_half(emu_machine_t *machine, uint32_t address);
+uint32_t get_word(emu_machine_t *machine, uint32_t address);
+void set_half(emu_machine_t *machine, uint32_t address, uint16_t value);
+void set_word(emu_machine_t *machine, uint32_t address, uint32_t value);
+
+//
+// For the sbrk syscall: moves the end of the heap, which starts at the page
+// after the data segment, on by increment bytes (rounded up to a word).
+// Returns where the end was, which is the start of the memory allocated, or
+// 0xFFFFFFFF if the heap can't grow that far (or shrink past its start).
+// The heap segment grows in 2 MiB chunks, so addresses past the end but in
+// the last chunk can be used too.
+//
+uint32_t move_heap_break(emu_machine_t *machine, int32_t increment);
+
+//
+// Calls run(machine) (e.g. execute_next_instruction), returning -1 instead
+// if the program uses an invalid address in a way that stops it.  That only
+// happens when built with -DEMU_GUARD_PAGES, otherwise invalid addresses are
+// reported and the program carries on.
+//
+int run_guarded(emu_machine_t *machine, int (*run)(emu_machine_t *machine));
+
+
+//
+// These functions are used in `machine.c' and `emu.c' --- do not call these
+// functions.
+//
+void load_program(emu_machine_t *machine, const program_image_t *image);
+void free_program(emu_machine_t *machine);
+int  execute_next_instruction(emu_machine_t *machine);
+int  execute_next_block(emu_machine_t *machine);
+void print_instruction_at_address(emu_machine_t *machine, uint32_t address);
+void print_program(emu_machine_t *machine);
+void print_program_cfg(emu_machine_t *machine);
+void print_text_segment(emu_machine_t *machine);
+void print_data_segment(emu_machine_t *machine);
+void print_stack_segment(emu_machine_t *machine);
+int get_text_segment_length(emu_machine_t *machine);
 
+//
+// Used by snapshot_machine and reset_machine in `machine.c'.  After
+// snapshot_memory, the first store to each page keeps what the page held,
+// so reset_memory can put back just the pages stored to since, and take
+// back any stack and heap grown since, in time proportional to the pages
+// stored to rather than the size of memory.
+//
+void snapshot_memory(emu_machine_t *machine);
+void reset_memory(emu_machine_t *machine);
+
+//
+// Used by `checkpoint.c' to save a machine's memory to a file and map it
+// back.  Each segment's pages, from the one holding first_address to the
+// one holding last_address + 3, are stored one after another in the file
+// from a page-aligned offset, with pages of zeros left as holes.
+//
+#define CHECKPOINT_PAGE_SIZE 4096
+#define MAX_CHECKPOINT_SEGMENTS 4
+
+typedef struct checkpoint_segment {
+    uint32_t first_address;
+    uint32_t last_address;
+    uint32_t offset;
+} checkpoint_segment_t;
+
+typedef struct memory_layout {
+    // text, data, stack, and then the heap if sbrk has been called
+    uint32_t n_segments;
+    checkpoint_segment_t segments[MAX_CHECKPOINT_SEGMENTS];
+    uint32_t heap_start;
+    uint32_t heap_break;
+} memory_layout_t;
+
+// Describes the machine's memory, with the segments' pages laid out in the
+// file from offset on.  Returns the offset of the end of the last one.
+uint64_t get_memory_layout(emu_machine_t *machine, uint32_t offset,
+                           memory_layout_t *layout);
+
+// Writes the pages where get_memory_layout said to, returning false if a
+// write fails
+bool write_memory(emu_machine_t *machine, const memory_layout_t *layout,
+                  int fd);
+
+// Instead of load_program: maps the segments' pages copy-on-write from a
+// file laid out by get_memory_layout, so they are only read (and only
+// copied when stored to) as the program uses them.  Returns false if the
+// layout doesn't make sense or the file can't be mapped.
+bool map_memory(emu_machine_t *machine, const memory_layout_t *layout,
+                int fd);
+
+
+//
+// These functions are used by the fast execution engines in `fast_execute.c'
+// and `jit.c'.
+//
+decoded_instruction_t *get_decoded_text(emu_machine_t *machine,
+                                        uint32_t *first_address,
+                                        uint32_t *length);
+void decode_text_word(emu_machine_t *machine, uint32_t address);
+
+//
+// The same as get_decoded_text, but with the first word of each assembler
+// sequence make_superinstruction() knows replaced by a superinstruction.
+// The words after them are left alone, so a branch into the middle of a
+// sequence runs the rest of it one instruction at a time.  Used by
+// `fast_execute.c'.
+//
+decoded_instruction_t *get_fused_text(emu_machine_t *machine,
+                                      uint32_t *first_address,
+                                      uint32_t *length);
+uint32_t get_text_write_count(emu_machine_t *machine);
 
 //
-// These functions are used in `emu.c' --- do not call these functions.
+// Used by the syscalls in `guest_io.c' to copy whole strings at once.
+// get_bytes returns the guest memory from address to the end of its
+// segment, and sets *length to its size, or returns NULL if address is
+// invalid.  set_bytes stores length bytes from address on like set_byte,
+// but stops at the first invalid address.
 //
-void read_program(FILE *f);
-int  execute_next_instruction(uint32_t *program_counter);
-void print_instruction_at_address(uint32_t address);
-void print_program(void);
-void print_text_segment(void);
-void print_data_segment(void);
-void print_stack_segment(void);
-int get_text_segment_length(void);
+const uint8_t *get_bytes(emu_machine_t *machine, uint32_t address,
+                         uint32_t *length);
+void set_bytes(emu_machine_t *machine, uint32_t address, const uint8_t *bytes,
+               uint32_t length);
 
 #endif // !defined(CS1521_ASS1__RAM_H)
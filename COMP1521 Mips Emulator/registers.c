@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "machine.h"
 #include "registers.h"
 
 const char *const register_name_map[] = {
@@ -22,22 +23,22 @@ const char *const register_name_map[] = {
     [fp] = "$fp",     [ra] = "$ra",
 };
 
-static uint32_t registers[N_REGISTERS] = { 0 };
-
-uint32_t get_register(register_type register_number) {
+uint32_t get_register(emu_machine_t *machine, register_type register_number) {
     assert(register_number >= 0 && register_number < N_REGISTERS);
-    return registers[register_number];
+    return machine->registers[register_number];
 }
 
-void set_register(register_type register_number, uint32_t value) {
+void set_register(emu_machine_t *machine, register_type register_number,
+                  uint32_t value) {
     assert(register_number >= 0 && register_number < N_REGISTERS);
     if (register_number != zero) {
-        registers[register_number] = value;
+        machine->registers[register_number] = value;
     }
 }
 
-void print_registers(void) {
+void print_registers(emu_machine_t *machine) {
     for (int r = 0; r < N_REGISTERS; r++) {
-        printf("R%-2d [%s] = %08X\n", r, register_name_map[r], registers[r]);
+        printf("R%-2d [%s] = %08X\n", r, register_name_map[r],
+               machine->registers[r]);
     }
 }
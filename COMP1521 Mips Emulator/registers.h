@@ -32,16 +32,20 @@ typedef enum register_type {
 //
 extern const char *const register_name_map[];
 
+// The registers belong to an emulated machine, see `machine.h'
+typedef struct emu_machine emu_machine_t;
+
 //
 // You can call these functions from `execute_instruction.c':
 //
-uint32_t get_register(register_type register_number);
-void set_register(register_type register_number, uint32_t value);
+uint32_t get_register(emu_machine_t *machine, register_type register_number);
+void set_register(emu_machine_t *machine, register_type register_number,
+                  uint32_t value);
 
 
 //
 // These functions are used in `emu.c' --- do not call these functions.
 //
-void print_registers(void);
+void print_registers(emu_machine_t *machine);
 
 #endif // !defined(CS1521_ASS1__REGISTERS_H)
@@ -0,0 +1,72 @@
+#include <sys/resource.h>
+#include <time.h>
+#include "machine.h"
+#include "stats.h"
+
+static const char *timer_names[N_STATS_TIMERS] = {
+    [stats_decode] = "decode",
+    [stats_memory] = "memory access",
+    [stats_syscall] = "syscalls",
+    [stats_translate] = "translate",
+};
+
+void start_stats(emu_machine_t *machine) {
+#ifdef EMU_STATS
+    machine->stats.start_ticks = stats_ticks();
+    machine->stats.start_seconds = stats_seconds();
+#else
+    (void)machine;
+#endif
+}
+
+void print_stats(FILE *f, emu_machine_t *machine, double seconds) {
+    fprintf(f, "instructions      %llu\n",
+            (unsigned long long)machine->instruction_count);
+    fprintf(f, "run time          %.6f s\n", seconds);
+    if (seconds > 0) {
+        fprintf(f, "instructions/s    %.0f\n",
+                machine->instruction_count / seconds);
+    }
+
+#ifdef EMU_STATS
+    emu_stats_t *stats = &machine->stats;
+    uint64_t elapsed_ticks = stats_ticks() - stats->start_ticks;
+    double elapsed_seconds = stats_seconds() - stats->start_seconds;
+    double seconds_per_tick =
+        elapsed_ticks ? elapsed_seconds / elapsed_ticks : 0;
+
+    double timed = 0;
+    for (int t = 0; t < N_STATS_TIMERS; t++) {
+        timed += stats->ticks[t] * seconds_per_tick;
+    }
+    double executing = seconds > timed ? seconds - timed : 0;
+    fprintf(f, "  %-16s%.6f s %5.1f%%\n", "execute", executing,
+            seconds > 0 ? 100 * executing / seconds : 0);
+    for (int t = 0; t < N_STATS_TIMERS; t++) {
+        double timer_seconds = stats->ticks[t] * seconds_per_tick;
+        fprintf(f, "  %-16s%.6f s %5.1f%%\n", timer_names[t], timer_seconds,
+                seconds > 0 ? 100 * timer_seconds / seconds : 0);
+    }
+    fprintf(f, "address2segment   %llu\n",
+            (unsigned long long)stats->segment_lookups);
+    fprintf(f, "page lookups      %llu\n",
+            (unsigned long long)stats->page_lookups);
+    fprintf(f, "invalid addresses %llu\n",
+            (unsigned long long)stats->invalid_addresses);
+#else
+    (void)timer_names;
+    fprintf(f, "(build with make CPPFLAGS=-DEMU_STATS for where the time "
+               "went)\n");
+#endif
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(f, "peak RSS          %ld KiB\n", usage.ru_maxrss);
+    }
+}
+
+double stats_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
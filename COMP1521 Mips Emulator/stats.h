@@ -0,0 +1,81 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters and timers for the emulator's own performance, for `emu --stats'.
+// They are only compiled in with -DEMU_STATS: otherwise struct emu_machine
+// has no stats and the macros below do nothing, so the normal build pays
+// nothing for them.
+
+// What the time spent running a program is split into.  Anything not
+// timed separately is counted as executing instructions.
+typedef enum stats_timer {
+    stats_decode,       // decoding instructions
+    stats_memory,       // loads and stores, including finding the segment
+    stats_syscall,      // syscalls, including their input and output
+    stats_translate,    // the JIT or the IR tier compiling blocks
+    N_STATS_TIMERS
+} stats_timer_t;
+
+typedef struct emu_stats {
+    // time spent in each, in stats_ticks()
+    uint64_t ticks[N_STATS_TIMERS];
+    // address2segment() calls, and accesses found through the page table
+    uint64_t segment_lookups;
+    uint64_t page_lookups;
+    uint64_t invalid_addresses;
+
+    // when the machine was created, for converting ticks to seconds
+    uint64_t start_ticks;
+    double start_seconds;
+} emu_stats_t;
+
+#ifdef EMU_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+// the time stamp counter is much cheaper to read than the clock
+static inline uint64_t stats_ticks(void) {
+    return __rdtsc();
+}
+#else
+#include <time.h>
+static inline uint64_t stats_ticks(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+#endif
+
+#define STATS_COUNT(machine, counter) ((machine)->stats.counter++)
+
+// Carries out statement, adding the time it takes to timer
+#define STATS_TIME(machine, timer, statement)                           \
+    do {                                                                \
+        uint64_t stats_start_ = stats_ticks();                          \
+        statement;                                                      \
+        (machine)->stats.ticks[timer] += stats_ticks() - stats_start_;  \
+    } while (0)
+#else
+#define STATS_COUNT(machine, counter) ((void)0)
+#define STATS_TIME(machine, timer, statement)                           \
+    do {                                                                \
+        statement;                                                      \
+    } while (0)
+#endif
+
+typedef struct emu_machine emu_machine_t;
+
+// Starts the clock the timers are measured against
+void start_stats(emu_machine_t *machine);
+
+// Prints the instructions run, how fast, where the time went (with
+// -DEMU_STATS) and the peak memory use.  seconds is how long the program
+// has been running.
+void print_stats(FILE *f, emu_machine_t *machine, double seconds);
+
+// Returns the time in seconds, for measuring how long things take
+double stats_seconds(void);
+
+#endif
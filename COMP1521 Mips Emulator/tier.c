@@ -0,0 +1,909 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+#include "ram.h"
+#include "registers.h"
+#include "decode_instruction.h"
+#include "fast_execute.h"
+#include "tier.h"
+#include "stats.h"
+
+// Use direct threading (a jump straight to the next operation's code) where
+// the compiler supports taking the address of a label, otherwise a switch
+#if defined(__GNUC__) && !defined(EMU_NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO 1
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(opcode) target_##opcode
+#define DISPATCH() goto *dispatch[op->op]
+#define NEXT() goto *dispatch[(++op)->op]
+#else
+#define TARGET(opcode) case opcode
+#define DISPATCH() continue
+#define NEXT()                                                           \
+    {                                                                    \
+        op++;                                                            \
+        continue;                                                        \
+    }
+#endif
+
+#define D (r[op->d])
+#define S (r[op->s])
+#define T (r[op->t])
+#define IMM (op->imm)
+
+// Leaves the block with the instructions after this one not run
+#define LEAVE(status, nextPc)                                            \
+    do {                                                                 \
+        machine->instruction_count -= block->nInstructions - op->executed; \
+        machine->program_counter = (nextPc);                             \
+        return (status);                                                 \
+    } while (0)
+
+// After a store or syscall, leaves the block if the program wrote to its
+// text segment, as the rest of the block may be stale (not wrapped in a
+// loop, NEXT() may be a continue)
+#define STORED()                                                         \
+    if (get_text_write_count(machine) != tier->textWriteCount) {         \
+        tier->stale = true;                                              \
+        LEAVE(0, block->address + op->executed * 4);                     \
+    }                                                                    \
+    NEXT()
+
+// How many times a block runs in the interpreter before it is compiled
+#define HOT_BLOCK_EXECUTIONS 50
+// Executions of a block the lockstep check found wrong, so it stays cold
+#define NEVER_HOT UINT32_MAX
+#define MAX_BLOCK_INSTRUCTIONS 64
+
+// IR operations.  Each writes register d from registers s and t, or from s
+// and imm in the _imm forms, except that loads and stores use the address
+// s + imm and stores write t there.  srlv and srl shift arithmetically in
+// emu, so they become ir_srav and ir_sra_imm.
+typedef enum ir_opcode {
+    ir_const,
+    ir_move,
+    // read s and t
+    ir_add, ir_sub, ir_mul, ir_and, ir_or, ir_xor, ir_slt, ir_sllv, ir_srav,
+    // read s
+    ir_add_imm, ir_mul_imm, ir_and_imm, ir_or_imm, ir_xor_imm, ir_slt_imm,
+    ir_sll_imm, ir_sra_imm,
+    ir_lb, ir_lh, ir_lw,
+    ir_sb, ir_sh, ir_sw,
+    // the syscall at word imm of the text segment
+    ir_syscall,
+    // leave the block, always the last operation
+    ir_exit,
+    N_IR_OPCODES
+} ir_opcode_t;
+
+typedef struct ir_op {
+    uint8_t op;         // ir_opcode_t
+    uint8_t d;
+    uint8_t s;
+    uint8_t t;
+    int32_t imm;
+    // for stores and syscalls, the instructions of the block run once this
+    // one has
+    uint32_t executed;
+} ir_op_t;
+
+// How a block ends
+typedef enum ir_exit {
+    exit_jump,          // to taken
+    exit_register,      // to the address in register s
+    exit_branch,        // to taken if s <condition> t (or imm), else notTaken
+} ir_exit_t;
+
+typedef enum ir_condition {
+    cond_eq, cond_ne, cond_lt, cond_ge, cond_le, cond_gt
+} ir_condition_t;
+
+typedef struct ir_block {
+    uint32_t address;
+    // MIPS instructions the block stands for, including the one ending it
+    uint32_t nInstructions;
+
+    uint8_t exit;       // ir_exit_t
+    uint8_t condition;  // ir_condition_t
+    uint8_t s;
+    uint8_t t;
+    bool compareImm;    // compare s with imm instead of t
+    int32_t imm;
+    uint32_t taken;
+    uint32_t notTaken;
+
+    uint32_t nOps;
+    ir_op_t ops[];
+} ir_block_t;
+
+// Everything the tiered engine keeps for one machine
+typedef struct tier_state {
+    decoded_instruction_t *text;
+    uint32_t textFirstAddress;
+    uint32_t textLength;
+    // times the block starting at each word of the text segment has run in
+    // the interpreter, and its compiled code once it has run enough
+    uint32_t *executions;
+    ir_block_t **blocks;
+    // get_text_write_count() when the blocks were compiled, they are stale
+    // once it changes
+    uint32_t textWriteCount;
+    // set once it has changed, the blocks are thrown away before going on
+    bool stale;
+} tier_state_t;
+
+// What a block's stores overwrote, so the lockstep check can undo them
+typedef struct store_record {
+    uint32_t address;
+    uint32_t size;
+    uint8_t before[4];
+    uint8_t after[4];
+} store_record_t;
+
+typedef struct store_log {
+    int n;
+    store_record_t records[MAX_BLOCK_INSTRUCTIONS];
+} store_log_t;
+
+// ========================== My Helper Functions ==============================
+// Both engines, with or without the lockstep check
+static int runTiers(emu_machine_t *machine, bool verify);
+static tier_state_t *startTier(emu_machine_t *machine);
+static void freeBlocks(tier_state_t *tier);
+
+
+// Runs a compiled block, and the compiled blocks after it, leaving the
+// address to go to next in machine->program_counter.  With a log, runs
+// only the one block and records what each store overwrote.  Returns 1 for
+// syscall exit, otherwise 0.
+static int runBlock(emu_machine_t *machine, tier_state_t *tier,
+                    const ir_block_t *block, store_log_t *log);
+static void logStore(emu_machine_t *machine, store_log_t *log,
+                     uint32_t address, uint32_t size);
+// Copies size bytes of guest memory, which may be on two pages, returning
+// false if any of them are invalid
+static bool copyGuest(emu_machine_t *machine, uint32_t address,
+                      uint32_t size, uint8_t *bytes);
+static uint32_t verifyBlock(emu_machine_t *machine, tier_state_t *tier,
+                            ir_block_t *block);
+
+// Translates the block starting at the given word of the text segment,
+// which mustn't be a syscall or an instruction that needs decoding.  Blocks
+// for the lockstep check end before syscalls, which can't be run twice.
+static ir_block_t *compileBlock(tier_state_t *tier, uint32_t index,
+                                bool verify);
+
+// Add the IR for one instruction to a block.  known and value hold which
+// registers have a value known at compile time, and what it is.
+static void compileMath(ir_block_t *block, const decoded_instruction_t *i,
+                        bool *known, uint32_t *value);
+static void compileMemory(ir_block_t *block, const decoded_instruction_t *i,
+                          uint32_t executed, bool *known, uint32_t *value);
+static void compileBranch(ir_block_t *block, const decoded_instruction_t *i,
+                          uint32_t pc, const bool *known,
+                          const uint32_t *value);
+static void compileJump(ir_block_t *block, const decoded_instruction_t *i,
+                        uint32_t pc, bool *known, uint32_t *value);
+
+// Add one IR operation, folding the _imm forms that don't change s into a
+// move (or nothing)
+static void emitOp(ir_block_t *block, ir_opcode_t op, int d, int s, int t,
+                   int32_t imm);
+static void emitImm(ir_block_t *block, ir_opcode_t op, int d, int s,
+                    int32_t imm);
+static void emitConst(ir_block_t *block, int d, uint32_t constant, bool *known,
+                      uint32_t *value);
+
+// Drops operations whose result is overwritten before anything reads it
+static void removeDeadWrites(ir_block_t *block);
+
+// =============================================================================
+int tier_execute_program(emu_machine_t *machine) {
+    return runTiers(machine, false);
+}
+
+int tier_verify_program(emu_machine_t *machine) {
+    return runTiers(machine, true);
+}
+
+void free_tier(emu_machine_t *machine) {
+    tier_state_t *tier = machine->tier;
+    if (tier == NULL) {
+        return;
+    }
+    freeBlocks(tier);
+    free(tier->executions);
+    free(tier->blocks);
+    free(tier);
+    machine->tier = NULL;
+}
+
+static int runTiers(emu_machine_t *machine, bool verify) {
+    if (machine->tier == NULL) {
+        machine->tier = startTier(machine);
+    }
+    tier_state_t *tier = machine->tier;
+    // compiled blocks don't count each instruction
+    if (machine->profile != NULL) {
+        return fast_execute_program(machine);
+    }
+
+    uint32_t pc = machine->program_counter;
+
+    for (;;) {
+        if (tier->stale) {
+            freeBlocks(tier);
+            tier->textWriteCount = get_text_write_count(machine);
+            tier->stale = false;
+        }
+
+        uint32_t offset = pc - tier->textFirstAddress;
+        if (offset >= tier->textLength || offset % 4 != 0) {
+            break;
+        }
+
+        uint32_t index = offset / 4;
+        uint8_t opcode = tier->text[index].opcode;
+        if (opcode == op_syscall) {
+            // blocks never start with these, the interpreter runs them
+            machine->program_counter = pc;
+            machine->instruction_count++;
+            if (execute_decoded_instruction(machine, &tier->text[index])) {
+                return 1;
+            }
+            // read_string can store into the text segment
+            tier->stale = get_text_write_count(machine) != tier->textWriteCount;
+            pc = machine->program_counter;
+            continue;
+        }
+        if (opcode == op_invalid || opcode == op_undecoded) {
+            machine->program_counter = pc;
+            int status = execute_next_instruction(machine);
+            if (status) {
+                return status;
+            }
+            tier->stale = get_text_write_count(machine) != tier->textWriteCount;
+            pc = machine->program_counter;
+            continue;
+        }
+
+        ir_block_t *block = tier->blocks[index];
+        if (block == NULL && tier->executions[index] != NEVER_HOT &&
+            ++tier->executions[index] >= HOT_BLOCK_EXECUTIONS) {
+            STATS_TIME(machine, stats_translate,
+                       block = compileBlock(tier, index, verify));
+            tier->blocks[index] = block;
+        }
+
+        if (block == NULL) {
+            machine->program_counter = pc;
+            int status = execute_next_block(machine);
+            if (status) {
+                return status;
+            }
+            tier->stale = get_text_write_count(machine) != tier->textWriteCount;
+            pc = machine->program_counter;
+        } else if (verify) {
+            pc = verifyBlock(machine, tier, block);
+            tier->stale = get_text_write_count(machine) != tier->textWriteCount;
+        } else {
+            if (runBlock(machine, tier, block, NULL)) {
+                return 1;
+            }
+            pc = machine->program_counter;
+        }
+    }
+
+    machine->program_counter = pc;
+    if (pc - tier->textFirstAddress < tier->textLength) {
+        // not word aligned, let the slow path execute it
+        return execute_next_instruction(machine);
+    }
+    return -1;
+}
+
+static tier_state_t *startTier(emu_machine_t *machine) {
+    tier_state_t *tier = calloc(1, sizeof *tier);
+    if (tier == NULL) {
+        abort();
+    }
+    tier->text = get_decoded_text(machine, &tier->textFirstAddress,
+                                  &tier->textLength);
+    tier->textWriteCount = get_text_write_count(machine);
+    tier->executions = calloc(tier->textLength / 4 + 1,
+                              sizeof *tier->executions);
+    tier->blocks = calloc(tier->textLength / 4 + 1, sizeof *tier->blocks);
+    if (tier->executions == NULL || tier->blocks == NULL) {
+        abort();
+    }
+    return tier;
+}
+
+static void freeBlocks(tier_state_t *tier) {
+    uint32_t nWords = tier->textLength / 4 + 1;
+    for (uint32_t index = 0; index < nWords; index++) {
+        free(tier->blocks[index]);
+    }
+    memset(tier->blocks, 0, nWords * sizeof *tier->blocks);
+    memset(tier->executions, 0, nWords * sizeof *tier->executions);
+}
+
+static int runBlock(emu_machine_t *machine, tier_state_t *tier,
+                    const ir_block_t *block, store_log_t *log) {
+    uint32_t *r = machine->registers;
+    const ir_op_t *op = block->ops;
+    uint32_t address;
+    uint32_t pc;
+    machine->instruction_count += block->nInstructions;
+
+#ifdef USE_COMPUTED_GOTO
+    static const void *const dispatch[N_IR_OPCODES] = {
+        [ir_const] = &&TARGET(ir_const),
+        [ir_move] = &&TARGET(ir_move),
+        [ir_add] = &&TARGET(ir_add),      [ir_sub] = &&TARGET(ir_sub),
+        [ir_mul] = &&TARGET(ir_mul),      [ir_and] = &&TARGET(ir_and),
+        [ir_or] = &&TARGET(ir_or),        [ir_xor] = &&TARGET(ir_xor),
+        [ir_slt] = &&TARGET(ir_slt),      [ir_sllv] = &&TARGET(ir_sllv),
+        [ir_srav] = &&TARGET(ir_srav),
+        [ir_add_imm] = &&TARGET(ir_add_imm),
+        [ir_mul_imm] = &&TARGET(ir_mul_imm),
+        [ir_and_imm] = &&TARGET(ir_and_imm),
+        [ir_or_imm] = &&TARGET(ir_or_imm),
+        [ir_xor_imm] = &&TARGET(ir_xor_imm),
+        [ir_slt_imm] = &&TARGET(ir_slt_imm),
+        [ir_sll_imm] = &&TARGET(ir_sll_imm),
+        [ir_sra_imm] = &&TARGET(ir_sra_imm),
+        [ir_lb] = &&TARGET(ir_lb),        [ir_lh] = &&TARGET(ir_lh),
+        [ir_lw] = &&TARGET(ir_lw),        [ir_sb] = &&TARGET(ir_sb),
+        [ir_sh] = &&TARGET(ir_sh),        [ir_sw] = &&TARGET(ir_sw),
+        [ir_syscall] = &&TARGET(ir_syscall),
+        [ir_exit] = &&TARGET(ir_exit),
+    };
+    DISPATCH();
+#else
+    for (;;) {
+        switch (op->op) {
+#endif
+
+    TARGET(ir_const): D = op->imm; NEXT();
+    TARGET(ir_move):  D = S; NEXT();
+
+    TARGET(ir_add):  D = S + T; NEXT();
+    TARGET(ir_sub):  D = S - T; NEXT();
+    TARGET(ir_mul):  D = S * T; NEXT();
+    TARGET(ir_and):  D = S & T; NEXT();
+    TARGET(ir_or):   D = S | T; NEXT();
+    TARGET(ir_xor):  D = S ^ T; NEXT();
+    TARGET(ir_slt):  D = (int32_t)S < (int32_t)T; NEXT();
+    TARGET(ir_sllv): D = T << (S & 0x1F); NEXT();
+    TARGET(ir_srav): D = (int32_t)T >> (S & 0x1F); NEXT();
+
+    TARGET(ir_add_imm): D = S + IMM; NEXT();
+    TARGET(ir_mul_imm): D = S * (uint32_t)IMM; NEXT();
+    TARGET(ir_and_imm): D = S & IMM; NEXT();
+    TARGET(ir_or_imm):  D = S | IMM; NEXT();
+    TARGET(ir_xor_imm): D = S ^ IMM; NEXT();
+    TARGET(ir_slt_imm): D = (int32_t)S < IMM; NEXT();
+    TARGET(ir_sll_imm): D = S << IMM; NEXT();
+    TARGET(ir_sra_imm): D = (int32_t)S >> IMM; NEXT();
+
+    // a load whose result isn't needed still goes to memory, into $zero,
+    // in case the address is invalid
+    TARGET(ir_lb):
+        STATS_TIME(machine, stats_memory,
+                   D = (int8_t)get_byte(machine, S + IMM));
+        r[zero] = 0;
+        NEXT();
+    TARGET(ir_lh):
+        STATS_TIME(machine, stats_memory,
+                   D = (int16_t)get_half(machine, S + IMM));
+        r[zero] = 0;
+        NEXT();
+    TARGET(ir_lw):
+        STATS_TIME(machine, stats_memory, D = get_word(machine, S + IMM));
+        r[zero] = 0;
+        NEXT();
+
+    TARGET(ir_sb):
+        address = S + IMM;
+        if (log != NULL) {
+            logStore(machine, log, address, 1);
+        }
+        STATS_TIME(machine, stats_memory, set_byte(machine, address, T));
+        STORED();
+    TARGET(ir_sh):
+        address = S + IMM;
+        if (log != NULL) {
+            logStore(machine, log, address, 2);
+        }
+        STATS_TIME(machine, stats_memory, set_half(machine, address, T));
+        STORED();
+    TARGET(ir_sw):
+        address = S + IMM;
+        if (log != NULL) {
+            logStore(machine, log, address, 4);
+        }
+        STATS_TIME(machine, stats_memory, set_word(machine, address, T));
+        STORED();
+
+    TARGET(ir_syscall):
+        machine->program_counter = block->address + (op->executed - 1) * 4;
+        if (execute_decoded_instruction(machine, &tier->text[op->imm])) {
+            // exited, with the program counter still on the syscall
+            LEAVE(1, machine->program_counter);
+        }
+        // read_string can store into the text segment
+        STORED();
+
+    TARGET(ir_exit):
+        if (block->exit == exit_jump) {
+            pc = block->taken;
+        } else if (block->exit == exit_register) {
+            pc = r[block->s];
+        } else {
+            int32_t s = r[block->s];
+            int32_t t = block->compareImm ? block->imm : (int32_t)r[block->t];
+            bool taken = false;
+            switch (block->condition) {
+                case cond_eq: taken = s == t; break;
+                case cond_ne: taken = s != t; break;
+                case cond_lt: taken = s < t; break;
+                case cond_ge: taken = s >= t; break;
+                case cond_le: taken = s <= t; break;
+                case cond_gt: taken = s > t; break;
+            }
+            pc = taken ? block->taken : block->notTaken;
+        }
+
+        // go straight on to the next block if it's compiled too (nothing
+        // but a store can make compiled code stale, and they check)
+        if (log == NULL && pc - tier->textFirstAddress < tier->textLength &&
+            pc % 4 == 0) {
+            const ir_block_t *next =
+                tier->blocks[(pc - tier->textFirstAddress) / 4];
+            if (next != NULL) {
+                block = next;
+                op = block->ops;
+                machine->instruction_count += block->nInstructions;
+                DISPATCH();
+            }
+        }
+        machine->program_counter = pc;
+        return 0;
+
+#ifndef USE_COMPUTED_GOTO
+        }
+    }
+#endif
+}
+
+static void logStore(emu_machine_t *machine, store_log_t *log,
+                     uint32_t address, uint32_t size) {
+    store_record_t *record = &log->records[log->n];
+    if (!copyGuest(machine, address, size, record->before)) {
+        // set_byte and friends report it and store nothing
+        return;
+    }
+    record->address = address;
+    record->size = size;
+    log->n++;
+}
+
+static bool copyGuest(emu_machine_t *machine, uint32_t address,
+                      uint32_t size, uint8_t *bytes) {
+    uint32_t length;
+    for (uint32_t copied = 0; copied < size; copied += length) {
+        const uint8_t *from = get_bytes(machine, address + copied, &length);
+        if (from == NULL) {
+            return false;
+        }
+        length = length < size - copied ? length : size - copied;
+        memcpy(bytes + copied, from, length);
+    }
+    return true;
+}
+
+static uint32_t verifyBlock(emu_machine_t *machine, tier_state_t *tier,
+                            ir_block_t *block) {
+    uint32_t start[N_REGISTERS];
+    memcpy(start, machine->registers, sizeof start);
+    uint64_t startCount = machine->instruction_count;
+
+    store_log_t log;
+    log.n = 0;
+    runBlock(machine, tier, block, &log);
+    uint32_t tierPc = machine->program_counter;
+    if (get_text_write_count(machine) != tier->textWriteCount) {
+        // the interpreter can't run the same instructions again
+        return tierPc;
+    }
+
+    uint32_t tierRegisters[N_REGISTERS];
+    memcpy(tierRegisters, machine->registers, sizeof tierRegisters);
+    uint64_t tierCount = machine->instruction_count;
+    for (int n = 0; n < log.n; n++) {
+        store_record_t *record = &log.records[n];
+        copyGuest(machine, record->address, record->size, record->after);
+    }
+
+    // put everything back, and run the same instructions in the interpreter
+    for (int n = log.n - 1; n >= 0; n--) {
+        set_bytes(machine, log.records[n].address, log.records[n].before,
+                  log.records[n].size);
+    }
+    memcpy(machine->registers, start, sizeof start);
+    machine->instruction_count = startCount;
+    machine->program_counter = block->address;
+    while (machine->instruction_count < tierCount &&
+           execute_next_instruction(machine) == 0) {
+    }
+
+    char problem[64] = "";
+    if (machine->instruction_count != tierCount) {
+        snprintf(problem, sizeof problem,
+                 "the interpreter stopped after %llu instructions",
+                 (unsigned long long)(machine->instruction_count - startCount));
+    } else if (machine->program_counter != tierPc) {
+        snprintf(problem, sizeof problem, "went to %08X, not %08X", tierPc,
+                 machine->program_counter);
+    }
+    for (int reg = 0; reg < N_REGISTERS && !problem[0]; reg++) {
+        if (machine->registers[reg] != tierRegisters[reg]) {
+            snprintf(problem, sizeof problem, "%s is %08X, not %08X",
+                     register_name_map[reg], tierRegisters[reg],
+                     machine->registers[reg]);
+        }
+    }
+    for (int n = 0; n < log.n && !problem[0]; n++) {
+        store_record_t *record = &log.records[n];
+        uint8_t bytes[sizeof record->after];
+        copyGuest(machine, record->address, record->size, bytes);
+        if (memcmp(bytes, record->after, record->size) != 0) {
+            snprintf(problem, sizeof problem, "stored different values at %08X",
+                     record->address);
+        }
+    }
+
+    if (problem[0]) {
+        fprintf(stderr,
+                "emu: compiled block at %08X disagrees with the "
+                "interpreter: %s\n",
+                block->address, problem);
+        uint32_t index = (block->address - tier->textFirstAddress) / 4;
+        tier->blocks[index] = NULL;
+        tier->executions[index] = NEVER_HOT;
+        free(block);
+    }
+    return machine->program_counter;
+}
+
+static ir_block_t *compileBlock(tier_state_t *tier, uint32_t index,
+                                bool verify) {
+    // one operation per instruction at most, and the exit
+    size_t maxOps = MAX_BLOCK_INSTRUCTIONS + 1;
+    ir_block_t *block = malloc(sizeof *block + maxOps * sizeof *block->ops);
+    if (block == NULL) {
+        abort();
+    }
+    uint32_t pc = tier->textFirstAddress + index * 4;
+    block->address = pc;
+    block->exit = exit_jump;
+    block->nOps = 0;
+
+    // nothing is known on the way in but $zero
+    bool known[N_REGISTERS] = {[zero] = true};
+    uint32_t value[N_REGISTERS] = {0};
+
+    // instructions in the block, including a branch or jump that ends it
+    uint32_t n;
+    for (n = 0; ; n++, index++, pc += 4) {
+        if (pc - tier->textFirstAddress >= tier->textLength ||
+            n == MAX_BLOCK_INSTRUCTIONS) {
+            block->taken = pc;
+            break;
+        }
+
+        const decoded_instruction_t *i = &tier->text[index];
+        if (i->opcode == op_syscall && !verify) {
+            // the interpreter runs it, and it can read or change anything
+            emitOp(block, ir_syscall, 0, 0, 0, index);
+            block->ops[block->nOps - 1].executed = n + 1;
+            memset(known, false, sizeof known);
+            known[zero] = true;
+            continue;
+        }
+        if (i->opcode == op_syscall || i->opcode == op_invalid ||
+            i->opcode == op_undecoded) {
+            // left for the interpreter
+            block->taken = pc;
+            break;
+        }
+
+        if (i->handler == handler_math) {
+            compileMath(block, i, known, value);
+        } else if (i->handler == handler_load_or_store) {
+            compileMemory(block, i, n + 1, known, value);
+        } else if (i->handler == handler_branch) {
+            compileBranch(block, i, pc, known, value);
+            n++;
+            break;
+        } else {
+            compileJump(block, i, pc, known, value);
+            n++;
+            break;
+        }
+    }
+
+    block->nInstructions = n;
+    removeDeadWrites(block);
+    emitOp(block, ir_exit, 0, 0, 0, 0);
+
+    ir_block_t *shrunk =
+        realloc(block, sizeof *block + block->nOps * sizeof *block->ops);
+    return shrunk != NULL ? shrunk : block;
+}
+
+static void compileMath(ir_block_t *block, const decoded_instruction_t *i,
+                        bool *known, uint32_t *value) {
+    int d = math_destination(i);
+    int s = i->s;
+    int t = i->t;
+    if (d == zero) {
+        // writes to $zero do nothing
+        return;
+    }
+
+    bool readsS = i->opcode != op_sll && i->opcode != op_srl;
+    bool readsT = i->opcode < op_addi || !readsS;
+    if ((!readsS || known[s]) && (!readsT || known[t])) {
+        emitConst(block, d, math_result(i, value[s], value[t]), known, value);
+        return;
+    }
+
+    switch (i->opcode) {
+        // commutative, so either operand can be the immediate
+        case op_add:
+        case op_mul:
+        case op_and:
+        case op_or:
+        case op_xor: {
+            static const ir_opcode_t byRegister[] = {
+                [op_add] = ir_add, [op_mul] = ir_mul, [op_and] = ir_and,
+                [op_or] = ir_or,   [op_xor] = ir_xor,
+            };
+            static const ir_opcode_t byImmediate[] = {
+                [op_add] = ir_add_imm, [op_mul] = ir_mul_imm,
+                [op_and] = ir_and_imm, [op_or] = ir_or_imm,
+                [op_xor] = ir_xor_imm,
+            };
+            if (known[t]) {
+                emitImm(block, byImmediate[i->opcode], d, s, value[t]);
+            } else if (known[s]) {
+                emitImm(block, byImmediate[i->opcode], d, t, value[s]);
+            } else {
+                emitOp(block, byRegister[i->opcode], d, s, t, 0);
+            }
+            break;
+        }
+        case op_sub:
+            if (known[t]) {
+                emitImm(block, ir_add_imm, d, s, -value[t]);
+            } else {
+                emitOp(block, ir_sub, d, s, t, 0);
+            }
+            break;
+        case op_slt:
+            if (known[t]) {
+                emitImm(block, ir_slt_imm, d, s, value[t]);
+            } else {
+                emitOp(block, ir_slt, d, s, t, 0);
+            }
+            break;
+        case op_sllv:
+        case op_srlv: {
+            ir_opcode_t byImmediate =
+                i->opcode == op_sllv ? ir_sll_imm : ir_sra_imm;
+            if (known[s]) {
+                emitImm(block, byImmediate, d, t, value[s] & 0x1F);
+            } else {
+                emitOp(block, i->opcode == op_sllv ? ir_sllv : ir_srav, d, s,
+                       t, 0);
+            }
+            break;
+        }
+        case op_addi: emitImm(block, ir_add_imm, d, s, i->imm); break;
+        case op_andi: emitImm(block, ir_and_imm, d, s, i->imm); break;
+        case op_ori: emitImm(block, ir_or_imm, d, s, i->imm); break;
+        case op_xori: emitImm(block, ir_xor_imm, d, s, i->imm); break;
+        case op_slti: emitImm(block, ir_slt_imm, d, s, i->imm); break;
+        case op_sll: emitImm(block, ir_sll_imm, d, t, i->shift); break;
+        case op_srl: emitImm(block, ir_sra_imm, d, t, i->shift); break;
+    }
+    known[d] = false;
+}
+
+static void compileMemory(ir_block_t *block, const decoded_instruction_t *i,
+                          uint32_t executed, bool *known, uint32_t *value) {
+    int s = i->s;
+    int t = i->t;
+    int32_t offset = i->imm;
+    if (i->opcode == op_lui) {
+        if (t != zero) {
+            emitConst(block, t, (uint32_t)i->imm << 16, known, value);
+        }
+        return;
+    }
+    if (known[s]) {
+        // a known base becomes an absolute address
+        offset = value[s] + (uint32_t)offset;
+        s = zero;
+    }
+
+    switch (i->opcode) {
+        case op_lb: emitOp(block, ir_lb, t, s, 0, offset); break;
+        case op_lh: emitOp(block, ir_lh, t, s, 0, offset); break;
+        case op_lw: emitOp(block, ir_lw, t, s, 0, offset); break;
+        case op_sb: emitOp(block, ir_sb, 0, s, t, offset); break;
+        case op_sh: emitOp(block, ir_sh, 0, s, t, offset); break;
+        case op_sw: emitOp(block, ir_sw, 0, s, t, offset); break;
+    }
+    if (i->opcode == op_lb || i->opcode == op_lh || i->opcode == op_lw) {
+        known[t] = t == zero;
+    } else {
+        block->ops[block->nOps - 1].executed = executed;
+    }
+}
+
+static void compileBranch(ir_block_t *block, const decoded_instruction_t *i,
+                          uint32_t pc, const bool *known,
+                          const uint32_t *value) {
+    bool compareT = i->opcode == op_beq || i->opcode == op_bne;
+    block->taken = pc + i->imm * 4;
+    block->notTaken = pc + 4;
+    if (known[i->s] && (!compareT || known[i->t])) {
+        if (!branch_taken(i, value[i->s], value[i->t])) {
+            block->taken = block->notTaken;
+        }
+        return;
+    }
+
+    block->exit = exit_branch;
+    block->s = i->s;
+    block->t = i->t;
+    block->compareImm = !compareT;
+    block->imm = 0;
+    switch (i->opcode) {
+        case op_beq: block->condition = cond_eq; break;
+        case op_bne: block->condition = cond_ne; break;
+        case op_blez: block->condition = cond_le; break;
+        case op_bgtz: block->condition = cond_gt; break;
+        case op_bltz: block->condition = cond_lt; break;
+        case op_bgez: block->condition = cond_ge; break;
+    }
+    if (!compareT) {
+        return;
+    }
+
+    if (known[i->s]) {
+        // equality doesn't care which side is which
+        block->s = i->t;
+        block->t = i->s;
+    }
+    if (known[block->t]) {
+        block->compareImm = true;
+        block->imm = value[block->t];
+    }
+
+    // slt d, a, b followed by bne d, $zero (or beq) becomes a single
+    // compare of a with b, as long as the slt didn't overwrite a or b
+    if (!block->compareImm || block->imm != 0 || block->nOps == 0) {
+        return;
+    }
+    const ir_op_t *last = &block->ops[block->nOps - 1];
+    bool isSlt = last->op == ir_slt || last->op == ir_slt_imm;
+    bool readsD = last->s == last->d ||
+                  (last->op == ir_slt && last->t == last->d);
+    if (isSlt && last->d == block->s && !readsD) {
+        block->condition = block->condition == cond_ne ? cond_lt : cond_ge;
+        block->s = last->s;
+        block->t = last->t;
+        block->compareImm = last->op == ir_slt_imm;
+        block->imm = last->imm;
+    }
+}
+
+static void compileJump(ir_block_t *block, const decoded_instruction_t *i,
+                        uint32_t pc, bool *known, uint32_t *value) {
+    if (i->opcode == op_jr) {
+        if (known[i->s]) {
+            block->taken = value[i->s];
+        } else {
+            block->exit = exit_register;
+            block->s = i->s;
+        }
+        return;
+    }
+    if (i->opcode == op_jal) {
+        emitConst(block, ra, pc + 4, known, value);
+    }
+    block->taken = jump_target(pc, i);
+}
+
+static void emitOp(ir_block_t *block, ir_opcode_t op, int d, int s, int t,
+                   int32_t imm) {
+    ir_op_t *next = &block->ops[block->nOps++];
+    next->op = op;
+    next->d = d;
+    next->s = s;
+    next->t = t;
+    next->imm = imm;
+    next->executed = 0;
+}
+
+static void emitImm(ir_block_t *block, ir_opcode_t op, int d, int s,
+                    int32_t imm) {
+    bool keepsS = imm == 0 ? op != ir_mul_imm && op != ir_and_imm &&
+                                 op != ir_slt_imm
+                  : imm == 1  ? op == ir_mul_imm
+                  : imm == -1 ? op == ir_and_imm
+                              : false;
+    if (!keepsS) {
+        emitOp(block, op, d, s, 0, imm);
+    } else if (d != s) {
+        emitOp(block, ir_move, d, s, 0, 0);
+    }
+}
+
+static void emitConst(ir_block_t *block, int d, uint32_t constant, bool *known,
+                      uint32_t *value) {
+    emitOp(block, ir_const, d, 0, 0, constant);
+    known[d] = true;
+    value[d] = constant;
+}
+
+static void removeDeadWrites(ir_block_t *block) {
+    // everything is live where the block ends, and wherever it could stop
+    // early: at a syscall, after a store to the text segment, or at a load
+    // or store of an invalid address with -DEMU_GUARD_PAGES
+    bool live[N_REGISTERS];
+    memset(live, true, sizeof live);
+    bool keep[MAX_BLOCK_INSTRUCTIONS];
+
+    for (int n = block->nOps - 1; n >= 0; n--) {
+        ir_op_t *op = &block->ops[n];
+        keep[n] = true;
+        if (op->op >= ir_sb) {
+            // stores and syscalls
+            memset(live, true, sizeof live);
+        } else if (op->op >= ir_lb) {
+            if (!live[op->d]) {
+                op->d = zero;
+            }
+            memset(live, true, sizeof live);
+        } else if (!live[op->d]) {
+            keep[n] = false;
+        } else {
+            live[op->d] = false;
+            if (op->op != ir_const) {
+                live[op->s] = true;
+            }
+            if (op->op >= ir_add && op->op <= ir_srav) {
+                live[op->t] = true;
+            }
+        }
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t n = 0; n < block->nOps; n++) {
+        if (keep[n]) {
+            block->ops[kept++] = block->ops[n];
+        }
+    }
+    block->nOps = kept;
+}
+// =============================================================================
@@ -0,0 +1,29 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+#include "machine.h"
+
+// Runs the machine's program in two tiers.  Basic blocks start out in the
+// interpreter, which counts how often each one runs.  A block that gets hot
+// is compiled to a small register IR, optimised (constants folded, dead
+// and $zero writes dropped, lui+ori and slt+bne collapsed into a constant
+// and a compare-and-branch), and run from then on.  Falls back to
+// fast_execute_program() while the machine is being profiled.  Compiled
+// blocks are thrown away when the program writes to its text segment.
+//
+// Returns the same as fast_execute_program().
+int tier_execute_program(emu_machine_t *machine);
+
+// Same as tier_execute_program(), but runs each compiled block in lockstep
+// with the interpreter: the block's stores are undone, the interpreter runs
+// the same instructions, and the registers, program counter and memory
+// stored to are compared.  A block that disagrees is reported on stderr and
+// left to the interpreter; the program carries on with the interpreter's
+// results either way.
+int tier_verify_program(emu_machine_t *machine);
+
+// Frees the blocks the tiered engine compiled for a machine
+void free_tier(emu_machine_t *machine);
+
+#endif
@@ -0,0 +1,464 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "decode_instruction.h"
+#include "machine.h"
+#include "print_instruction.h"
+#include "ram.h"
+#include "translate.h"
+
+// The text segment being translated, as the machine loaded it
+typedef struct translation {
+    FILE *out;
+    emu_machine_t *machine;
+    const decoded_instruction_t *text;
+    uint32_t first_address;
+    uint32_t n_words;
+    // which words start a basic block, and so get a label
+    bool *leaders;
+} translation_t;
+
+static bool in_text(translation_t *t, uint32_t address);
+static bool ends_block(const decoded_instruction_t *decoded);
+static void find_leaders(translation_t *t, const program_image_t *image);
+static void write_prologue(translation_t *t, const program_image_t *image,
+                           const char *source_name);
+static void write_bytes(FILE *out, const char *name, const uint8_t *bytes,
+                        uint32_t length);
+static void write_run_function(translation_t *t);
+static void write_instruction(translation_t *t, uint32_t w,
+                              uint32_t remaining);
+static void write_store(translation_t *t, uint32_t address, const char *call,
+                        const decoded_instruction_t *d, uint32_t remaining);
+static void write_branch(translation_t *t, uint32_t address,
+                         const char *condition, int32_t imm);
+static void write_goto(translation_t *t, const char *indent, uint32_t target);
+static void write_main(translation_t *t);
+
+int translate_program(const program_image_t *image, const char *source_name,
+                      const char *filename) {
+    translation_t t = {0};
+    t.machine = create_machine(image, NULL, NULL);
+    if (t.machine == NULL) {
+        perror(filename);
+        return -1;
+    }
+    uint32_t text_length;
+    t.text = get_decoded_text(t.machine, &t.first_address, &text_length);
+    t.n_words = (text_length + 3) / 4;
+    t.leaders = calloc(t.n_words + 1, sizeof *t.leaders);
+    t.out = fopen(filename, "w");
+    if (t.leaders == NULL || t.out == NULL) {
+        perror(filename);
+        free(t.leaders);
+        free_machine(t.machine);
+        return -1;
+    }
+
+    find_leaders(&t, image);
+    write_prologue(&t, image, source_name);
+    write_run_function(&t);
+    write_main(&t);
+
+    int status = 0;
+    if (ferror(t.out) | fclose(t.out)) {
+        perror(filename);
+        status = -1;
+    }
+    free(t.leaders);
+    free_machine(t.machine);
+    return status;
+}
+
+static bool in_text(translation_t *t, uint32_t address) {
+    uint32_t offset = address - t->first_address;
+    return offset / 4 < t->n_words && offset % 4 == 0;
+}
+
+// Whether the instruction can go anywhere but the next one
+static bool ends_block(const decoded_instruction_t *decoded) {
+    return decoded->handler == handler_branch ||
+           decoded->handler == handler_jump ||
+           decoded->handler == handler_syscall ||
+           decoded->handler == handler_invalid;
+}
+
+// Blocks start at the entry point, at labels (which is where jr usually
+// goes), at the targets of branches and jumps, and after each of those
+static void find_leaders(translation_t *t, const program_image_t *image) {
+    uint32_t entry = t->machine->program_counter;
+    if (in_text(t, entry)) {
+        t->leaders[(entry - t->first_address) / 4] = true;
+    }
+    for (uint32_t s = 0; s < image->n_symbols; s++) {
+        if (in_text(t, image->symbols[s].address)) {
+            t->leaders[(image->symbols[s].address - t->first_address) / 4] =
+                true;
+        }
+    }
+    for (uint32_t w = 0; w < t->n_words; w++) {
+        const decoded_instruction_t *d = &t->text[w];
+        uint32_t address = t->first_address + w * 4;
+        uint32_t target = address;
+        if (d->handler == handler_branch) {
+            target = address + d->imm * 4;
+        } else if (d->opcode == op_j || d->opcode == op_jal) {
+            target = jump_target(address, d);
+        }
+        if (in_text(t, target)) {
+            t->leaders[(target - t->first_address) / 4] = true;
+        }
+        if (ends_block(d)) {
+            t->leaders[w + 1] = true;
+        }
+    }
+    t->leaders[0] = true;
+}
+
+static void write_prologue(translation_t *t, const program_image_t *image,
+                           const char *source_name) {
+    FILE *out = t->out;
+    fprintf(out,
+            "// Translated from %s by `emu --translate'.\n"
+            "//\n"
+            "// Compile it with the emulator's sources, for example with\n"
+            "// `make prog.aot' in the emulator's directory.\n"
+            "\n"
+            "#include <stdbool.h>\n"
+            "#include <stdint.h>\n"
+            "#include <stdio.h>\n"
+            "#include <string.h>\n"
+            "#include \"emu.h\"\n"
+            "#include \"fast_execute.h\"\n"
+            "#include \"guest_io.h\"\n"
+            "#include \"machine.h\"\n"
+            "#include \"program_image.h\"\n"
+            "#include \"ram.h\"\n"
+            "#include \"registers.h\"\n"
+            "\n"
+            "#define TEXT_FIRST 0x%08Xu\n"
+            "#define TEXT_LENGTH 0x%08Xu\n"
+            "\n",
+            source_name, t->first_address, t->n_words * 4);
+
+    write_bytes(out, "text", image->text, image->text_length);
+    write_bytes(out, "data", image->data, image->data_length);
+    fprintf(out,
+            "static program_image_t image = {\n"
+            "    .text_address = 0x%08Xu,\n"
+            "    .text_length = %u,\n"
+            "    .text = text,\n"
+            "    .data_address = 0x%08Xu,\n"
+            "    .data_length = %u,\n"
+            "    .data = data,\n"
+            "};\n"
+            "\n"
+            "// carried out by the interpreter\n"
+            "static const decoded_instruction_t syscall_instruction = {\n"
+            "    .opcode = op_syscall, .handler = handler_syscall,\n"
+            "};\n"
+            "static const decoded_instruction_t invalid_instruction = {\n"
+            "    .opcode = op_invalid, .handler = handler_invalid,\n"
+            "};\n"
+            "\n",
+            image->text_address, image->text_length, image->data_address,
+            image->data_length);
+}
+
+static void write_bytes(FILE *out, const char *name, const uint8_t *bytes,
+                        uint32_t length) {
+    fprintf(out, "static uint8_t %s[] = {", name);
+    for (uint32_t i = 0; i < length; i++) {
+        fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n    " : " ", bytes[i]);
+    }
+    // an empty initializer isn't allowed
+    fprintf(out, "%s};\n\n", length == 0 ? " 0 " : "\n");
+}
+
+// Returns the same as fast_execute_program(), with 0 meaning the program has
+// modified itself and has to carry on in the interpreter
+static void write_run_function(translation_t *t) {
+    FILE *out = t->out;
+    fprintf(out,
+            "static int run_translated(emu_machine_t *machine) {\n"
+            "    uint32_t *r = machine->registers;\n"
+            "    uint32_t pc = machine->program_counter;\n"
+            "    int status;\n"
+            "\n"
+            "dispatch:\n"
+            "    switch (pc) {\n");
+    for (uint32_t w = 0; w < t->n_words; w++) {
+        if (t->leaders[w]) {
+            uint32_t address = t->first_address + w * 4;
+            fprintf(out, "    case 0x%08Xu: goto L_%08X;\n", address, address);
+        }
+    }
+    fprintf(out,
+            "    }\n"
+            "    // not the start of a block: leave the text segment, or run\n"
+            "    // one instruction in the interpreter and look again\n"
+            "    machine->program_counter = pc;\n"
+            "    if (pc - TEXT_FIRST >= TEXT_LENGTH) {\n"
+            "        return -1;\n"
+            "    }\n"
+            "    status = execute_next_instruction(machine);\n"
+            "    if (status != 0) {\n"
+            "        return status;\n"
+            "    }\n"
+            "    if (get_text_write_count(machine) != 0) {\n"
+            "        return 0;\n"
+            "    }\n"
+            "    pc = machine->program_counter;\n"
+            "    goto dispatch;\n");
+
+    for (uint32_t w = 0; w < t->n_words; w++) {
+        if (t->leaders[w]) {
+            uint32_t n = 1;
+            while (w + n < t->n_words && !t->leaders[w + n]) {
+                n++;
+            }
+            fprintf(out, "\nL_%08X:\n", t->first_address + w * 4);
+            fprintf(out, "    machine->instruction_count += %u;\n", n);
+            for (uint32_t i = 0; i < n; i++) {
+                write_instruction(t, w + i, n - i - 1);
+            }
+        }
+    }
+    // falling off the end of the text segment
+    fprintf(out,
+            "    pc = 0x%08Xu;\n"
+            "    goto dispatch;\n"
+            "}\n"
+            "\n",
+            t->first_address + t->n_words * 4);
+}
+
+// The C for one instruction, with the instruction as a comment
+static void write_instruction(translation_t *t, uint32_t w,
+                              uint32_t remaining) {
+    FILE *out = t->out;
+    const decoded_instruction_t *d = &t->text[w];
+    uint32_t address = t->first_address + w * 4;
+    char text[INSTRUCTION_TEXT_SIZE];
+    format_instruction(get_word(t->machine, address), text);
+    fprintf(out, "    // [%08X] %s\n", address, text);
+
+    // register writes are dropped when they are to $zero
+    int s = d->s;
+    int dest = d->handler == handler_math && d->opcode != op_addi &&
+                       d->opcode != op_andi && d->opcode != op_ori &&
+                       d->opcode != op_xori && d->opcode != op_slti
+                   ? d->d
+                   : d->t;
+    if (dest == 0 && (d->handler == handler_math || d->opcode == op_lui)) {
+        return;
+    }
+    // loads from an invalid address are still reported
+    char write[16] = "(void)";
+    if (dest != 0) {
+        snprintf(write, sizeof write, "r[%d] = ", dest);
+    }
+    int32_t imm = d->imm;
+
+    switch (d->opcode) {
+        case op_add:
+            fprintf(out, "    %sr[%d] + r[%d];\n", write, s, d->t);
+            break;
+        case op_sub:
+            fprintf(out, "    %sr[%d] - r[%d];\n", write, s, d->t);
+            break;
+        case op_mul:
+            fprintf(out, "    %sr[%d] * r[%d];\n", write, s, d->t);
+            break;
+        case op_and:
+            fprintf(out, "    %sr[%d] & r[%d];\n", write, s, d->t);
+            break;
+        case op_or:
+            fprintf(out, "    %sr[%d] | r[%d];\n", write, s, d->t);
+            break;
+        case op_xor:
+            fprintf(out, "    %sr[%d] ^ r[%d];\n", write, s, d->t);
+            break;
+        case op_slt:
+            fprintf(out, "    %s(int32_t)r[%d] < (int32_t)r[%d];\n", write, s,
+                    d->t);
+            break;
+        case op_sllv:
+            fprintf(out, "    %sr[%d] << (r[%d] & 0x1F);\n", write, d->t, s);
+            break;
+        case op_srlv:
+            // arithmetic, like mathOps()
+            fprintf(out, "    %s(int32_t)r[%d] >> (r[%d] & 0x1F);\n", write,
+                    d->t, s);
+            break;
+        case op_addi:
+            fprintf(out, "    %sr[%d] + %d;\n", write, s, imm);
+            break;
+        case op_andi:
+            fprintf(out, "    %sr[%d] & %d;\n", write, s, imm);
+            break;
+        case op_ori:
+            fprintf(out, "    %sr[%d] | %d;\n", write, s, imm);
+            break;
+        case op_xori:
+            fprintf(out, "    %sr[%d] ^ %d;\n", write, s, imm);
+            break;
+        case op_slti:
+            fprintf(out, "    %s(int32_t)r[%d] < %d;\n", write, s, imm);
+            break;
+        case op_sll:
+            fprintf(out, "    %sr[%d] << %d;\n", write, d->t, d->shift);
+            break;
+        case op_srl:
+            fprintf(out, "    %s(int32_t)r[%d] >> %d;\n", write, d->t,
+                    d->shift);
+            break;
+        case op_lui:
+            fprintf(out, "    %s0x%08Xu;\n", write, (uint32_t)imm << 16);
+            break;
+        case op_lb:
+            fprintf(out, "    %s(int8_t)get_byte(machine, r[%d] + %d);\n",
+                    write, s, imm);
+            break;
+        case op_lh:
+            fprintf(out, "    %s(int16_t)get_half(machine, r[%d] + %d);\n",
+                    write, s, imm);
+            break;
+        case op_lw:
+            fprintf(out, "    %sget_word(machine, r[%d] + %d);\n", write, s,
+                    imm);
+            break;
+        case op_sb:
+            write_store(t, address, "set_byte", d, remaining);
+            break;
+        case op_sh:
+            write_store(t, address, "set_half", d, remaining);
+            break;
+        case op_sw:
+            write_store(t, address, "set_word", d, remaining);
+            break;
+        case op_beq:
+            fprintf(out, "    if (r[%d] == r[%d]) {\n", s, d->t);
+            write_branch(t, address, NULL, imm);
+            break;
+        case op_bne:
+            fprintf(out, "    if (r[%d] != r[%d]) {\n", s, d->t);
+            write_branch(t, address, NULL, imm);
+            break;
+        case op_blez:
+            write_branch(t, address, "<= 0", imm);
+            break;
+        case op_bgtz:
+            write_branch(t, address, "> 0", imm);
+            break;
+        case op_bltz:
+            write_branch(t, address, "< 0", imm);
+            break;
+        case op_bgez:
+            write_branch(t, address, ">= 0", imm);
+            break;
+        case op_jal:
+            fprintf(out, "    r[31] = 0x%08Xu;\n", address + 4);
+            write_goto(t, "    ", jump_target(address, d));
+            break;
+        case op_j:
+            write_goto(t, "    ", jump_target(address, d));
+            break;
+        case op_jr:
+            fprintf(out, "    pc = r[%d];\n    goto dispatch;\n", s);
+            break;
+        case op_syscall:
+            fprintf(out,
+                    "    machine->program_counter = 0x%08Xu;\n"
+                    "    if (execute_decoded_instruction(machine, "
+                    "&syscall_instruction)) {\n"
+                    "        return 1;\n"
+                    "    }\n"
+                    // read_string can write to the text segment
+                    "    if (get_text_write_count(machine) != 0) {\n"
+                    "        return 0;\n"
+                    "    }\n",
+                    address);
+            break;
+        default:
+            fprintf(out,
+                    "    machine->program_counter = 0x%08Xu;\n"
+                    "    return execute_decoded_instruction(machine, "
+                    "&invalid_instruction);\n",
+                    address);
+            break;
+    }
+}
+
+// Stores that write to the text segment leave the translated code, which
+// no longer matches the program
+static void write_store(translation_t *t, uint32_t address, const char *call,
+                        const decoded_instruction_t *d, uint32_t remaining) {
+    fprintf(t->out,
+            "    %s(machine, r[%d] + %d, r[%d]);\n"
+            "    if (get_text_write_count(machine) != 0) {\n",
+            call, d->s, d->imm, d->t);
+    if (remaining > 0) {
+        fprintf(t->out, "        machine->instruction_count -= %u;\n",
+                remaining);
+    }
+    fprintf(t->out,
+            "        machine->program_counter = 0x%08Xu;\n"
+            "        return 0;\n"
+            "    }\n",
+            address + 4);
+}
+
+// A branch to address + imm * 4, comparing $s with 0 unless the caller has
+// started the if statement already
+static void write_branch(translation_t *t, uint32_t address,
+                         const char *condition, int32_t imm) {
+    const decoded_instruction_t *d =
+        &t->text[(address - t->first_address) / 4];
+    if (condition != NULL) {
+        fprintf(t->out, "    if ((int32_t)r[%d] %s) {\n", d->s, condition);
+    }
+    write_goto(t, "        ", address + imm * 4);
+    fprintf(t->out, "    }\n");
+}
+
+// Goes straight to the block at target if there is one, or looks it up
+static void write_goto(translation_t *t, const char *indent, uint32_t target) {
+    if (in_text(t, target) && t->leaders[(target - t->first_address) / 4]) {
+        fprintf(t->out, "%sgoto L_%08X;\n", indent, target);
+    } else {
+        fprintf(t->out, "%spc = 0x%08Xu;\n%sgoto dispatch;\n", indent, target,
+                indent);
+    }
+}
+
+static void write_main(translation_t *t) {
+    fprintf(t->out,
+            "// Runs the program like `emu -E', and with -r prints the\n"
+            "// registers afterwards like `emu -e'\n"
+            "int main(int argc, char *argv[]) {\n"
+            "    bool registers = argc > 1 && strcmp(argv[1], \"-r\") == 0;\n"
+            "    emu_machine_t *machine = create_machine(&image, stdin, "
+            "stdout);\n"
+            "    if (machine == NULL) {\n"
+            "        perror(argv[0]);\n"
+            "        return 1;\n"
+            "    }\n"
+            "    map_input(machine);\n"
+            "\n"
+            "    int status = run_guarded(machine, run_translated);\n"
+            "    while (status == 0) {\n"
+            "        status = run_guarded(machine, fast_execute_program);\n"
+            "    }\n"
+            "\n"
+            "    // the exit syscall ends the program without the registers\n"
+            "    if (registers && !machine->exited) {\n"
+            "        flush_output(machine);\n"
+            "        print_registers(machine);\n"
+            "    }\n"
+            "    free_machine(machine);\n"
+            "    return 0;\n"
+            "}\n");
+}
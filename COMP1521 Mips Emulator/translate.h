@@ -0,0 +1,23 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include "program_image.h"
+
+// Translates a program to a C file that runs it without decoding anything,
+// for compiling ahead of time with the emulator's sources (see `make
+// prog.aot' in emu.mk).
+//
+// Every basic block of the text segment becomes a labelled block of C
+// working on the machine's registers, with memory accessed through `ram.h',
+// static branches and jumps going straight to their label, and jr going
+// through a switch on the address.  Syscalls and invalid instructions are
+// carried out by execute_decoded_instruction(), so the program behaves just
+// as it does in emu: the compiled program prints what `emu -E' prints, and
+// with -r also prints the registers afterwards like `emu -e'.  A program
+// that writes to its own text segment carries on in the fast interpreter.
+//
+// Returns 0 on success, or prints why not and returns -1.
+int translate_program(const program_image_t *image, const char *source_name,
+                      const char *filename);
+
+#endif